@@ -51,7 +51,7 @@ bUseRegexp(false)
 
 void ADLSearch::Prepare(StringMap& params) {
     // Prepare quick search of substrings
-    stringSearchList.clear();
+    stringSearch.clear();
     #ifdef USE_PCRE
     if(searchString.find("$Re:") == 0){
         regexpstring.clear();
@@ -66,8 +66,8 @@ void ADLSearch::Prepare(StringMap& params) {
         StringTokenizer<string> st(stringParams, ' ');
         for(StringIter i = st.getTokens().begin(); i != st.getTokens().end(); ++i) {
             if(!i->empty()) {
-                // Add substring search
-                stringSearchList.push_back(StringSearch(*i));
+                // Add substring search; words past MultiStringSearch::MAX_PATTERNS are ignored
+                stringSearch.add(*i);
             }
         }
     #ifdef USE_PCRE
@@ -181,12 +181,10 @@ bool ADLSearch::SearchAll(const string& s) {
     } else {
     #endif
     // Match all substrings
-        for(StringSearch::List::iterator i = stringSearchList.begin(); i != stringSearchList.end(); ++i) {
-            if(!i->match(s)) {
-                return false;
-            }
-        }
-        return !stringSearchList.empty();
+        if(stringSearch.empty())
+            return false;
+        MultiStringSearch::Mask all = stringSearch.getAll();
+        return stringSearch.match(s) == all;
     #ifdef USE_PCRE
     }
     #endif
@@ -449,6 +447,13 @@ void ADLSearchManager::matchListing(DirectoryListing& aDirList) noexcept {
     if (BOOLSETTING(USE_ADL_ONLY_OWN_LIST) && params["userCID"] != ClientManager::getInstance()->getMe()->getCID().toBase32())
         return;
 
+    // Don't go through (and load) the whole listing for nothing
+    bool active = false;
+    for(auto i = collection.begin(); i != collection.end() && !active; ++i)
+        active = i->isActive;
+    if(!active)
+        return;
+
     setUser(aDirList.getUser());
 
     DestDirList destDirs;
@@ -462,6 +467,7 @@ void ADLSearchManager::matchListing(DirectoryListing& aDirList) noexcept {
 }
 
 void ADLSearchManager::matchRecurse(DestDirList &aDestList, DirectoryListing::Directory* aDir, string &aPath) {
+    aDir->load();
     for(DirectoryListing::Directory::Iter dirIt = aDir->directories.begin(); dirIt != aDir->directories.end(); ++dirIt) {
         string tmpPath = aPath + "\\" + (*dirIt)->getName();
         MatchesDirectory(aDestList, *dirIt, tmpPath);
@@ -25,7 +25,7 @@
 
 #include "Util.h"
 #include "SettingsManager.h"
-#include "StringSearch.h"
+#include "MultiStringSearch.h"
 #include "Singleton.h"
 #include "DirectoryListing.h"
 
@@ -89,8 +89,8 @@ private:
     //decide if regexp should be used
     bool bUseRegexp;
     string regexpstring;
-    // Substring searches
-    StringSearch::List stringSearchList;
+    // Substring searches, all of them have to match
+    MultiStringSearch stringSearch;
     bool SearchAll(const string& s);
 };
 
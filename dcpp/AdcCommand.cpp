@@ -23,17 +23,86 @@
 
 namespace dcpp {
 
-AdcCommand::AdcCommand(uint32_t aCmd, char aType /* = TYPE_CLIENT */) : cmdInt(aCmd), from(0), type(aType) { }
-AdcCommand::AdcCommand(uint32_t aCmd, const uint32_t aTarget, char aType) : cmdInt(aCmd), from(0), to(aTarget), type(aType) { }
-AdcCommand::AdcCommand(Severity sev, Error err, const string& desc, char aType /* = TYPE_CLIENT */) : cmdInt(CMD_STA), from(0), type(aType) {
+AdcCommand::AdcCommand(uint32_t aCmd, char aType /* = TYPE_CLIENT */) : allBuilt(true), serializedAs(SERIALIZED_NONE), cmdInt(aCmd), from(0), type(aType) { }
+AdcCommand::AdcCommand(uint32_t aCmd, const uint32_t aTarget, char aType) : allBuilt(true), serializedAs(SERIALIZED_NONE), cmdInt(aCmd), from(0), to(aTarget), type(aType) { }
+AdcCommand::AdcCommand(Severity sev, Error err, const string& desc, char aType /* = TYPE_CLIENT */) : allBuilt(true), serializedAs(SERIALIZED_NONE), cmdInt(CMD_STA), from(0), type(aType) {
     addParam((sev == SEV_SUCCESS) ? "000" : Util::toString(sev * 100 + err));
     addParam(desc);
 }
 
-AdcCommand::AdcCommand(const string& aLine, bool nmdc /* = false */) : cmdInt(0), type(TYPE_CLIENT) {
+AdcCommand::AdcCommand(const string& aLine, bool nmdc /* = false */) : allBuilt(true), serializedAs(SERIALIZED_NONE), cmdInt(0), type(TYPE_CLIENT) {
     parse(aLine, nmdc);
 }
 
+namespace {
+
+/** Throw if a parameter has an invalid escape, so that unescaping it later can't fail */
+void checkEscapes(const char* buf, string::size_type len, bool nmdc) {
+    for(const char* p = buf, *end = buf + len; (p = static_cast<const char*>(memchr(p, '\\', end - p))) != NULL; p += 2) {
+        if(p + 1 == end)
+            throw ParseException("Escape at eol");
+        if(p[1] != 's' && p[1] != 'n' && p[1] != '\\' && !(p[1] == ' ' && nmdc))
+            throw ParseException("Unknown escape");
+    }
+}
+
+/** Store a parameter, unescaping it only if it has escapes at all */
+void unescape(const char* buf, string::size_type len, bool nmdc, string& out) {
+    const char* esc = static_cast<const char*>(memchr(buf, '\\', len));
+    if(!esc) {
+        out.assign(buf, len);
+        return;
+    }
+
+    out.reserve(len);
+    out.assign(buf, esc - buf);
+    for(string::size_type i = esc - buf; i < len; ++i) {
+        if(buf[i] != '\\') {
+            out += buf[i];
+            continue;
+        }
+
+        ++i;
+        if(i == len)
+            throw ParseException("Escape at eol");
+        if(buf[i] == 's')
+            out += ' ';
+        else if(buf[i] == 'n')
+            out += '\n';
+        else if(buf[i] == '\\')
+            out += '\\';
+        else if(buf[i] == ' ' && nmdc)  // $ADCGET escaping, leftover from old specs
+            out += ' ';
+        else
+            throw ParseException("Unknown escape");
+    }
+}
+
+/** @return The end of the parameter starting at i */
+string::size_type findEnd(const char* buf, string::size_type i, string::size_type len, bool nmdc) {
+    const char* begin = buf + i;
+    const char* end = buf + len;
+    for(const char* p = begin; ; ) {
+        const char* sp = static_cast<const char*>(memchr(p, ' ', end - p));
+        if(!sp)
+            return len;
+
+        if(nmdc) {
+            // $ADCGET escapes spaces as "\ "; the space is escaped if an odd number of backslashes precedes it
+            const char* b = sp;
+            while(b != begin && b[-1] == '\\')
+                --b;
+            if((sp - b) % 2) {
+                p = sp + 1;
+                continue;
+            }
+        }
+        return sp - buf;
+    }
+}
+
+}
+
 void AdcCommand::parse(const string& aLine, bool nmdc /* = false */) {
     string::size_type i = 5;
 
@@ -64,87 +133,65 @@ void AdcCommand::parse(const string& aLine, bool nmdc /* = false */) {
         from = HUB_SID;
     }
 
-    string::size_type len = aLine.length();
-    const char* buf = aLine.c_str();
-    string cur;
-    cur.reserve(128);
+    // Parameters of an earlier line point into it
+    buildAll();
+    for(auto p = views.begin(); p != views.end(); ++p) {
+        p->plain = false;
+    }
+    line = aLine;
+
+    const string::size_type len = line.length();
+    const char* buf = line.c_str();
 
     bool toSet = false;
     bool featureSet = false;
     bool fromSet = nmdc; // $ADCxxx never have a from CID...
 
+    // Parameters stay in the line; they're checked now but unescaped only once used
+    size_t count = parameters.size() + std::count(buf + min(i, len), buf + len, ' ') + 1;
+    views.reserve(count);
+    parameters.reserve(count);
+    string cur;
     while(i < len) {
-        switch(buf[i]) {
-        case '\\':
-            ++i;
-            if(i == len)
-                throw ParseException("Escape at eol");
-            if(buf[i] == 's')
-                cur += ' ';
-            else if(buf[i] == 'n')
-                cur += '\n';
-            else if(buf[i] == '\\')
-                cur += '\\';
-            else if(buf[i] == ' ' && nmdc)  // $ADCGET escaping, leftover from old specs
-                cur += ' ';
-            else
-                throw ParseException("Unknown escape");
+        string::size_type end = findEnd(buf, i, len, nmdc);
+        // An empty parameter counts, except at the end of the line
+        if(end == len && end == i)
             break;
-        case ' ':
-            // New parameter...
-            {
-                if((type == TYPE_BROADCAST || type == TYPE_DIRECT || type == TYPE_ECHO || type == TYPE_FEATURE) && !fromSet) {
-                    if(cur.length() != 4) {
-                        throw ParseException("Invalid SID length");
-                    }
-                    from = toSID(cur);
-                    fromSet = true;
-                } else if((type == TYPE_DIRECT || type == TYPE_ECHO) && !toSet) {
-                    if(cur.length() != 4) {
-                        throw ParseException("Invalid SID length");
-                    }
-                    to = toSID(cur);
-                    toSet = true;
-                } else if(type == TYPE_FEATURE && !featureSet) {
-                    if(cur.length() % 5 != 0) {
-                        throw ParseException("Invalid feature length");
-                    }
-                    // Skip...
-                    featureSet = true;
-                } else {
-                    parameters.push_back(cur);
-                }
-                cur.clear();
-            }
-            break;
-        default:
-            cur += buf[i];
-        }
-        ++i;
-    }
-    if(!cur.empty()) {
+
         if((type == TYPE_BROADCAST || type == TYPE_DIRECT || type == TYPE_ECHO || type == TYPE_FEATURE) && !fromSet) {
+            unescape(buf + i, end - i, nmdc, cur);
             if(cur.length() != 4) {
                 throw ParseException("Invalid SID length");
             }
             from = toSID(cur);
             fromSet = true;
         } else if((type == TYPE_DIRECT || type == TYPE_ECHO) && !toSet) {
+            unescape(buf + i, end - i, nmdc, cur);
             if(cur.length() != 4) {
                 throw ParseException("Invalid SID length");
             }
             to = toSID(cur);
             toSet = true;
         } else if(type == TYPE_FEATURE && !featureSet) {
+            unescape(buf + i, end - i, nmdc, cur);
             if(cur.length() % 5 != 0) {
                 throw ParseException("Invalid feature length");
             }
             // Skip...
             featureSet = true;
         } else {
-            parameters.push_back(cur);
+            checkEscapes(buf + i, end - i, nmdc);
+
+            Param p = { static_cast<uint32_t>(i), static_cast<uint32_t>(end - i), false, nmdc, false };
+            p.plain = !memchr(buf + i, '\\', end - i) && !memchr(buf + i, '\n', end - i);
+            views.push_back(p);
+            parameters.push_back(string());
+            allBuilt = false;
         }
+        i = end + 1;
     }
+    index.clear();
+    serializedAs = SERIALIZED_NONE;
 
     if((type == TYPE_BROADCAST || type == TYPE_DIRECT || type == TYPE_ECHO || type == TYPE_FEATURE) && !fromSet) {
         throw ParseException("Missing from_sid");
@@ -160,29 +207,51 @@ void AdcCommand::parse(const string& aLine, bool nmdc /* = false */) {
 }
 
 string AdcCommand::toString(const CID& aCID) const {
-    return getHeaderString(aCID) + getParamString(false);
+    string tmp = getHeaderString(aCID);
+    appendParams(tmp, false);
+    return tmp;
 }
 
 string AdcCommand::toString(uint32_t sid /* = 0 */, bool nmdc /* = false */) const {
-    return getHeaderString(sid, nmdc) + getParamString(nmdc);
+    string tmp = getHeaderString(sid, nmdc);
+    appendParams(tmp, nmdc);
+    return tmp;
+}
+
+void AdcCommand::preserialize(bool nmdc /* = false */) const {
+    string tmp;
+    appendParams(tmp, nmdc);
 }
 
 string AdcCommand::escape(const string& str, bool old) {
-    string tmp = str;
-    string::size_type i = 0;
-    while( (i = tmp.find_first_of(" \n\\", i)) != string::npos) {
+    string tmp;
+    escape(str, old, tmp);
+    return tmp;
+}
+
+void AdcCommand::escape(const string& str, bool old, string& out) {
+    const char* p = str.data();
+    const char* end = p + str.size();
+    while(p != end) {
+        const char* e = p;
+        while(e != end && *e != ' ' && *e != '\n' && *e != '\\')
+            ++e;
+        out.append(p, e);
+        if(e == end)
+            break;
+
+        out += '\\';
         if(old) {
-            tmp.insert(i, "\\");
+            out += *e;
         } else {
-            switch(tmp[i]) {
-                case ' ': tmp.replace(i, 1, "\\s"); break;
-                case '\n': tmp.replace(i, 1, "\\n"); break;
-                case '\\': tmp.replace(i, 1, "\\\\"); break;
+            switch(*e) {
+                case ' ': out += 's'; break;
+                case '\n': out += 'n'; break;
+                case '\\': out += '\\'; break;
             }
         }
-        i+=2;
+        p = e + 1;
     }
-    return tmp;
 }
 
 string AdcCommand::getHeaderString(uint32_t sid, bool nmdc) const {
@@ -223,41 +292,148 @@ string AdcCommand::getHeaderString(const CID& cid) const {
     return tmp;
 }
 
-string AdcCommand::getParamString(bool nmdc) const {
-    string tmp;
-    for(auto i = getParameters().begin(); i != getParameters().end(); ++i) {
-        tmp += ' ';
-        tmp += escape(*i, nmdc);
+void AdcCommand::appendParams(string& tmp, bool nmdc) const {
+    int as = nmdc ? SERIALIZED_NMDC : SERIALIZED_ADC;
+    if(serializedAs != as) {
+        size_t n = 0;
+        for(size_t i = 0; i < views.size(); ++i) {
+            n += max(static_cast<size_t>(views[i].len), parameters[i].size()) + 1;
+        }
+        // Escapes are rare enough that making room for a few of them will do
+        serialized.clear();
+        serialized.reserve(n + 16);
+
+        for(size_t i = 0; i < views.size(); ++i) {
+            serialized += ' ';
+            appendParam(i, nmdc, serialized);
+        }
+        serializedAs = as;
     }
+
+    tmp.reserve(tmp.size() + serialized.size() + 1);
+    tmp += serialized;
     if(nmdc) {
         tmp += '|';
     } else {
         tmp += '\n';
     }
-    return tmp;
+}
+
+void AdcCommand::appendParam(size_t n, bool nmdc, string& out) const {
+    const Param& p = views[n];
+    if(p.plain) {
+        // Nothing to escape, so it's the same as in the line
+        out.append(line, p.pos, p.len);
+    } else {
+        build(n);
+        escape(parameters[n], nmdc, out);
+    }
+}
+
+AdcCommand& AdcCommand::addParam(const string& str) {
+    Param p = { 0, 0, false, false, true };
+    views.push_back(p);
+    parameters.push_back(str);
+
+    // Keep the index and the serialized form rather than redoing them for each added parameter
+    if(!index.empty()) {
+        auto entry = make_pair(getCode(parameters.size() - 1), static_cast<uint32_t>(parameters.size() - 1));
+        index.insert(upper_bound(index.begin(), index.end(), entry), entry);
+    }
+    if(serializedAs != SERIALIZED_NONE) {
+        serialized += ' ';
+        escape(str, serializedAs == SERIALIZED_NMDC, serialized);
+    }
+    return *this;
+}
+
+AdcCommand& AdcCommand::eraseParam(size_t n) {
+    if(n < parameters.size()) {
+        views.erase(views.begin() + n);
+        parameters.erase(parameters.begin() + n);
+        index.clear();
+        serializedAs = SERIALIZED_NONE;
+    }
+    return *this;
+}
+
+void AdcCommand::build(size_t n) const {
+    const Param& p = views[n];
+    if(!p.built) {
+        unescape(line.data() + p.pos, p.len, p.nmdc, parameters[n]);
+        p.built = true;
+    }
+}
+
+void AdcCommand::buildAll() const {
+    if(!allBuilt) {
+        for(size_t i = 0; i < views.size(); ++i) {
+            build(i);
+        }
+        allBuilt = true;
+    }
+}
+
+uint16_t AdcCommand::getCode(size_t n) const {
+    const Param& p = views[n];
+    char code[2] = { 0, 0 };
+    if(!p.built && (p.len < 1 || line[p.pos] != '\\') && (p.len < 2 || line[p.pos + 1] != '\\')) {
+        // The name has no escapes, so it can be read from the line
+        memcpy(code, line.data() + p.pos, min(p.len, 2u));
+    } else {
+        build(n);
+        memcpy(code, parameters[n].data(), min(parameters[n].size(), (size_t)2));
+    }
+    return toCode(code);
+}
+
+size_t AdcCommand::findParam(const char* name, size_t start) const {
+    if(index.empty() && !parameters.empty()) {
+        index.reserve(parameters.size());
+        for(size_t i = 0; i < parameters.size(); ++i) {
+            index.push_back(make_pair(getCode(i), static_cast<uint32_t>(i)));
+        }
+        sort(index.begin(), index.end());
+    }
+
+    auto i = lower_bound(index.begin(), index.end(), make_pair(toCode(name), static_cast<uint32_t>(start)));
+    if(i != index.end() && i->first == toCode(name))
+        return i->second;
+    return string::npos;
 }
 
 const string& AdcCommand::getParam(size_t n) const {
-    return getParameters().size() > n ? getParameters()[n] : Util::emptyString;
+    if(n >= parameters.size())
+        return Util::emptyString;
+    build(n);
+    return parameters[n];
 }
 
 bool AdcCommand::getParam(const char* name, size_t start, string& ret) const {
-    for(auto i = start; i < getParameters().size(); ++i) {
-        if(toCode(name) == toCode(getParameters()[i].c_str())) {
-            ret = getParameters()[i].substr(2);
-            return true;
-        }
+    size_t i = findParam(name, start);
+    if(i == string::npos)
+        return false;
+
+    const Param& p = views[i];
+    if(!p.built && p.plain) {
+        ret.assign(line, p.pos + 2, p.len - 2);
+    } else {
+        build(i);
+        ret = parameters[i].substr(2);
     }
-    return false;
+    return true;
 }
 
 bool AdcCommand::hasFlag(const char* name, size_t start) const {
-    for(auto i = start; i < getParameters().size(); ++i) {
-        if(toCode(name) == toCode(getParameters()[i].c_str()) &&
-            getParameters()[i].size() == 3 &&
-            getParameters()[i][2] == '1')
-        {
-            return true;
+    for(size_t i = findParam(name, start); i != string::npos; i = findParam(name, i + 1)) {
+        const Param& p = views[i];
+        if(!p.built && p.plain) {
+            if(p.len == 3 && line[p.pos + 2] == '1')
+                return true;
+        } else {
+            build(i);
+            if(parameters[i].size() == 3 && parameters[i][2] == '1')
+                return true;
         }
     }
     return false;
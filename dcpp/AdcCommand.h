@@ -130,21 +130,23 @@ public:
     const string& getFeatures() const { return features; }
     AdcCommand& setFeatures(const string& feat) { features = feat; return *this; }
 
-    StringList& getParameters() { return parameters; }
-    const StringList& getParameters() const { return parameters; }
+    /** All parameters, unescaped */
+    const StringList& getParameters() const { buildAll(); return parameters; }
+    size_t getParamCount() const { return parameters.size(); }
 
     string toString(const CID& aCID) const;
     string toString(uint32_t sid, bool nmdc = false) const;
+    /**
+     * Serialize the parameters now; copies of the command keep them serialized and only add the
+     * parameters added to them, so that a command sent to several targets is escaped once.
+     */
+    void preserialize(bool nmdc = false) const;
 
     AdcCommand& addParam(const string& name, const string& value) {
-        parameters.push_back(name);
-        parameters.back() += value;
-        return *this;
-    }
-    AdcCommand& addParam(const string& str) {
-        parameters.push_back(str);
-        return *this;
+        return addParam(name + value);
     }
+    AdcCommand& addParam(const string& str);
+    AdcCommand& eraseParam(size_t n);
     const string& getParam(size_t n) const;
     /** Return a named parameter where the name is a two-letter code */
     bool getParam(const char* name, size_t start, string& ret) const;
@@ -154,6 +156,8 @@ public:
     bool operator==(uint32_t aCmd) { return cmdInt == aCmd; }
 
     static string escape(const string& str, bool old);
+    /** Append str escaped to out */
+    static void escape(const string& str, bool old, string& out);
     uint32_t getTo() const { return to; }
     AdcCommand& setTo(const uint32_t sid) { to = sid; return *this; }
     uint32_t getFrom() const { return from; }
@@ -161,10 +165,45 @@ public:
     static uint32_t toSID(const string& aSID) { return *reinterpret_cast<const uint32_t*>(aSID.data()); }
     static string fromSID(const uint32_t aSID) { return string(reinterpret_cast<const char*>(&aSID), sizeof(aSID)); }
 private:
+    /**
+     * Where a parameter of a parsed line is; it's unescaped into parameters only when first used.
+     * Added parameters are built from the start.
+     */
+    struct Param {
+        uint32_t pos;
+        uint32_t len;
+        /** No escapes and no newlines, so the line holds the parameter in its serialized form */
+        bool plain;
+        /** Whether the line was in the $ADCxxx form, whose escapes differ */
+        bool nmdc;
+        mutable bool built;
+    };
+
     string getHeaderString(const CID& cid) const;
     string getHeaderString(uint32_t sid, bool nmdc) const;
-    string getParamString(bool nmdc) const;
-    StringList parameters;
+    void appendParams(string& tmp, bool nmdc) const;
+    void appendParam(size_t n, bool nmdc, string& out) const;
+
+    void build(size_t n) const;
+    void buildAll() const;
+    uint16_t getCode(size_t n) const;
+    /** @return Index of the first parameter from start on with the two-letter code of name, string::npos if none */
+    size_t findParam(const char* name, size_t start) const;
+
+    /** The parsed line, which the views point into */
+    string line;
+    vector<Param> views;
+    mutable StringList parameters;
+    mutable bool allBuilt;
+
+    /** Parameters by two-letter code and position, built by the first lookup by name */
+    mutable vector<pair<uint16_t, uint32_t> > index;
+
+    /** Serialized parameters, so that a command sent to several targets is escaped only once */
+    mutable string serialized;
+    enum { SERIALIZED_NONE, SERIALIZED_ADC, SERIALIZED_NMDC };
+    mutable int serializedAs;
+
     string features;
     union {
         char cmdChar[4];
@@ -138,7 +138,7 @@ void AdcHub::clearUsers() {
 }
 
 void AdcHub::handle(AdcCommand::INF, AdcCommand& c) noexcept {
-    if(c.getParameters().empty())
+    if(c.getParamCount() == 0)
         return;
 
     string cid;
@@ -241,7 +241,7 @@ void AdcHub::handle(AdcCommand::SID, AdcCommand& c) noexcept {
         return;
     }
 
-    if(c.getParameters().empty())
+    if(c.getParamCount() == 0)
         return;
 
     sid = AdcCommand::toSID(c.getParam(0));
@@ -251,7 +251,7 @@ void AdcHub::handle(AdcCommand::SID, AdcCommand& c) noexcept {
 }
 
 void AdcHub::handle(AdcCommand::MSG, AdcCommand& c) noexcept {
-    if(c.getParameters().empty())
+    if(c.getParamCount() == 0)
         return;
 
         ChatMessage message = { c.getParam(0), findUser(c.getFrom()) };
@@ -279,7 +279,7 @@ void AdcHub::handle(AdcCommand::MSG, AdcCommand& c) noexcept {
 }
 
 void AdcHub::handle(AdcCommand::GPA, AdcCommand& c) noexcept {
-    if(c.getParameters().empty())
+    if(c.getParamCount() == 0)
         return;
     salt = c.getParam(0);
     state = STATE_VERIFY;
@@ -338,7 +338,7 @@ void AdcHub::handle(AdcCommand::CTM, AdcCommand& c) noexcept {
     OnlineUser* u = findUser(c.getFrom());
     if(!u || u->getUser() == ClientManager::getInstance()->getMe())
         return;
-    if(c.getParameters().size() < 3)
+    if(c.getParamCount() < 3)
         return;
 
     const string& protocol = c.getParam(0);
@@ -364,7 +364,7 @@ void AdcHub::handle(AdcCommand::CTM, AdcCommand& c) noexcept {
 }
 
 void AdcHub::handle(AdcCommand::RCM, AdcCommand& c) noexcept {
-    if(c.getParameters().size() < 2) {
+    if(c.getParamCount() < 2) {
         return;
     }
 
@@ -402,7 +402,7 @@ void AdcHub::handle(AdcCommand::RCM, AdcCommand& c) noexcept {
 }
 
 void AdcHub::handle(AdcCommand::CMD, AdcCommand& c) noexcept {
-    if(c.getParameters().empty())
+    if(c.getParamCount() == 0)
         return;
     const string& name = c.getParam(0);
     bool rem = c.hasFlag("RM", 1);
@@ -456,7 +456,7 @@ void AdcHub::sendUDP(const AdcCommand& cmd) noexcept {
 }
 
 void AdcHub::handle(AdcCommand::STA, AdcCommand& c) noexcept {
-    if(c.getParameters().size() < 2)
+    if(c.getParamCount() < 2)
         return;
 
     OnlineUser* u = c.getFrom() == AdcCommand::HUB_SID ? &getUser(c.getFrom(), CID()) : findUser(c.getFrom());
@@ -533,8 +533,8 @@ void AdcHub::handle(AdcCommand::PSR, AdcCommand& c) noexcept {
 }
 
 void AdcHub::handle(AdcCommand::GET, AdcCommand& c) noexcept {
-    if(c.getParameters().size() < 5) {
-        if(c.getParameters().size() > 0) {
+    if(c.getParamCount() < 5) {
+        if(c.getParamCount() > 0) {
             if(c.getParam(0) == "blom") {
                 send(AdcCommand(AdcCommand::SEV_FATAL, AdcCommand::ERROR_PROTOCOL_GENERIC,
                         "Too few parameters for blom", AdcCommand::TYPE_HUB));
@@ -594,7 +594,7 @@ void AdcHub::handle(AdcCommand::NAT, AdcCommand& c) noexcept {
         return;
 
     OnlineUser* u = findUser(c.getFrom());
-    if(!u || u->getUser() == ClientManager::getInstance()->getMe() || c.getParameters().size() < 3)
+    if(!u || u->getUser() == ClientManager::getInstance()->getMe() || c.getParamCount() < 3)
         return;
 
     const string& protocol = c.getParam(0);
@@ -628,7 +628,7 @@ void AdcHub::handle(AdcCommand::RNT, AdcCommand& c) noexcept {
         return;
 
     OnlineUser* u = findUser(c.getFrom());
-    if(!u || u->getUser() == ClientManager::getInstance()->getMe() || c.getParameters().size() < 3)
+    if(!u || u->getUser() == ClientManager::getInstance()->getMe() || c.getParamCount() < 3)
         return;
 
     const string& protocol = c.getParam(0);
@@ -1044,7 +1044,7 @@ void AdcHub::info(bool /*alwaysSend*/) {
 
     addParam(lastInfoMap, c, "SU", su);
 
-    if(!c.getParameters().empty()) {
+    if(c.getParamCount() != 0) {
         send(c);
     }
 }
@@ -0,0 +1,65 @@
+/*
+ * Copyright (C) 2001-2012 Jacek Sieka, arnetheduck on gmail point com
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#pragma once
+
+#include "typedefs.h"
+
+#include <boost/noncopyable.hpp>
+
+namespace dcpp {
+
+/**
+ * Bump allocator for many small objects that die together: memory is carved out of large chunks,
+ * which are only freed when the arena is destroyed. The arena doesn't run any destructors.
+ */
+class Arena : boost::noncopyable {
+public:
+    explicit Arena(size_t aChunkSize = 1024*1024) : chunkSize(aChunkSize), pos(NULL), end(NULL) { }
+    ~Arena() {
+        for(auto i = chunks.begin(); i != chunks.end(); ++i)
+            delete[] *i;
+    }
+
+    void* allocate(size_t n) {
+        n = (n + ALIGN - 1) & ~(ALIGN - 1);
+        if(static_cast<size_t>(end - pos) < n)
+            grow(n);
+        void* p = pos;
+        pos += n;
+        return p;
+    }
+
+private:
+    enum { ALIGN = 16 };
+
+    void grow(size_t n) {
+        // Whatever is left of the current chunk is wasted
+        size_t s = max(n, chunkSize);
+        pos = new uint8_t[s];
+        end = pos + s;
+        chunks.push_back(pos);
+    }
+
+    size_t chunkSize;
+    uint8_t* pos;
+    uint8_t* end;
+    vector<uint8_t*> chunks;
+};
+
+} // namespace dcpp
@@ -21,6 +21,11 @@
 #include "BZUtils.h"
 #include "Exception.h"
 #include "format.h"
+#include "Thread.h"
+#include "Semaphore.h"
+#include "CriticalSection.h"
+#include "SettingsManager.h"
+#include "Pointer.h"
 
 namespace dcpp {
 
@@ -103,4 +108,481 @@ bool UnBZFilter::operator()(const void* in, size_t& insize, void* out, size_t& o
     return err == BZ_OK;
 }
 
+/**
+ * Runs the pieces of a parallel filter on a few threads. The filter takes the results in the order
+ * it handed out the pieces; a piece that no thread has taken yet when its result is needed is run
+ * by the filter's thread itself.
+ */
+class BZJobs {
+public:
+    struct Job {
+        enum State { QUEUED, RUNNING, DONE };
+
+        Job() : state(QUEUED) { }
+        virtual ~Job() { }
+        virtual void run() = 0;
+
+        State state;
+    };
+
+    BZJobs(int aThreads) : next(0), stopping(false) {
+        for(int i = 0; i < aThreads; ++i) {
+            workers.push_back(unique_ptr<Worker>(new Worker(*this)));
+            try {
+                workers.back()->start();
+            } catch(const ThreadException& e) {
+                dcdebug("BZJobs: %s\n", e.getError().c_str());
+                workers.pop_back();
+                break;
+            }
+        }
+    }
+
+    ~BZJobs() {
+        {
+            Lock l(cs);
+            stopping = true;
+        }
+        for(size_t i = 0; i < workers.size(); ++i) {
+            s.signal();
+        }
+        for(auto i = workers.begin(); i != workers.end(); ++i) {
+            (*i)->join();
+        }
+        for_each(jobs.begin(), jobs.end(), DeleteFunction());
+    }
+
+    void push(Job* aJob) {
+        Lock l(cs);
+        jobs.push_back(aJob);
+        s.signal();
+    }
+
+    bool empty() const { Lock l(cs); return jobs.empty(); }
+    /** Whether enough pieces are under way to keep the threads busy */
+    bool full() const { Lock l(cs); return jobs.size() >= 2 * max(workers.size(), (size_t)1); }
+
+    /** @return The oldest job once it's done, NULL if it isn't and aWait is false */
+    Job* front(bool aWait) {
+        for(;;) {
+            Job* j = NULL;
+            {
+                Lock l(cs);
+                if(jobs.empty())
+                    return NULL;
+                if(jobs.front()->state == Job::DONE)
+                    return jobs.front();
+                if(!aWait)
+                    return NULL;
+                if(jobs.front()->state == Job::QUEUED) {
+                    j = jobs.front();
+                    j->state = Job::RUNNING;
+                    next++;
+                }
+            }
+
+            if(j) {
+                j->run();
+                Lock l(cs);
+                j->state = Job::DONE;
+                return j;
+            }
+            done.wait();
+        }
+    }
+
+    /** Delete the oldest job, which must be done */
+    void pop() {
+        Lock l(cs);
+        dcassert(jobs.front()->state == Job::DONE);
+        delete jobs.front();
+        jobs.pop_front();
+        next--;
+    }
+
+private:
+    class Worker : public Thread {
+    public:
+        Worker(BZJobs& aJobs) : jobs(aJobs) { }
+        virtual int run() {
+            setThreadName("BZJobs");
+            jobs.work();
+            return 0;
+        }
+    private:
+        BZJobs& jobs;
+    };
+
+    void work() {
+        for(;;) {
+            s.wait();
+            Job* j;
+            {
+                Lock l(cs);
+                if(stopping)
+                    return;
+                // The job this signal was for may have been run by the filter already
+                if(next == jobs.size())
+                    continue;
+                j = jobs[next++];
+                j->state = Job::RUNNING;
+            }
+
+            j->run();
+
+            {
+                Lock l(cs);
+                j->state = Job::DONE;
+            }
+            done.signal();
+        }
+    }
+
+    mutable CriticalSection cs;
+    /** One signal per job, plus one per thread to stop */
+    Semaphore s;
+    /** One signal per job done by a thread */
+    Semaphore done;
+    std::deque<Job*> jobs;
+    /** The first job no one has taken yet; jobs are taken in order */
+    size_t next;
+    bool stopping;
+    vector<unique_ptr<Worker> > workers;
+};
+
+namespace {
+
+const uint64_t BLOCK_MAGIC = 0x314159265359ULL;
+const uint64_t EOS_MAGIC = 0x177245385090ULL;
+
+/** Input of a piece: even if run-length encoding makes it 5/4 as big, it fits one 900k block */
+const size_t CHUNK_SIZE = 700*1000;
+
+inline uint32_t getBit(const string& s, uint64_t pos) {
+    return ((uint8_t)s[pos >> 3] >> (7 - (pos & 7))) & 1;
+}
+
+uint64_t getBits(const string& s, uint64_t pos, int n) {
+    uint64_t ret = 0;
+    for(int i = 0; i < n; ++i) {
+        ret = (ret << 1) | getBit(s, pos + i);
+    }
+    return ret;
+}
+
+void putMagic(BZBitWriter& w, uint64_t magic) {
+    w.put(magic >> 24, 24);
+    w.put(magic & 0xffffff, 24);
+}
+
+int getThreads() {
+    return max(SETTING(BZIP2_THREADS), 1);
+}
+
+class CompressJob : public BZJobs::Job {
+public:
+    CompressJob(string& aIn) : ok(false) { in.swap(aIn); }
+
+    virtual void run() {
+        unsigned int len = in.size() + in.size() / 100 + 600;
+        out.resize(len);
+        ok = BZ2_bzBuffToBuffCompress(&out[0], &len, &in[0], in.size(), 9, 0, 30) == BZ_OK;
+        out.resize(len);
+        string().swap(in);
+    }
+
+    string in;
+    string out;
+    bool ok;
+};
+
+class DecompressJob : public BZJobs::Job {
+public:
+    DecompressJob(string& aIn, uint64_t aBegin) : begin(aBegin), ok(false) { in.swap(aIn); }
+
+    virtual void run() {
+        bz_stream zs;
+        memset(&zs, 0, sizeof(zs));
+        if(BZ2_bzDecompressInit(&zs, 0, 0) != BZ_OK)
+            return;
+
+        zs.next_in = &in[0];
+        zs.avail_in = in.size();
+        size_t pos = 0;
+        int err;
+        do {
+            out.resize(pos + 1024*1024);
+            zs.next_out = &out[pos];
+            zs.avail_out = out.size() - pos;
+            err = BZ2_bzDecompress(&zs);
+            pos = out.size() - zs.avail_out;
+        } while(err == BZ_OK && zs.avail_out == 0);
+        out.resize(pos);
+
+        ok = err == BZ_STREAM_END;
+        BZ2_bzDecompressEnd(&zs);
+        string().swap(in);
+    }
+
+    string in;
+    string out;
+    /** Where the block is in the input */
+    uint64_t begin;
+    bool ok;
+};
+
+}
+
+void BZBitWriter::copy(const string& src, uint64_t aBegin, uint64_t aEnd) {
+    for(; aBegin < aEnd && (aBegin & 7); ++aBegin)
+        put(getBit(src, aBegin), 1);
+    for(; aEnd - aBegin >= 8; aBegin += 8)
+        put((uint8_t)src[aBegin >> 3], 8);
+    for(; aBegin < aEnd; ++aBegin)
+        put(getBit(src, aBegin), 1);
+}
+
+ParallelBZFilter::ParallelBZFilter() : jobs(new BZJobs(getThreads())), ready("BZh9"), readyPos(0), writer(ready), crc(0), finished(false), ended(false) {
+    chunk.reserve(CHUNK_SIZE);
+}
+
+ParallelBZFilter::~ParallelBZFilter() {
+}
+
+bool ParallelBZFilter::operator()(const void* in, size_t& insize, void* out, size_t& outsize) {
+    if(outsize == 0)
+        return 0;
+
+    const char* ip = (const char*)in;
+    size_t used = 0;
+    bool full = false;
+    if(insize == 0) {
+        if(!finished) {
+            if(!chunk.empty())
+                submit();
+            finished = true;
+        }
+    } else {
+        while(used < insize) {
+            if(chunk.size() == CHUNK_SIZE) {
+                if(jobs->full()) {
+                    full = true;
+                    break;
+                }
+                submit();
+            }
+            size_t n = min(insize - used, CHUNK_SIZE - chunk.size());
+            chunk.append(ip + used, n);
+            used += n;
+        }
+    }
+
+    // Only wait for the threads when there's nothing else to do
+    collect(readyPos == ready.size() && (full || finished));
+
+    size_t n = min(outsize, ready.size() - readyPos);
+    memcpy(out, ready.data() + readyPos, n);
+    readyPos += n;
+    if(readyPos == ready.size()) {
+        ready.clear();
+        readyPos = 0;
+    } else if(readyPos > 1024*1024) {
+        ready.erase(0, readyPos);
+        readyPos = 0;
+    }
+
+    insize = used;
+    outsize = n;
+    return !ended || readyPos != ready.size();
+}
+
+void ParallelBZFilter::submit() {
+    jobs->push(new CompressJob(chunk));
+    chunk.reserve(CHUNK_SIZE);
+}
+
+void ParallelBZFilter::collect(bool aWait) {
+    CompressJob* j;
+    while((j = static_cast<CompressJob*>(jobs->front(aWait))) != NULL) {
+        // Piece: header (32 bits), the block, end of stream magic (48), CRC (32) and padding
+        const string& s = j->out;
+        if(!j->ok || s.size() < 14)
+            throw Exception(_("Error during compression"));
+
+        uint32_t blockCrc = getBits(s, 80, 32);
+        uint64_t bits = s.size() * 8;
+        uint64_t end = 0;
+        for(int pad = 0; pad < 8 && !end; ++pad) {
+            uint64_t pos = bits - pad - 80;
+            if(getBits(s, pos, 48) == EOS_MAGIC && getBits(s, pos + 48, 32) == blockCrc)
+                end = pos;
+        }
+        if(!end)
+            throw Exception(_("Error during compression"));
+
+        writer.copy(s, 32, end);
+        crc = ((crc << 1) | (crc >> 31)) ^ blockCrc;
+
+        jobs->pop();
+        aWait = false;
+    }
+
+    if(finished && !ended && jobs->empty()) {
+        putMagic(writer, EOS_MAGIC);
+        writer.put(crc, 32);
+        writer.flush();
+        ended = true;
+    }
+}
+
+ParallelUnBZFilter::ParallelUnBZFilter() : jobs(new BZJobs(getThreads())), level(0), scanPos(32), shift(0), blockStart(0),
+    ended(false), readyPos(0), produced(0), serialInPos(0), skip(0)
+{
+}
+
+ParallelUnBZFilter::~ParallelUnBZFilter() {
+}
+
+bool ParallelUnBZFilter::operator()(const void* in, size_t& insize, void* out, size_t& outsize) {
+    if(outsize == 0)
+        return 0;
+
+    bool eof = insize == 0;
+    input.append((const char*)in, insize);
+
+    if(!serial) {
+        if(level == 0 && input.size() >= 4) {
+            if(input.compare(0, 3, "BZh") != 0 || input[3] < '1' || input[3] > '9')
+                throw Exception(_("Error during decompression"));
+            level = input[3];
+        }
+
+        if(level != 0)
+            scan();
+        submit();
+
+        if(readyPos == ready.size()) {
+            if(eof && !ended && jobs->empty() && blocks.empty())
+                throw Exception(_("Error during decompression"));
+            collect(eof || ended || jobs->full());
+        }
+    }
+
+    if(serial && readyPos == ready.size()) {
+        // The blocks before the failed one were given out already; decode them again and drop them
+        while(skip > 0) {
+            size_t n = input.size() - serialInPos;
+            if(n == 0 && !eof) {
+                outsize = 0;
+                return true;
+            }
+
+            size_t m = static_cast<size_t>(min(static_cast<uint64_t>(outsize), skip));
+            bool more = (*serial)(input.data() + serialInPos, n, out, m);
+            serialInPos += n;
+            skip -= m;
+            if(!more) {
+                outsize = 0;
+                return false;
+            }
+        }
+
+        size_t n = input.size() - serialInPos;
+        if(n == 0 && !eof) {
+            outsize = 0;
+            return true;
+        }
+
+        bool more = (*serial)(input.data() + serialInPos, n, out, outsize);
+        serialInPos += n;
+        return more;
+    }
+
+    size_t n = min(outsize, ready.size() - readyPos);
+    memcpy(out, ready.data() + readyPos, n);
+    readyPos += n;
+    if(readyPos == ready.size()) {
+        ready.clear();
+        readyPos = 0;
+    }
+
+    outsize = n;
+    return serial || !ended || !jobs->empty() || !blocks.empty() || readyPos != ready.size();
+}
+
+void ParallelUnBZFilter::scan() {
+    const uint64_t end = input.size() * 8;
+    for(; scanPos < end && !ended; ++scanPos) {
+        shift = ((shift << 1) | getBit(input, scanPos)) & 0xffffffffffffULL;
+        if(scanPos < 32 + 47)
+            continue;
+
+        uint64_t magic = scanPos - 47;
+        if(shift == BLOCK_MAGIC) {
+            if(blockStart)
+                blocks.push_back(make_pair(blockStart, magic));
+            blockStart = magic;
+        } else if(shift == EOS_MAGIC) {
+            if(blockStart)
+                blocks.push_back(make_pair(blockStart, magic));
+            blockStart = 0;
+            ended = true;
+        }
+    }
+}
+
+string ParallelUnBZFilter::makeStream(uint64_t aBegin, uint64_t aEnd) const {
+    string ret("BZh");
+    ret += level;
+    BZBitWriter w(ret);
+    w.copy(input, aBegin, aEnd);
+    putMagic(w, EOS_MAGIC);
+    // A stream of one block has the block's CRC as combined CRC
+    w.put(getBits(input, aBegin + 48, 32), 32);
+    w.flush();
+    return ret;
+}
+
+void ParallelUnBZFilter::submit() {
+    while(!blocks.empty() && !jobs->full()) {
+        string s = makeStream(blocks.front().first, blocks.front().second);
+        jobs->push(new DecompressJob(s, blocks.front().first));
+        blocks.pop_front();
+    }
+}
+
+void ParallelUnBZFilter::collect(bool aWait) {
+    DecompressJob* j;
+    while((j = static_cast<DecompressJob*>(jobs->front(aWait))) != NULL) {
+        if(!j->ok) {
+            fallBack(j->begin);
+            return;
+        }
+
+        produced += j->out.size();
+        if(readyPos == ready.size()) {
+            ready.swap(j->out);
+            readyPos = 0;
+        } else {
+            ready += j->out;
+        }
+        jobs->pop();
+        submit();
+        aWait = false;
+    }
+}
+
+void ParallelUnBZFilter::fallBack(uint64_t aBegin) {
+    dcdebug("ParallelUnBZFilter: falling back at bit %llu\n", (unsigned long long)aBegin);
+    while(jobs->front(true)) {
+        jobs->pop();
+    }
+    blocks.clear();
+
+    // The combined CRC at the end covers all blocks, so the stream can only be checked as a whole
+    serial.reset(new UnBZFilter);
+    serialInPos = 0;
+    skip = produced;
+}
+
 } // namespace dcpp
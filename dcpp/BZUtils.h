@@ -20,8 +20,15 @@
 
 #include <bzlib.h>
 
+#include <deque>
+#include <memory>
+#include <string>
+
 namespace dcpp {
 
+using std::string;
+using std::unique_ptr;
+
 class BZFilter {
 public:
     BZFilter();
@@ -56,4 +63,104 @@ private:
     bz_stream zs;
 };
 
+class BZJobs;
+
+/** Writes a stream bit by bit, the way bzip2 lays out its blocks */
+class BZBitWriter {
+public:
+    BZBitWriter(string& aOut) : out(aOut), acc(0), bits(0) { }
+
+    /** Append the n (at most 32) lowest bits of value */
+    void put(uint32_t value, int n) {
+        acc = (acc << n) | (value & (n == 32 ? 0xffffffff : ((1u << n) - 1)));
+        bits += n;
+        while(bits >= 8) {
+            bits -= 8;
+            out += (char)(uint8_t)(acc >> bits);
+        }
+        acc &= (1u << bits) - 1;
+    }
+    /** Append the bits [aBegin, aEnd) of src */
+    void copy(const string& src, uint64_t aBegin, uint64_t aEnd);
+    /** Pad the last byte with zeroes */
+    void flush() {
+        if(bits > 0)
+            put(0, 8 - bits);
+    }
+
+private:
+    string& out;
+    uint64_t acc;
+    int bits;
+};
+
+/**
+ * Compresses like BZFilter, on several threads: the input is cut into pieces that fit a bzip2 block
+ * each, the pieces are compressed on their own, and their blocks are stitched together bit by bit
+ * into one ordinary bzip2 stream.
+ */
+class ParallelBZFilter {
+public:
+    ParallelBZFilter();
+    ~ParallelBZFilter();
+    /** @see BZFilter::operator() */
+    bool operator()(const void* in, size_t& insize, void* out, size_t& outsize);
+private:
+    void submit();
+    void collect(bool aWait);
+
+    unique_ptr<BZJobs> jobs;
+    string chunk;
+    /** Output not handed out yet */
+    string ready;
+    size_t readyPos;
+    BZBitWriter writer;
+    /** Combined CRC of the blocks */
+    uint32_t crc;
+    bool finished;
+    bool ended;
+};
+
+/**
+ * Decompresses like UnBZFilter, on several threads: blocks are found by their magic number and
+ * each one is decompressed as a stream of its own. Should a block not decompress (the magic number
+ * may also turn up inside a block), the rest is decompressed in one go by an UnBZFilter.
+ */
+class ParallelUnBZFilter {
+public:
+    ParallelUnBZFilter();
+    ~ParallelUnBZFilter();
+    /** @see UnBZFilter::operator() */
+    bool operator()(const void* in, size_t& insize, void* out, size_t& outsize);
+private:
+    void scan();
+    void submit();
+    void collect(bool aWait);
+    void fallBack(uint64_t aBegin);
+    string makeStream(uint64_t aBegin, uint64_t aEnd) const;
+
+    unique_ptr<BZJobs> jobs;
+    /** All input so far */
+    string input;
+    char level;
+    uint64_t scanPos;
+    uint64_t shift;
+    /** Start of the block being scanned, 0 if none */
+    uint64_t blockStart;
+    /** Blocks found but not handed to the threads yet */
+    std::deque<std::pair<uint64_t, uint64_t> > blocks;
+    bool ended;
+
+    string ready;
+    size_t readyPos;
+    /** Output of the blocks decompressed so far */
+    uint64_t produced;
+
+    /** Used once a block failed; decodes the whole input again from its start */
+    unique_ptr<UnBZFilter> serial;
+    size_t serialInPos;
+    /** Output of the serial filter that was already given out from the blocks */
+    uint64_t skip;
+};
+
 } // namespace dcpp
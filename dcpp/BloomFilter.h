@@ -28,7 +28,8 @@ public:
     BloomFilter(size_t tableSize) { table.resize(tableSize); }
     ~BloomFilter() { }
 
-    void add(const string& s) {xadd(s, N); }
+    void add(const string& s) {xadd(s.data(), s.length(), N); }
+    void add(const char* s, size_t len) { xadd(s, len, N); }
     bool match(const StringList& s) const {
         for(auto i = s.begin(); i != s.end(); ++i) {
             if(!match(*i))
@@ -40,7 +41,7 @@ public:
         if(s.length() >= N) {
             string::size_type l = s.length() - N;
             for(string::size_type i = 0; i <= l; ++i) {
-                if(!table[getPos(s, i, N)]) {
+                if(!table[getPos(s.data(), i, N)]) {
                     return false;
                 }
             }
@@ -63,9 +64,9 @@ public:
     }
 #endif
 private:
-    void xadd(const string& s, size_t n) {
-        if(s.length() >= n) {
-            string::size_type l = s.length() - n;
+    void xadd(const char* s, size_t len, size_t n) {
+        if(len >= n) {
+            string::size_type l = len - n;
             for(string::size_type i = 0; i <= l; ++i) {
                 table[getPos(s, i, n)] = true;
             }
@@ -73,10 +74,10 @@ private:
     }
 
     /* This is roughly how boost::hash does it */
-    size_t getPos(const string& s, size_t i, size_t l) const {
+    size_t getPos(const char* s, size_t i, size_t l) const {
         size_t h = 0;
-        const char* c = s.data() + i;
-        const char* end = s.data() + i + l;
+        const char* c = s + i;
+        const char* end = s + i + l;
         for(; c < end; ++c) {
             h ^= *c + 0x9e3779b9 + (h<<6) + (h>>2);
         }
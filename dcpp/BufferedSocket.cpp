@@ -37,7 +37,8 @@ namespace dcpp {
 
 BufferedSocket::BufferedSocket(char aSeparator) :
 separator(aSeparator), mode(MODE_LINE), dataBytes(0), rollback(0), state(STARTING),
-disconnecting(false)
+disconnecting(false), reactor(false), throttled(false), readPending(false), sendPos(0), sendFile(NULL),
+filePos(0), fileWriteSize(0), fileSockSize(0), fileDone(false)
 {
     start();
 
@@ -171,38 +172,32 @@ void BufferedSocket::threadAccept() {
     }
 }
 
-void BufferedSocket::threadRead() {
+bool BufferedSocket::threadRead() {
     if(state != RUNNING)
-        return;
+        return false;
 
-    int left = (mode == MODE_DATA) ? ThrottleManager::getInstance()->read(sock.get(), &inbuf[0], (int)inbuf.size()) : sock->read(&inbuf[0], (int)inbuf.size());
+    int left = (mode == MODE_DATA) ? ThrottleManager::getInstance()->read(sock.get(), &inbuf[0], (int)inbuf.size(), reactor ? &throttled : NULL) : sock->read(&inbuf[0], (int)inbuf.size());
     if(left == -1) {
         // EWOULDBLOCK, no data received...
-        return;
+        return false;
     } else if(left == 0) {
         // This socket has been closed...
         throw SocketException(_("Connection closed"));
     }
-    string::size_type pos = 0;
-    // always uncompressed data
-    string l;
     int bufpos = 0, total = left;
 
     while (left > 0) {
         switch (mode) {
             case MODE_ZPIPE: {
-                    const int BUF_SIZE = 1024;
-                    // Special to autodetect nmdc connections...
-                    string::size_type pos = 0;
+                    const int BUF_SIZE = 64*1024;
                     boost::scoped_array<char> buffer(new char[BUF_SIZE]);
-                    l = line;
-                    // decompress all input data and store in l.
+                    // decompress all input data, splitting lines as it comes out
                     while (left) {
                         size_t in = BUF_SIZE;
                         size_t used = left;
                         bool ret = (*filterIn) (&inbuf[0] + total - left, used, &buffer[0], in);
                         left -= used;
-                        l.append (&buffer[0], in);
+                        splitLines(&buffer[0], in, false);
                         // if the stream ends before the data runs out, keep remainder of data in inbuf
                         if (!ret) {
                             bufpos = total-left;
@@ -210,43 +205,23 @@ void BufferedSocket::threadRead() {
                             break;
                         }
                     }
-                    // process all lines
-                    while ((pos = l.find(separator)) != string::npos) {
-                        if(pos > 0) // check empty (only pipe) command and don't waste cpu with it ;o)
-                            fire(BufferedSocketListener::Line(), l.substr(0, pos));
-                        l.erase (0, pos + 1 /* separator char */);
-                    }
-                    // store remainder
-                    line = l;
-
                     break;
                 }
-            case MODE_LINE:
-                // Special to autodetect nmdc connections...
-                if(separator == 0) {
-                    if(inbuf[0] == '$') {
-                        separator = '|';
-                    } else {
-                        separator = '\n';
-                    }
-                }
-                l = line + string ((char*)&inbuf[bufpos], left);
-                while ((pos = l.find(separator)) != string::npos) {
-                    if(pos > 0) // check empty (only pipe) command and don't waste cpu with it ;o)
-                        fire(BufferedSocketListener::Line(), l.substr(0, pos));
-                    l.erase (0, pos + 1 /* separator char */);
-                    if (l.length() < (size_t)left) left = l.length();
-                    if (mode != MODE_LINE) {
-                        // we changed mode; remainder of l is invalid.
-                        l.clear();
-                        bufpos = total - left;
-                        break;
+            case MODE_LINE: {
+                    // Special to autodetect nmdc connections...
+                    if(separator == 0) {
+                        if(inbuf[0] == '$') {
+                            separator = '|';
+                        } else {
+                            separator = '\n';
+                        }
                     }
+                    size_t used = splitLines((const char*)&inbuf[bufpos], left, true);
+                    // if a listener left line mode, the rest is for the new mode
+                    bufpos += used;
+                    left -= used;
+                    break;
                 }
-                if (pos == string::npos)
-                    left = 0;
-                line = l;
-                break;
             case MODE_DATA:
                 while(left > 0) {
                     if(dataBytes == -1) {
@@ -274,6 +249,41 @@ void BufferedSocket::threadRead() {
     if(mode == MODE_LINE && line.size() > static_cast<size_t>(SETTING(MAX_COMMAND_LENGTH))) {
         throw SocketException(_("Maximum command length exceeded"));
     }
+    return true;
+}
+
+/**
+ * Fire a Line for every complete line of the data, going through it once and copying only the
+ * lines that continue an unfinished one; the unfinished end is kept in line.
+ * @param aStop Stop after a line whose listener left line mode.
+ * @return The number of bytes used.
+ */
+size_t BufferedSocket::splitLines(const char* aData, size_t aLen, bool aStop) {
+    const char* p = aData;
+    const char* end = aData + aLen;
+
+    while(p < end) {
+        const char* sep = (const char*)memchr(p, separator, end - p);
+        if(!sep) {
+            line.append(p, end);
+            return aLen;
+        }
+
+        if(!line.empty()) {
+            line.append(p, sep);
+            fire(BufferedSocketListener::Line(), line);
+            line.clear();
+        } else if(sep > p) { // check empty (only pipe) command and don't waste cpu with it ;o)
+            lineBuf.assign(p, sep);
+            fire(BufferedSocketListener::Line(), lineBuf);
+        }
+        p = sep + 1;
+
+        if(aStop && mode != MODE_LINE) {
+            break;
+        }
+    }
+    return p - aData;
 }
 
 void BufferedSocket::threadSendFile(InputStream* file) {
@@ -289,6 +299,28 @@ void BufferedSocket::threadSendFile(InputStream* file) {
     ByteVector readBuf(bufSize);
     ByteVector writeBuf(bufSize);
 
+    // Straight from the file to the socket for as long as the stream allows it
+    while(!disconnecting && sock->canSendFile()) {
+        size_t len = bufSize;
+        File* f = file->getSource(len);
+        if(!f)
+            break;
+
+        int sent = ThrottleManager::getInstance()->sendFile(sock.get(), *f, len);
+        if(sent > 0) {
+            file->skipped(sent);
+            fire(BufferedSocketListener::BytesSent(), sent, sent);
+        } else if(sent == 0) {
+            // End of the file; let reading find out as well
+            break;
+        } else {
+            int w = sock->wait(POLL_TIMEOUT, Socket::WAIT_WRITE | Socket::WAIT_READ);
+            if(w & Socket::WAIT_READ) {
+                threadRead();
+            }
+        }
+    }
+
     size_t readPos = 0;
 
     bool readDone = false;
@@ -488,6 +520,18 @@ int BufferedSocket::run() {
                 break;
             }
             if(state == RUNNING) {
+                if(SocketReactor::getInstance() && SocketReactor::getInstance()->isEnabled()) {
+                    {
+                        // addTask() notifies the reactor once it sees the flag, so the handler
+                        // gets its loop before the lock lets anyone look
+                        Lock l(cs);
+                        reactor = true;
+                        SocketReactor::getInstance()->attach(this, sock->sock, Socket::WAIT_READ);
+                    }
+                    // The reactor takes over, including deleting the socket; don't touch it anymore
+                    dcdebug("BufferedSocket::run() handed over %p\n", (void*)this);
+                    return 0;
+                }
                 checkSocket();
             }
         } catch(const Exception& e) {
@@ -499,8 +543,191 @@ int BufferedSocket::run() {
     return 0;
 }
 
+/**
+ * Reactor counterpart of run(); the sends are resumed whenever the socket becomes writable
+ * instead of blocking until done.
+ */
+void BufferedSocket::handleEvents(int aEvents) {
+    bool wasThrottled = throttled;
+    throttled = false;
+
+    try {
+        if(!reactorTasks()) {
+            return;
+        }
+        if((aEvents & Socket::WAIT_READ) || readPending || wasThrottled) {
+            reactorRead();
+        }
+        reactorSend();
+    } catch(const Exception& e) {
+        fail(e.getError());
+    }
+
+    if(state == RUNNING) {
+        if(throttled) {
+            SocketReactor::getInstance()->detach(this);
+            SocketReactor::getInstance()->retry(this, ThrottleManager::getInstance()->getRetryDelay());
+        } else {
+            SocketReactor::getInstance()->update(this, Socket::WAIT_READ | (isSending() ? Socket::WAIT_WRITE : 0));
+        }
+    }
+}
+
+/** @return false if the socket was shut down */
+bool BufferedSocket::reactorTasks() {
+    if(disconnecting && isSending()) {
+        sendBuf.clear();
+        sendPos = 0;
+        sendFile = NULL;
+        fileBuf.clear();
+    }
+
+    // Like the thread, the next task waits until the current send is done
+    while(!isSending() && taskSem.wait(0)) {
+        pair<Tasks, unique_ptr<TaskData> > p;
+        {
+            Lock l(cs);
+            dcassert(!tasks.empty());
+            p = move(tasks.front());
+            tasks.erase(tasks.begin());
+        }
+
+        if(p.first == SHUTDOWN) {
+            SocketReactor::getInstance()->destroy(this);
+            return false;
+        } else if(p.first == UPDATED) {
+            fire(BufferedSocketListener::Updated());
+        } else if(state != RUNNING) {
+            dcdebug("%d unexpected in state %d\n", p.first, state);
+        } else if(p.first == SEND_DATA) {
+            if(!disconnecting) {
+                Lock l(cs);
+                writeBuf.swap(sendBuf);
+                sendPos = 0;
+            }
+        } else if(p.first == SEND_FILE) {
+            if(!disconnecting) {
+                sendFile = static_cast<SendFileInfo*>(p.second.get())->stream;
+                dcassert(sendFile != NULL);
+                fileSockSize = (size_t)sock->getSocketOptInt(SO_SNDBUF);
+                fileBuf.clear();
+                filePos = 0;
+                fileWriteSize = 0;
+                fileDone = false;
+            }
+        } else if(p.first == DISCONNECT) {
+            fail(_("Disconnected"));
+        } else {
+            dcdebug("%d unexpected in RUNNING state\n", p.first);
+        }
+    }
+    return true;
+}
+
+void BufferedSocket::reactorRead() {
+    readPending = false;
+
+    // Don't let one busy socket hold up the others in the loop
+    for(int i = 0; i < 16; ++i) {
+        if(!threadRead()) {
+            return;
+        }
+    }
+
+    // Data may also be buffered by SSL, where polling doesn't see it
+    readPending = true;
+    SocketReactor::getInstance()->notify(this);
+}
+
+void BufferedSocket::reactorSend() {
+    if(state != RUNNING)
+        return;
+
+    while(!sendBuf.empty()) {
+        int n = sock->write(&sendBuf[sendPos], sendBuf.size() - sendPos);
+        if(n <= 0) {
+            return;
+        }
+
+        sendPos += n;
+        if(sendPos == sendBuf.size()) {
+            sendBuf.clear();
+            sendPos = 0;
+            // Get to the next task
+            SocketReactor::getInstance()->notify(this);
+        }
+    }
+
+    while(sendFile) {
+        if(filePos == fileBuf.size()) {
+            if(fileDone) {
+                sendFile = NULL;
+                fileBuf.clear();
+                filePos = 0;
+                fire(BufferedSocketListener::TransmitDone());
+                SocketReactor::getInstance()->notify(this);
+                return;
+            }
+
+            size_t bytesRead = max(fileSockSize, (size_t)64*1024);
+
+            size_t len = bytesRead;
+            File* f = sock->canSendFile() ? sendFile->getSource(len) : NULL;
+            if(f) {
+                int sent = ThrottleManager::getInstance()->sendFile(sock.get(), *f, len, &throttled);
+                if(sent < 0) {
+                    return;
+                } else if(sent > 0) {
+                    sendFile->skipped(sent);
+                    fire(BufferedSocketListener::BytesSent(), sent, sent);
+                    continue;
+                }
+                // End of the file; let reading find out as well
+            }
+
+            fileBuf.resize(bytesRead);
+            size_t actual = sendFile->read(&fileBuf[0], bytesRead);
+
+            if(bytesRead > 0) {
+                fire(BufferedSocketListener::BytesSent(), bytesRead, 0);
+            }
+
+            fileBuf.resize(actual);
+            filePos = 0;
+            if(actual == 0) {
+                fileDone = true;
+            }
+            continue;
+        }
+
+        int written;
+        if(fileWriteSize > 0) {
+            // workaround for OpenSSL (crashes when previous write failed and now retrying with different writeSize)
+            written = sock->write(&fileBuf[filePos], fileWriteSize);
+        } else {
+            size_t writeSize = min(fileSockSize / 2, fileBuf.size() - filePos);
+            written = ThrottleManager::getInstance()->write(sock.get(), &fileBuf[filePos], writeSize, &throttled);
+            if(written == -1) {
+                fileWriteSize = writeSize;
+            }
+        }
+
+        if(written <= 0) {
+            return;
+        }
+
+        filePos += written;
+        fileWriteSize = 0;
+        fire(BufferedSocketListener::BytesSent(), 0, written);
+    }
+}
+
 void BufferedSocket::fail(const string& aError) {
     if(sock.get()) {
+        if(reactor) {
+            // Before the descriptor is closed and possibly reused by another socket
+            SocketReactor::getInstance()->detach(this);
+        }
         sock->disconnect();
     }
 
@@ -519,6 +746,8 @@ void BufferedSocket::shutdown() {
 void BufferedSocket::addTask(Tasks task, TaskData* data) {
     dcassert(task == DISCONNECT || task == SHUTDOWN || task == UPDATED || sock.get());
     tasks.push_back(make_pair(task, unique_ptr<TaskData>(data))); taskSem.signal();
+    if(reactor)
+        SocketReactor::getInstance()->notify(this);
 }
 
 } // namespace dcpp
@@ -26,10 +26,15 @@
 #include "Util.h"
 #include "Socket.h"
 #include "Atomic.h"
+#include "SocketReactor.h"
 
 namespace dcpp {
 
-class BufferedSocket : public Speaker<BufferedSocketListener>, private Thread {
+/**
+ * A socket driven by its own thread, which handles the connection attempt. Once connected, the
+ * socket is handed over to the SocketReactor when it's enabled, and the thread ends.
+ */
+class BufferedSocket : public Speaker<BufferedSocketListener>, private Thread, private SocketReactor::Handler {
 public:
     enum Modes {
         MODE_LINE,
@@ -147,6 +152,8 @@ private:
     int64_t dataBytes;
     size_t rollback;
     string line;
+    /** Reused for lines that are complete in the receive buffer */
+    string lineBuf;
     ByteVector inbuf;
     ByteVector writeBuf;
     ByteVector sendBuf;
@@ -155,11 +162,33 @@ private:
     State state;
     bool disconnecting;
 
+    /** Driven by the reactor instead of the thread */
+    bool reactor;
+    /** The reactor stopped polling because no traffic token was left */
+    bool throttled;
+    /** There may be more to read than the reactor was told about */
+    bool readPending;
+    /** Reactor state of the data and file being sent */
+    size_t sendPos;
+    InputStream* sendFile;
+    ByteVector fileBuf;
+    size_t filePos;
+    size_t fileWriteSize;
+    size_t fileSockSize;
+    bool fileDone;
+
     virtual int run();
+    virtual void handleEvents(int aEvents);
+
+    bool isSending() const { return !sendBuf.empty() || sendFile; }
+    bool reactorTasks();
+    void reactorRead();
+    void reactorSend();
 
     void threadConnect(const string& aAddr, uint16_t aPort, uint16_t localPort, NatRoles natRole, bool proxy);
     void threadAccept();
-    void threadRead();
+    bool threadRead();
+    size_t splitLines(const char* aData, size_t aLen, bool aStop);
     void threadSendFile(InputStream* is);
     void threadSendData();
 
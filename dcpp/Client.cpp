@@ -36,7 +36,7 @@ Client::Client(const string& hubURL, char separator_, bool secure_) :
     reconnDelay(120), lastActivity(GET_TICK()), registered(false), autoReconnect(false),
     encoding(Text::hubDefaultCharset), state(STATE_DISCONNECTED), sock(0),
     hubUrl(hubURL), port(0), separator(separator_),
-    secure(secure_), countType(COUNT_UNCOUNTED)
+    secure(secure_), countType(COUNT_UNCOUNTED), reconnectTimer(0), destroying(false)
 {
     string file, proto, query, fragment;
     Util::decodeUrl(hubURL, proto, address, port, file, query, fragment);
@@ -49,6 +49,18 @@ Client::Client(const string& hubURL, char separator_, bool secure_) :
 Client::~Client() {
     dcassert(!sock);
 
+    // Once destroying is set nothing is scheduled anymore; cancel waits for callbacks that are running
+    vector<TimerManager::TimerId> ids;
+    {
+        Lock l(reconnectCs);
+        destroying = true;
+        ids.swap(reconnectTimers);
+        reconnectTimer = 0;
+    }
+    for(auto i = ids.begin(); i != ids.end(); ++i) {
+        TimerManager::getInstance()->cancel(*i);
+    }
+
     // In case we were deleted before we Failed
     FavoriteManager::getInstance()->removeUserCommand(getHubUrl());
     TimerManager::getInstance()->removeListener(this);
@@ -59,6 +71,7 @@ void Client::reconnect() {
     disconnect(true);
     setAutoReconnect(true);
     setReconnDelay(0);
+    scheduleReconnect();
 }
 
 void Client::shutdown() {
@@ -164,6 +177,7 @@ void Client::on(Connected) noexcept {
             if(!std::equal(kp.begin(), kp.end(), kp2v.begin())) {
                 state = STATE_DISCONNECTED;
                 sock->removeListener(this);
+                scheduleReconnect();
                 fire(ClientListener::Failed(), this, "Keyprint mismatch");
                 return;
             }
@@ -177,6 +191,7 @@ void Client::on(Failed, const string& aLine) noexcept {
     state = STATE_DISCONNECTED;
     FavoriteManager::getInstance()->removeUserCommand(getHubUrl());
     sock->removeListener(this);
+    scheduleReconnect();
     fire(ClientListener::Failed(), this, aLine);
 }
 
@@ -273,11 +288,52 @@ void Client::on(Line, const string& aLine) noexcept {
     COMMAND_DEBUG((Util::stricmp(getEncoding(), Text::utf8) != 0 ? Text::toUtf8(aLine, getEncoding()) : aLine), DebugManager::HUB_IN, getIpPort())
 }
 
-void Client::on(Second, uint64_t aTick) noexcept {
-    if(state == STATE_DISCONNECTED && getAutoReconnect() && (aTick > (getLastActivity() + getReconnDelay() * 1000)) ) {
+void Client::scheduleReconnect() {
+    uint64_t due = getLastActivity() + getReconnDelay() * 1000 + 1;
+    uint64_t now = GET_TICK();
+
+    // Whoever replaces a timer cancels it, outside the lock as cancel waits for a running callback,
+    // which may be rescheduling itself
+    TimerManager::TimerId old;
+    {
+        Lock l(reconnectCs);
+        if(destroying)
+            return;
+        old = reconnectTimer;
+        reconnectTimer = TimerManager::getInstance()->schedule(due > now ? due - now : 0, [this](uint64_t aTick) { onReconnect(aTick); });
+        reconnectTimers.push_back(reconnectTimer);
+    }
+
+    if(old) {
+        TimerManager::getInstance()->cancel(old);
+
+        Lock l(reconnectCs);
+        auto i = find(reconnectTimers.begin(), reconnectTimers.end(), old);
+        if(i != reconnectTimers.end())
+            reconnectTimers.erase(i);
+    }
+}
+
+void Client::onReconnect(uint64_t aTick) {
+    {
+        Lock l(reconnectCs);
+        if(destroying)
+            return;
+    }
+
+    if(state != STATE_DISCONNECTED || !getAutoReconnect())
+        return;
+
+    if(aTick > getLastActivity() + getReconnDelay() * 1000) {
         // Try to reconnect...
         connect();
+    } else {
+        // There was some activity meanwhile
+        scheduleReconnect();
     }
+}
+
+void Client::on(Second, uint64_t aTick) noexcept {
     if(!searchQueue.interval) return;
 
     if(isConnected()) {
@@ -190,6 +190,10 @@ protected:
     void updateCounts(bool aRemove);
     void updateActivity() { lastActivity = GET_TICK(); }
 
+    /** Try to reconnect once the reconnect delay has passed since the last activity */
+    void scheduleReconnect();
+    void onReconnect(uint64_t aTick);
+
     virtual string checkNick(const string& nick) = 0;
     virtual void search(int aSizeMode, int64_t aSize, int aFileType, const string& aString, const string& aToken, const StringList& aExtList) = 0;
 
@@ -223,6 +227,14 @@ private:
     char separator;
     bool secure;
     CountType countType;
+
+    /** Guards the reconnect timers; the timer callback may reschedule while another thread does too */
+    CriticalSection reconnectCs;
+    TimerManager::TimerId reconnectTimer;
+    /** Timers scheduled and not yet known to be cancelled */
+    vector<TimerManager::TimerId> reconnectTimers;
+    /** Set by the destructor, after which no timer is scheduled anymore */
+    bool destroying;
 };
 
 } // namespace dcpp
@@ -192,7 +192,7 @@ uint8_t ClientManager::getSlots(const CID& cid) const {
     Lock l(cs);
     OnlineIterC i = onlineUsers.find(cid);
     if(i != onlineUsers.end()) {
-        return static_cast<uint8_t>(Util::toInt(i->second->getIdentity().get("SL")));
+        return static_cast<uint8_t>(i->second->getIdentity().getSlots());
     }
     return 0;
 }
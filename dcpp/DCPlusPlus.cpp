@@ -35,6 +35,7 @@
 #include "FinishedManager.h"
 #include "ResourceManager.h"
 #include "ThrottleManager.h"
+#include "SocketReactor.h"
 #include "ADLSearch.h"
 //#include "WindowManager.h"
 #include "StringTokenizer.h"
@@ -81,6 +82,7 @@ void startup(void (*f)(void*, const string&), void* p) {
     TimerManager::newInstance();
     HashManager::newInstance();
     CryptoManager::newInstance();
+    SocketReactor::newInstance();
     SearchManager::newInstance();
     ClientManager::newInstance();
     ConnectionManager::newInstance();
@@ -154,6 +156,7 @@ void shutdown() {
     UPnPManager::getInstance()->close();
 
     BufferedSocket::waitShutdown();
+    SocketReactor::deleteInstance();
     //WindowManager::getInstance()->prepareSave();
     QueueManager::getInstance()->saveQueue(true);
     ClientManager::getInstance()->saveUsers();
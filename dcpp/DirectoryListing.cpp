@@ -22,6 +22,7 @@
 
 #include "QueueManager.h"
 #include "ClientManager.h"
+#include "LogManager.h"
 
 #include "StringTokenizer.h"
 #include "SimpleXML.h"
@@ -40,6 +41,7 @@ namespace dcpp {
 
 DirectoryListing::DirectoryListing(const HintedUser& aUser) :
 user(aUser),
+lazyPending(0),
 root(new Directory(NULL, Util::emptyString, false, false))
 {
 }
@@ -80,7 +82,7 @@ UserPtr DirectoryListing::getUserFromFilename(const string& fileName) {
     return ClientManager::getInstance()->getUser(cid);
 }
 
-void DirectoryListing::loadFile(const string& name) {
+void DirectoryListing::loadFile(const string& name, bool lazy) {
     string txt;
 
     // For now, we detect type by ending...
@@ -88,21 +90,32 @@ void DirectoryListing::loadFile(const string& name) {
 
     dcpp::File ff(name, dcpp::File::READ, dcpp::File::OPEN);
     if(Util::stricmp(ext, ".bz2") == 0) {
-        FilteredInputStream<UnBZFilter, false> f(&ff);
-        loadXML(f, false);
+        FilteredInputStream<ParallelUnBZFilter, false> f(&ff);
+        if(lazy)
+            loadLazy(f);
+        else
+            loadXML(f, false);
     } else if(Util::stricmp(ext, ".xml") == 0) {
-        loadXML(ff, false);
+        if(lazy)
+            loadLazy(ff);
+        else
+            loadXML(ff, false);
     }
 }
 
 class ListLoader : public dcpp::SimpleXMLReader::CallBack {
 public:
-    ListLoader(DirectoryListing::Directory* root, bool aUpdating) : cur(root),
-                                                                    base("/"),
-                                                                    inListing(false),
-                                                                    updating(aUpdating),
-                                                                    m_is_mediainfo_list(false),
-                                                                    m_is_first_check_mediainfo_list(false)
+    /** @param aLazy Indexes of the lazy directories in the list, in the order they appear */
+    ListLoader(DirectoryListing& aList, DirectoryListing::Directory* aCur, bool aUpdating,
+               const vector<uint32_t>* aLazy = NULL) : list(aList),
+                                                          cur(aCur),
+                                                          lazy(aLazy),
+                                                          lazyPos(0),
+                                                          base("/"),
+                                                          inListing(false),
+                                                          updating(aUpdating),
+                                                          m_is_mediainfo_list(false),
+                                                          m_is_first_check_mediainfo_list(false)
     {
     }
 
@@ -113,7 +126,10 @@ public:
 
     const string& getBase() const { return base; }
 private:
+    DirectoryListing& list;
     DirectoryListing::Directory* cur;
+    const vector<uint32_t>* lazy;
+    size_t lazyPos;
 
     StringMap params;
     string base;
@@ -129,7 +145,7 @@ string DirectoryListing::updateXML(const string& xml) {
 }
 
 string DirectoryListing::loadXML(InputStream& is, bool updating) {
-    ListLoader ll(getRoot(), updating);
+    ListLoader ll(*this, getRoot(), updating);
 
     dcpp::SimpleXMLReader(&ll).parse(is, SETTING(MAX_FILELIST_SIZE) ? (size_t)SETTING(MAX_FILELIST_SIZE)*1024*1024 : 0);
 
@@ -180,7 +196,7 @@ void ListLoader::startTag(const string& name, StringPairList& attribs, bool simp
                 }
             }
 
-            DirectoryListing::File* f = new DirectoryListing::File(cur, n, size, tth);
+            DirectoryListing::File* f = list.createFile(cur, n, size, tth);
 
             string l_ts = "";
 
@@ -222,8 +238,10 @@ void ListLoader::startTag(const string& name, StringPairList& attribs, bool simp
                 }
             }
             if(d == NULL) {
-                d = new DirectoryListing::Directory(cur, n, false, !incomp);
+                d = list.createDirectory(cur, n, !incomp);
                 cur->directories.push_back(d);
+                if(lazy && lazyPos < lazy->size())
+                    list.setPending(d, (*lazy)[lazyPos++]);
             }
             cur = d;
 
@@ -247,7 +265,7 @@ void ListLoader::startTag(const string& name, StringPairList& attribs, bool simp
                 }
             }
             if(d == NULL) {
-                d = new DirectoryListing::Directory(cur, *i, false, false);
+                d = list.createDirectory(cur, *i, false);
                 cur->directories.push_back(d);
             }
             cur = d;
@@ -273,6 +291,237 @@ void ListLoader::endTag(const string& name, const string&) {
     }
 }
 
+namespace {
+
+/** Whether the tag whose name starts at p is aName */
+inline bool isTag(const char* p, const char* end, const char* aName, size_t aLen) {
+    if(static_cast<size_t>(end - p) <= aLen || memcmp(p, aName, aLen) != 0)
+        return false;
+    char c = p[aLen];
+    return c == ' ' || c == '\t' || c == '\r' || c == '\n' || c == '/' || c == '>';
+}
+
+inline bool isSpace(char c) {
+    return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
+
+/** @return Where the tag that p is in ends; attribute values may hold a '>' */
+const char* skipTag(const char* p, const char* end) {
+    char quote = 0;
+    for(; p < end; ++p) {
+        if(quote) {
+            if(*p == quote)
+                quote = 0;
+        } else if(*p == '"' || *p == '\'') {
+            quote = *p;
+        } else if(*p == '>') {
+            return p + 1;
+        }
+    }
+    return end;
+}
+
+/** The Size attribute of a File tag; the attributes are walked, so that a name can't fool it */
+int64_t getFileSize(const char* p, const char* end) {
+    while(p < end) {
+        while(p < end && isSpace(*p))
+            ++p;
+        const char* name = p;
+        while(p < end && *p != '=' && *p != '>' && !isSpace(*p))
+            ++p;
+        const char* nameEnd = p;
+        while(p < end && *p != '"' && *p != '\'' && *p != '>')
+            ++p;
+        if(p == end || *p == '>')
+            break;
+        char quote = *p++;
+        const char* value = p;
+        while(p < end && *p != quote)
+            ++p;
+        if(nameEnd - name == 4 && memcmp(name, "Size", 4) == 0)
+            return strtoll(value, NULL, 10);
+        ++p;
+    }
+    return 0;
+}
+
+}
+
+/**
+ * Read the whole list, but only parse its top level: the directories are looked up in a quick
+ * pass that doesn't parse any attribute besides the sizes of the files, and stay empty until
+ * they're loaded.
+ */
+void DirectoryListing::loadLazy(InputStream& is) {
+    const size_t maxSize = SETTING(MAX_FILELIST_SIZE) ? (size_t)SETTING(MAX_FILELIST_SIZE)*1024*1024 : 0;
+    const size_t BUF_SIZE = 64*1024;
+
+    string xml;
+    for(;;) {
+        size_t old = xml.size();
+        xml.resize(old + BUF_SIZE);
+        size_t n = BUF_SIZE;
+        size_t len = is.read(&xml[old], n);
+        xml.resize(old + len);
+        if(maxSize > 0 && xml.size() > maxSize)
+            throw SimpleXMLException("Greater than maximum allowed size");
+        if(len == 0)
+            break;
+    }
+
+    lazyXml.swap(xml);
+    LazyDirectory top = indexXML();
+    lazyPending = lazyDirs.size();
+
+    parseLazy(getRoot(), top, lazyXml.substr(top.tag, top.begin - top.tag));
+}
+
+DirectoryListing::LazyDirectory DirectoryListing::indexXML() {
+    const char* const start = lazyXml.data();
+    const char* const end = start + lazyXml.size();
+
+    LazyDirectory top = { string::npos, 0, 0, 0, 0, 0 };
+    vector<uint32_t> open;
+
+    const char* p = start;
+    while(p < end && (p = (const char*)memchr(p, '<', end - p)) != NULL) {
+        const char* t = p + 1;
+        if(isTag(t, end, "File", 4)) {
+            const char* e = skipTag(t, end);
+            if(!open.empty()) {
+                LazyDirectory& d = lazyDirs[open.back()];
+                d.files++;
+                d.size += getFileSize(t + 4, e);
+            }
+            p = e;
+        } else if(isTag(t, end, "Directory", 9)) {
+            const char* e = skipTag(t, end);
+            LazyDirectory d = { static_cast<size_t>(p - start), static_cast<size_t>(e - start), static_cast<size_t>(e - start), 0, 0, 0 };
+            if(!open.empty())
+                lazyDirs[open.back()].dirs++;
+            lazyDirs.push_back(d);
+            if(e[-2] != '/')
+                open.push_back(lazyDirs.size() - 1);
+            p = e;
+        } else if(isTag(t, end, "/Directory", 10)) {
+            if(open.empty())
+                throw SimpleXMLException("Unexpected end tag");
+            LazyDirectory& d = lazyDirs[open.back()];
+            d.end = p - start;
+            open.pop_back();
+            if(!open.empty()) {
+                lazyDirs[open.back()].files += d.files;
+                lazyDirs[open.back()].size += d.size;
+            }
+            p = skipTag(t, end);
+        } else if(top.tag == string::npos && isTag(t, end, "FileListing", 11)) {
+            const char* e = skipTag(t, end);
+            top.tag = p - start;
+            top.begin = top.end = e - start;
+            p = e;
+        } else if(isTag(t, end, "/FileListing", 12)) {
+            top.end = p - start;
+            p = skipTag(t, end);
+        } else {
+            p = t;
+        }
+    }
+
+    if(top.tag == string::npos || !open.empty())
+        throw SimpleXMLException("Unexpected end of stream");
+    return top;
+}
+
+/**
+ * The files and subdirectories of a directory, as a list of tags that can be parsed on their own:
+ * the content of the subdirectories is left out.
+ * @param aDirs Receives the indexes of the subdirectories, in the order they appear.
+ */
+string DirectoryListing::skimXML(size_t aBegin, size_t aEnd, vector<uint32_t>& aDirs) const {
+    const char* const start = lazyXml.data();
+    const char* const end = start + aEnd;
+
+    string ret;
+    auto next = lazyDirs.begin();
+    const char* p = start + aBegin;
+    while(p < end && (p = (const char*)memchr(p, '<', end - p)) != NULL) {
+        const char* t = p + 1;
+        if(isTag(t, end, "File", 4)) {
+            const char* e = skipTag(t, end);
+            ret.append(p, e);
+            p = e;
+        } else if(isTag(t, end, "Directory", 9)) {
+            size_t tag = p - start;
+            next = lower_bound(next, lazyDirs.end(), tag, [](const LazyDirectory& d, size_t pos) { return d.tag < pos; });
+            if(next == lazyDirs.end() || next->tag != tag)
+                break;
+
+            const char* e = start + next->begin;
+            if(e[-2] == '/') {
+                ret.append(p, e);
+                p = e;
+            } else {
+                ret.append(p, e - 1);
+                ret.append("/>");
+                p = skipTag(start + next->end + 1, end);
+            }
+            aDirs.push_back(next - lazyDirs.begin());
+        } else {
+            p = t;
+        }
+    }
+    return ret;
+}
+
+void DirectoryListing::parseLazy(Directory* aDir, const LazyDirectory& aLazy, string aStartTag) {
+    if(aStartTag.size() >= 2 && aStartTag[aStartTag.size() - 2] == '/')
+        aStartTag.replace(aStartTag.size() - 2, 2, ">");
+
+    vector<uint32_t> dirs;
+    string xml = aStartTag + skimXML(aLazy.begin, aLazy.end, dirs) + "</FileListing>";
+
+    ListLoader ll(*this, aDir, false, &dirs);
+    MemoryInputStream mis(xml);
+    dcpp::SimpleXMLReader(&ll).parse(mis);
+
+    if(lazyPending == 0) {
+        string().swap(lazyXml);
+        vector<LazyDirectory>().swap(lazyDirs);
+    }
+}
+
+void DirectoryListing::setPending(Directory* aDir, uint32_t aIndex) {
+    if(lazyDirs[aIndex].begin == lazyDirs[aIndex].end) {
+        // Nothing to parse
+        --lazyPending;
+    } else {
+        aDir->pending = this;
+        aDir->lazyIndex = aIndex;
+    }
+}
+
+void DirectoryListing::loadDirectory(Directory* aDir) {
+    LazyDirectory l = lazyDirs[aDir->lazyIndex];
+    aDir->pending = NULL;
+    --lazyPending;
+
+    // Parsing goes through a FileListing element, which would mark the directory complete
+    bool complete = aDir->getComplete();
+    try {
+        parseLazy(aDir, l, "<FileListing>");
+    } catch(const Exception& e) {
+        // What was parsed is kept, but the directory is shown as incomplete
+        complete = false;
+        LogManager::getInstance()->message(str(F_("Could not load %1% from the file list of %2%: %3%") %
+            Util::addBrackets(getPath(aDir)) % Util::toString(ClientManager::getInstance()->getNicks(getUser())) % e.getError()));
+    }
+    aDir->setComplete(complete);
+}
+
+size_t DirectoryListing::Directory::getDirectoryCount() const {
+    return pending ? pending->lazyDirs[lazyIndex].dirs : directories.size();
+}
+
 string DirectoryListing::getPath(const Directory* d) const {
     if(d == root)
         return "";
@@ -310,6 +559,7 @@ void DirectoryListing::download(Directory* aDir, const string& aTarget, bool hig
     string tmp;
     string target = (aDir == getRoot()) ? aTarget : aTarget + aDir->getName() + PATH_SEPARATOR;
     // First, recurse over the directories
+    aDir->load();
     Directory::List& lst = aDir->directories;
     sort(lst.begin(), lst.end(), Directory::DirSort());
     for(auto j = lst.begin(); j != lst.end(); ++j) {
@@ -352,6 +602,7 @@ DirectoryListing::Directory* DirectoryListing::find(const string& aName, Directo
     dcassert(end != string::npos);
     auto name = aName.substr(0, end);
 
+    current->load();
     auto i = std::find(current->directories.begin(), current->directories.end(), name);
     if(i != current->directories.end()) {
         if(end == (aName.size() - 1))
@@ -366,7 +617,7 @@ struct HashContained {
     HashContained(const DirectoryListing::Directory::TTHSet& l) : tl(l) { }
     const DirectoryListing::Directory::TTHSet& tl;
     bool operator()(const DirectoryListing::File::Ptr i) const {
-        return tl.count((i->getTTH())) && (DeleteFunction()(i), true);
+        return tl.count((i->getTTH())) && (DirectoryListing::File::destroy(i), true);
     }
 private:
     HashContained& operator=(HashContained&);
@@ -375,7 +626,7 @@ private:
 struct DirectoryEmpty {
     bool operator()(const DirectoryListing::Directory::Ptr i) const {
         bool r = i->getFileCount() == 0 && i->directories.empty();
-        if (r) DeleteFunction()(i);
+        if (r) DirectoryListing::Directory::destroy(i);
         return r;
     }
 };
@@ -389,17 +640,21 @@ void DirectoryListing::Directory::filterList(DirectoryListing& dirList) {
 }
 
 void DirectoryListing::Directory::filterList(DirectoryListing::Directory::TTHSet& l) {
+    load();
     for(auto i = directories.begin(); i != directories.end(); ++i) (*i)->filterList(l);
     directories.erase(std::remove_if(directories.begin(),directories.end(),DirectoryEmpty()),directories.end());
     files.erase(std::remove_if(files.begin(),files.end(),HashContained(l)),files.end());
 }
 
 void DirectoryListing::Directory::getHashList(DirectoryListing::Directory::TTHSet& l) {
+    load();
     for(auto i = directories.begin(); i != directories.end(); ++i) (*i)->getHashList(l);
     for(auto i = files.begin(); i != files.end(); ++i) l.insert((*i)->getTTH());
 }
 
 int64_t DirectoryListing::Directory::getTotalSize(bool adl) {
+    if(pending)
+        return pending->lazyDirs[lazyIndex].size;
     int64_t x = getSize();
     for(auto i = directories.begin(); i != directories.end(); ++i) {
         if(!(adl && (*i)->getAdls()))
@@ -409,6 +664,8 @@ int64_t DirectoryListing::Directory::getTotalSize(bool adl) {
 }
 
 size_t DirectoryListing::Directory::getTotalFileCount(bool adl) {
+    if(pending)
+        return pending->lazyDirs[lazyIndex].files;
     size_t x = getFileCount();
     for(auto i = directories.begin(); i != directories.end(); ++i) {
         if(!(adl && (*i)->getAdls()))
@@ -21,6 +21,7 @@
 #include "noexcept.h"
 #include "User.h"
 #include "FastAlloc.h"
+#include "Arena.h"
 #include "MerkleTree.h"
 #include "Streams.h"
 #include "MediaInfo.h"
@@ -46,11 +47,11 @@ public:
         typedef List::iterator Iter;
 
         File(Directory* aDir, const string& aName, int64_t aSize, const TTHValue& aTTH) noexcept :
-            name(aName), size(aSize), parent(aDir), tthRoot(aTTH), adls(false)
+            name(aName), size(aSize), parent(aDir), tthRoot(aTTH), adls(false), inArena(false)
         {
         }
 
-        File(const File& rhs, bool _adls = false) : name(rhs.name), size(rhs.size), parent(rhs.parent), tthRoot(rhs.tthRoot), adls(_adls)
+        File(const File& rhs, bool _adls = false) : name(rhs.name), size(rhs.size), parent(rhs.parent), tthRoot(rhs.tthRoot), adls(_adls), inArena(false)
         {
         }
 
@@ -61,6 +62,14 @@ public:
 
         ~File() { }
 
+        /** Delete a file, whether it was allocated with new or from the arena of its listing */
+        static void destroy(File* f) {
+            if(f->inArena)
+                f->~File();
+            else
+                delete f;
+        }
+
         GETSET(string, name, Name);
         GETSET(int64_t, size, Size);
         GETSET(Directory*, parent, Parent);
@@ -69,6 +78,9 @@ public:
         GETSET(uint64_t, ts, TS);
         GETSET(uint64_t, hit, Hit);
         MediaInfo mediaInfo;
+    private:
+        friend class DirectoryListing;
+        bool inArena;
     };
 
     class Directory : public FastAlloc<Directory>, boost::noncopyable {
@@ -88,13 +100,30 @@ public:
         File::List files;
 
         Directory(Directory* aParent, const string& aName, bool _adls, bool aComplete)
-            : name(aName), parent(aParent), adls(_adls), complete(aComplete) { }
+            : name(aName), parent(aParent), adls(_adls), complete(aComplete), inArena(false), pending(NULL), lazyIndex(0) { }
 
         virtual ~Directory() {
-            for_each(directories.begin(), directories.end(), DeleteFunction());
-            for_each(files.begin(), files.end(), DeleteFunction());
+            for_each(directories.begin(), directories.end(), &Directory::destroy);
+            for_each(files.begin(), files.end(), &File::destroy);
         }
 
+        /** Delete a directory, whether it was allocated with new or from the arena of its listing */
+        static void destroy(Directory* d) {
+            if(d->inArena)
+                d->~Directory();
+            else
+                delete d;
+        }
+
+        /**
+         * In a lazily loaded listing, parse the files and subdirectories of this directory if that
+         * wasn't done yet. Call before going through directories or files. Const, as the content
+         * is there in principle and only gets parsed.
+         */
+        void load() const { if(pending) pending->loadDirectory(const_cast<Directory*>(this)); }
+        /** Number of subdirectories, known without loading the directory */
+        size_t getDirectoryCount() const;
+
         size_t getTotalFileCount(bool adls = false);
         int64_t getTotalSize(bool adls = false);
         void filterList(DirectoryListing& dirList);
@@ -116,6 +145,12 @@ public:
         GETSET(bool, adls, Adls);
         GETSET(bool, complete, Complete);
 
+    private:
+        friend class DirectoryListing;
+        bool inArena;
+        /** Listing that still has to parse the content, if any */
+        DirectoryListing* pending;
+        uint32_t lazyIndex;
     };
 
     class AdlDirectory : public Directory {
@@ -128,7 +163,11 @@ public:
     DirectoryListing(const HintedUser& aUser);
     ~DirectoryListing();
 
-    void loadFile(const string& name);
+    /**
+     * @param lazy Only parse the top level now; the content of a directory is parsed when it's
+     * first loaded (see Directory::load). Totals are known from the start.
+     */
+    void loadFile(const string& name, bool lazy = false);
 
     string updateXML(const std::string&);
     string loadXML(InputStream& xml, bool updating);
@@ -160,6 +199,47 @@ public:
 private:
     friend class ListLoader;
 
+    /**
+     * Create the nodes of a loaded list in the arena: they are laid out next to each other and
+     * their memory is given back all at once with the listing, instead of node by node.
+     */
+    File* createFile(Directory* aDir, const string& aName, int64_t aSize, const TTHValue& aTTH) {
+        File* f = new (arena.allocate(sizeof(File))) File(aDir, aName, aSize, aTTH);
+        f->inArena = true;
+        return f;
+    }
+    Directory* createDirectory(Directory* aParent, const string& aName, bool aComplete) {
+        Directory* d = new (arena.allocate(sizeof(Directory))) Directory(aParent, aName, false, aComplete);
+        d->inArena = true;
+        return d;
+    }
+
+    /** Where a directory is in the list of a lazy listing, and what's below it */
+    struct LazyDirectory {
+        /** Offset of the start tag */
+        size_t tag;
+        /** The content, between the start and end tag */
+        size_t begin, end;
+        size_t files;
+        int64_t size;
+        /** Subdirectories directly below */
+        size_t dirs;
+    };
+
+    void loadLazy(InputStream& is);
+    LazyDirectory indexXML();
+    string skimXML(size_t aBegin, size_t aEnd, vector<uint32_t>& aDirs) const;
+    void parseLazy(Directory* aDir, const LazyDirectory& aLazy, string aStartTag);
+    void setPending(Directory* aDir, uint32_t aIndex);
+    void loadDirectory(Directory* aDir);
+
+    /** The decompressed list and its directories, as long as some of them haven't been parsed */
+    string lazyXml;
+    vector<LazyDirectory> lazyDirs;
+    size_t lazyPending;
+
+    /** Must outlive root, as the tree is made of nodes from the arena */
+    Arena arena;
     Directory* root;
 
 };
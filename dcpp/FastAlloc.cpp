@@ -0,0 +1,181 @@
+/*
+ * Copyright (C) 2001-2012 Jacek Sieka, arnetheduck on gmail point com
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "stdinc.h"
+#include "FastAlloc.h"
+
+#ifdef _WIN32
+#include <boost/thread/tss.hpp>
+#else
+#include <pthread.h>
+#endif
+
+#ifdef __GNUC__
+#include <cxxabi.h>
+#endif
+
+namespace dcpp {
+
+#ifndef _DEBUG
+
+FastCriticalSection FastAllocBase::cs;
+FastAllocBase::Depot* FastAllocBase::depots = NULL;
+__thread FastAllocBase::Cache* FastAllocBase::threadCaches = NULL;
+
+FastAllocBase::Depot::Depot(const char* aName, size_t aSize) : cs(), name(aName), size(aSize), free(0), allocated(0), caches(NULL) {
+    FastLock l(FastAllocBase::cs);
+    next = depots;
+    depots = this;
+}
+
+void FastAllocBase::attach(Cache& c, Depot& d) {
+#ifdef _WIN32
+    static boost::thread_specific_ptr<Cache*> hook([](Cache**) { threadExit(NULL); });
+    if(hook.get() == NULL)
+        hook.reset(&threadCaches);
+#else
+    static const pthread_key_t key = [] {
+        pthread_key_t k;
+        pthread_key_create(&k, &threadExit);
+        return k;
+    }();
+    // The destructor only runs for a non-null value
+    pthread_setspecific(key, &threadCaches);
+#endif
+
+    c.depot = &d;
+    c.nextInThread = threadCaches;
+    threadCaches = &c;
+
+    FastLock l(d.cs);
+    c.prev = NULL;
+    c.next = d.caches;
+    if(d.caches)
+        d.caches->prev = &c;
+    d.caches = &c;
+}
+
+void FastAllocBase::refill(Cache& c, Depot& d) {
+    dcassert(c.head == NULL);
+    if(c.depot == NULL)
+        attach(c, d);
+
+    FastLock l(d.cs);
+    if(d.chains.empty())
+        grow(d);
+
+    c.head = d.chains.back().first;
+    c.count = d.chains.back().second;
+    d.chains.pop_back();
+    d.free -= c.count;
+}
+
+void FastAllocBase::release(Cache& c) {
+    dcassert(c.count > BATCH);
+    void* last = c.head;
+    for(size_t i = 1; i < BATCH; ++i)
+        last = *(void**)last;
+
+    void* rest = *(void**)last;
+    *(void**)last = NULL;
+    size_t n = c.count - BATCH;
+    c.count = BATCH;
+
+    FastLock l(c.depot->cs);
+    c.depot->chains.push_back(make_pair(rest, n));
+    c.depot->free += n;
+}
+
+void FastAllocBase::flush(Cache& c) {
+    Depot& d = *c.depot;
+    FastLock l(d.cs);
+    if(c.count > 0) {
+        d.chains.push_back(make_pair(c.head, c.count));
+        d.free += c.count;
+    }
+
+    if(c.prev)
+        c.prev->next = c.next;
+    else
+        d.caches = c.next;
+    if(c.next)
+        c.next->prev = c.prev;
+
+    c.head = NULL;
+    c.count = 0;
+    c.depot = NULL;
+}
+
+void FastAllocBase::threadExit(void*) {
+    Cache* c = threadCaches;
+    threadCaches = NULL;
+    while(c) {
+        Cache* next = c->nextInThread;
+        flush(*c);
+        c = next;
+    }
+}
+
+void FastAllocBase::grow(Depot& d) {
+    // We want to grow by approximately 128kb at a time...
+    size_t items = ((128*1024 + d.size - 1)/d.size);
+    uint8_t* tmp = new uint8_t[d.size*items];
+    for(size_t i = 0; i < items; i += BATCH) {
+        size_t n = min((size_t)BATCH, items - i);
+        d.chains.push_back(make_pair((void*)tmp, n));
+        for(size_t j = 0; j < n - 1; ++j) {
+            *(void**)tmp = tmp + d.size;
+            tmp += d.size;
+        }
+        *(void**)tmp = NULL;
+        tmp += d.size;
+    }
+    d.allocated += items;
+    d.free += items;
+}
+
+void FastAllocBase::getStats(vector<Stats>& aStats) {
+    aStats.clear();
+
+    FastLock l(cs);
+    for(Depot* d = depots; d; d = d->next) {
+        Stats s;
+#ifdef __GNUC__
+        int status = 0;
+        char* name = abi::__cxa_demangle(d->name, NULL, NULL, &status);
+        s.name = name ? name : d->name;
+        ::free(name);
+#else
+        s.name = d->name;
+#endif
+        s.size = d->size;
+
+        FastLock dl(d->cs);
+        size_t cached = 0;
+        for(Cache* c = d->caches; c; c = c->next)
+            cached += c->count;
+        s.allocated = d->allocated;
+        size_t unused = d->free + cached;
+        s.live = unused < d->allocated ? d->allocated - unused : 0;
+        aStats.push_back(s);
+    }
+}
+
+#endif
+
+} // namespace dcpp
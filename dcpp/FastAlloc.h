@@ -20,17 +20,80 @@
 
 #include "CriticalSection.h"
 #include "debug.h"
+#include "typedefs.h"
+
+#include <typeinfo>
 
 namespace dcpp {
 
 #ifndef _DEBUG
 struct FastAllocBase {
+    /** Memory use of one FastAlloc'ed type */
+    struct Stats {
+        string name;
+        size_t size;
+        /** Objects carved out of the heap so far (they are never given back) */
+        size_t allocated;
+        /** Objects in use; approximate, as the caches of other threads are read without locking */
+        size_t live;
+    };
+
+    static void getStats(vector<Stats>& aStats);
+
+protected:
+    /** Objects that move between a thread cache and the depot at once */
+    enum { BATCH = 64 };
+
+    struct Depot;
+
+    /** Free objects of one type kept by one thread; zero-initialized, so it can be thread-local */
+    struct Cache {
+        void* head;
+        size_t count;
+        Depot* depot;
+        /** Next cache of the same thread, to return them all when the thread ends */
+        Cache* nextInThread;
+        /** Caches of all threads for this type, for the statistics */
+        Cache* prev;
+        Cache* next;
+    };
+
+    /** Free objects of one type shared by all threads, in chains of up to BATCH objects */
+    struct Depot {
+        Depot(const char* aName, size_t aSize);
+
+        FastCriticalSection cs;
+        const char* name;
+        size_t size;
+        vector<pair<void*, size_t> > chains;
+        size_t free;
+        size_t allocated;
+        Cache* caches;
+        Depot* next;
+    };
+
+    /** Give the cache a chain of objects from the depot */
+    static void refill(Cache& c, Depot& d);
+    /** Move all but BATCH objects of the cache to the depot */
+    static void release(Cache& c);
+    /** Register a thread's cache, so that it's emptied when the thread ends */
+    static void attach(Cache& c, Depot& d);
+
+private:
+    static void flush(Cache& c);
+    static void grow(Depot& d);
+    static void threadExit(void*);
+
     static FastCriticalSection cs;
+    static Depot* depots;
+    static __thread Cache* threadCaches;
 };
 
 /**
  * Fast new/delete replacements for constant sized objects, that also give nice
  * reference locality...
+ * Each thread keeps a small cache of free objects per type, so allocating takes no lock; only
+ * refilling a cache from, or emptying it into, the shared depot does, a BATCH of objects at a time.
  */
 template<class T>
 struct FastAlloc : public FastAllocBase {
@@ -63,37 +126,39 @@ protected:
 private:
 
     static void* allocate() {
-        FastLock l(cs);
-        if(freeList == NULL) {
-            grow();
+        Cache& c = cache;
+        if(c.head == NULL) {
+            refill(c, getDepot());
         }
-        void* tmp = freeList;
-        freeList = *((void**)freeList);
+        void* tmp = c.head;
+        c.head = *((void**)tmp);
+        --c.count;
         return tmp;
     }
 
     static void deallocate(void* p) {
-        FastLock l(cs);
-        *(void**)p = freeList;
-        freeList = p;
+        Cache& c = cache;
+        if(c.depot == NULL) {
+            // Freed by a thread that never allocated this type
+            attach(c, getDepot());
+        }
+        *(void**)p = c.head;
+        c.head = p;
+        if(++c.count >= 2 * BATCH) {
+            release(c);
+        }
     }
 
-    static void* freeList;
-
-    static void grow() {
-        dcassert(sizeof(T) >= sizeof(void*));
-        // We want to grow by approximately 128kb at a time...
-        size_t items = ((128*1024 + sizeof(T) - 1)/sizeof(T));
-        freeList = new uint8_t[sizeof(T)*items];
-        uint8_t* tmp = (uint8_t*)freeList;
-        for(size_t i = 0; i < items - 1; i++) {
-            *(void**)tmp = tmp + sizeof(T);
-            tmp += sizeof(T);
-        }
-        *(void**)tmp = NULL;
+    static Depot& getDepot() {
+        static_assert(sizeof(T) >= sizeof(void*), "objects must hold the free list link");
+        // Never destroyed, as detached threads may still free objects while the program exits
+        static Depot* depot = new Depot(typeid(T).name(), sizeof(T));
+        return *depot;
     }
+
+    static __thread Cache cache;
 };
-template<class T> void* FastAlloc<T>::freeList = NULL;
+template<class T> __thread FastAllocBase::Cache FastAlloc<T>::cache;
 #else
 template<class T> struct FastAlloc { };
 #endif
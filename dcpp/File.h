@@ -63,6 +63,8 @@ public:
     // not sure if the client code needs this...
     int extendFile(int64_t len) noexcept;
 
+    int getHandle() const noexcept { return h; }
+
 #endif // !_WIN32
 
     File(const string& aFileName, int access, int mode);
@@ -82,6 +84,9 @@ public:
     virtual size_t write(const void* buf, size_t len);
     virtual size_t flush();
 
+    /** Sending from the file's own position also moves it, so nothing has to be skipped */
+    virtual File* getSource(size_t& /*len*/) { return this; }
+
     uint32_t getLastModified() noexcept;
 
     static void copyFile(const string& src, const string& target);
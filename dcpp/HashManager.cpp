@@ -32,6 +32,9 @@
 #include <setjmp.h>
 #endif
 
+#include <sys/types.h>
+#include <sys/stat.h>
+
 #include <memory>
 
 #ifdef USE_XATTR
@@ -45,6 +48,12 @@ namespace dcpp {
 
 #define HASH_FILE_VERSION_STRING "2"
 static const uint32_t HASH_FILE_VERSION = 2;
+/** HashIndex.dat identification; the magic also tells apart files written with another byte order */
+static const uint32_t HASH_INDEX_MAGIC = 0x49484344;
+static const uint32_t HASH_INDEX_VERSION = 1;
+/** Journal record types */
+static const char JOURNAL_TREE = 'T';
+static const char JOURNAL_FILE = 'F';
 const int64_t HashManager::MIN_BLOCK_SIZE = 64 * 1024;
 const string HashManager::StreamStore::g_streamName(".gltth");
 
@@ -166,11 +175,10 @@ void HashManager::StreamStore::deleteStream(const string& p_filePath)
 bool HashManager::checkTTH(const string& aFileName, int64_t aSize, uint32_t aTimeStamp) {
     Lock l(cs);
 
-    const TTHValue* tthold = getFileTTHif(Text::toLower(aFileName));
-    const TTHValue* tth = getFileTTHif(aFileName);
-    if (tthold != NULL && tth == NULL) {
+    TTHValue tthold, tth;
+    if (getFileTTHif(Text::toLower(aFileName), tthold) && !getFileTTHif(aFileName, tth)) {
         TigerTree tt(MIN_BLOCK_SIZE);
-        store.getTree(*tthold, tt);
+        store.getTree(tthold, tt);
         hashDone(aFileName, aTimeStamp, tt, 0, aSize);
 
         m_streamstore.saveTree(aFileName, tt);
@@ -186,17 +194,17 @@ bool HashManager::checkTTH(const string& aFileName, int64_t aSize, uint32_t aTim
 
 TTHValue HashManager::getTTH(const string& aFileName, int64_t aSize) {
     Lock l(cs);
-    const TTHValue* tth = store.getTTH(aFileName);
-    if (tth == NULL) {
+    TTHValue tth;
+    if (!store.getTTH(aFileName, tth)) {
         hasher.hashFile(aFileName, aSize);
         throw HashException();
     }
-    return *tth;
+    return tth;
 }
 
-const TTHValue* HashManager::getFileTTHif(const string& aFileName) {
+bool HashManager::getFileTTHif(const string& aFileName, TTHValue& tth) {
     Lock l(cs);
-    return store.getTTH(aFileName);
+    return store.getTTH(aFileName, tth);
 }
 
 bool HashManager::getTree(const TTHValue& root, TigerTree& tt) {
@@ -234,10 +242,27 @@ void HashManager::hashDone(const string& aFileName, uint32_t aTimeStamp, const T
 
 void HashManager::HashStore::addFile(const string& aFileName, uint32_t aTimeStamp, const TigerTree& tth, bool aUsed) {
     addTree(tth);
+    addFileInfo(aFileName, tth.getRoot(), aTimeStamp, aUsed);
+
+    string rec(1, JOURNAL_FILE);
+    uint32_t len = aFileName.length();
+    rec.append((const char*)tth.getRoot().data, TTHValue::BYTES);
+    rec.append((const char*)&aTimeStamp, sizeof(aTimeStamp));
+    rec.append((const char*)&len, sizeof(len));
+    rec += aFileName;
+    appendJournal(rec);
+}
 
+void HashManager::HashStore::addFileInfo(const string& aFileName, const TTHValue& aRoot, uint32_t aTimeStamp, bool aUsed) {
     string fname = Util::getFileName(aFileName);
     string fpath = Util::getFilePath(aFileName);
 
+    ptrdiff_t k = findIndexFile(fpath, fname);
+    if (k != -1) {
+        indexRemoved[k] = true;
+        indexRemovedCount++;
+    }
+
     FileInfoList& fileList = fileIndex[fpath];
 
     FileInfoIter j = find(fileList.begin(), fileList.end(), fname);
@@ -245,23 +270,80 @@ void HashManager::HashStore::addFile(const string& aFileName, uint32_t aTimeStam
         fileList.erase(j);
     }
 
-    fileList.push_back(FileInfo(fname, tth.getRoot(), aTimeStamp, aUsed));
+    fileList.push_back(FileInfo(fname, aRoot, aTimeStamp, aUsed));
     dirty = true;
 }
 
 void HashManager::HashStore::addTree(const TigerTree& tt) noexcept {
-    if (treeIndex.find(tt.getRoot()) == treeIndex.end()) {
+    TreeInfo ti;
+    if (!findTree(tt.getRoot(), ti)) {
         try {
             File f(getDataFile(), File::READ | File::WRITE, File::OPEN);
             int64_t index = saveTree(f, tt);
-            treeIndex.insert(make_pair(tt.getRoot(), TreeInfo(tt.getFileSize(), index, tt.getBlockSize())));
-            dirty = true;
+            ti = TreeInfo(tt.getFileSize(), index, tt.getBlockSize());
+            treeIndex.insert(make_pair(tt.getRoot(), ti));
+
+            string rec(1, JOURNAL_TREE);
+            int64_t values[] = { ti.getSize(), ti.getIndex(), ti.getBlockSize() };
+            rec.append((const char*)tt.getRoot().data, TTHValue::BYTES);
+            rec.append((const char*)values, sizeof(values));
+            appendJournal(rec);
         } catch (const FileException& e) {
             LogManager::getInstance()->message(str(F_("Error saving hash data: %1%") % e.getError()));
         }
     }
 }
 
+void HashManager::HashStore::appendJournal(const string& aRecord) {
+    if (!journal.get())
+        return;
+
+    try {
+        journal->write(aRecord);
+        dirty = true;
+    } catch (const FileException& e) {
+        LogManager::getInstance()->message(str(F_("Error saving hash data: %1%") % e.getError()));
+    }
+}
+
+bool HashManager::HashStore::findTree(const TTHValue& root, TreeInfo& ti) const {
+    TreeMap::const_iterator i = treeIndex.find(root);
+    if (i != treeIndex.end()) {
+        ti = i->second;
+        return true;
+    }
+
+    const TreeRecord* end = indexTrees + indexTreeCount;
+    const TreeRecord* r = lower_bound(indexTrees, end, root, [](const TreeRecord& a, const TTHValue& b) {
+        return memcmp(a.root, b.data, TTHValue::BYTES) < 0;
+    });
+    if (r != end && memcmp(r->root, root.data, TTHValue::BYTES) == 0) {
+        ti = TreeInfo(r->size, r->index, r->blockSize);
+        return true;
+    }
+    return false;
+}
+
+ptrdiff_t HashManager::HashStore::findIndexFile(const string& fpath, const string& fname) const {
+    size_t lo = 0, hi = indexFileCount;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        const FileRecord& r = indexFiles[mid];
+        int c = strcmp(indexStrings + r.dir, fpath.c_str());
+        if (c == 0)
+            c = strcmp(indexStrings + r.name, fname.c_str());
+
+        if (c < 0) {
+            lo = mid + 1;
+        } else if (c > 0) {
+            hi = mid;
+        } else {
+            return indexRemoved[mid] ? -1 : mid;
+        }
+    }
+    return -1;
+}
+
 int64_t HashManager::HashStore::saveTree(File& f, const TigerTree& tt) {
     if (tt.getLeaves().size() == 1)
         return SMALL_TREE;
@@ -307,20 +389,20 @@ bool HashManager::HashStore::loadTree(File& f, const TreeInfo& ti, const TTHValu
 }
 
 bool HashManager::HashStore::getTree(const TTHValue& root, TigerTree& tt) {
-    TreeIter i = treeIndex.find(root);
-    if (i == treeIndex.end())
+    TreeInfo ti;
+    if (!findTree(root, ti))
         return false;
     try {
         File f(getDataFile(), File::READ, File::OPEN);
-        return loadTree(f, i->second, root, tt);
+        return loadTree(f, ti, root, tt);
     } catch (const Exception&) {
         return false;
     }
 }
 
 size_t HashManager::HashStore::getBlockSize(const TTHValue& root) const {
-    TreeMap::const_iterator i = treeIndex.find(root);
-    return i == treeIndex.end() ? 0 : i->second.getBlockSize();
+    TreeInfo ti;
+    return findTree(root, ti) ? ti.getBlockSize() : 0;
 }
 
 bool HashManager::HashStore::checkTTH(const string& aFileName, int64_t aSize, uint32_t aTimeStamp) {
@@ -331,8 +413,8 @@ bool HashManager::HashStore::checkTTH(const string& aFileName, int64_t aSize, ui
         FileInfoIter j = find(i->second.begin(), i->second.end(), fname);
         if (j != i->second.end()) {
             FileInfo& fi = *j;
-            TreeIter ti = treeIndex.find(fi.getRoot());
-            if (ti == treeIndex.end() || ti->second.getSize() != aSize || fi.getTimeStamp() != aTimeStamp) {
+            TreeInfo ti;
+            if (!findTree(fi.getRoot(), ti) || ti.getSize() != aSize || fi.getTimeStamp() != aTimeStamp) {
                 i->second.erase(j);
                 dirty = true;
                 return false;
@@ -340,10 +422,23 @@ bool HashManager::HashStore::checkTTH(const string& aFileName, int64_t aSize, ui
             return true;
         }
     }
+
+    ptrdiff_t k = findIndexFile(fpath, fname);
+    if (k != -1) {
+        const FileRecord& r = indexFiles[k];
+        TreeInfo ti;
+        if (!findTree(TTHValue(r.root), ti) || ti.getSize() != aSize || r.timeStamp != aTimeStamp) {
+            indexRemoved[k] = true;
+            indexRemovedCount++;
+            dirty = true;
+            return false;
+        }
+        return true;
+    }
     return false;
 }
 
-const TTHValue* HashManager::HashStore::getTTH(const string& aFileName) {
+bool HashManager::HashStore::getTTH(const string& aFileName, TTHValue& tth) {
     string fname = Util::getFileName(aFileName);
     string fpath = Util::getFilePath(aFileName);
 
@@ -352,14 +447,25 @@ const TTHValue* HashManager::HashStore::getTTH(const string& aFileName) {
         FileInfoIter j = find(i->second.begin(), i->second.end(), fname);
         if (j != i->second.end()) {
             j->setUsed(true);
-            return &(j->getRoot());
+            tth = j->getRoot();
+            return true;
         }
     }
-    return NULL;
+
+    ptrdiff_t k = findIndexFile(fpath, fname);
+    if (k != -1) {
+        indexUsed[k] = true;
+        // Copied out, as the index is unmapped when saved
+        tth = TTHValue(indexFiles[k].root);
+        return true;
+    }
+    return false;
 }
 
 void HashManager::HashStore::rebuild() {
     try {
+        unpackIndex();
+
         DirMap newFileIndex;
         TreeMap newTreeIndex;
 
@@ -412,70 +518,230 @@ void HashManager::HashStore::rebuild() {
         File::renameFile(tmpName, origName);
         treeIndex = newTreeIndex;
         fileIndex = newFileIndex;
-        dirty = true;
-        save();
+        writeIndex();
     } catch (const Exception& e) {
         LogManager::getInstance()->message(str(F_("Hashing failed: %1%") % e.getError()));
     }
 }
 
 void HashManager::HashStore::save() {
-    if (dirty) {
-        try {
+    if (!dirty)
+        return;
+
+    // Merge once the journal has grown to a fair share of the index, or if there's no journal
+    int64_t indexSize = index.get() ? index->getSize() : 0;
+    if (!journal.get() || journal->getSize() > max(indexSize / 4, (int64_t)1024 * 1024) ||
+        indexRemovedCount > indexFileCount / 4 + 1024)
+    {
+        writeIndex();
+        return;
+    }
+
+    try {
+        journal->flush();
+        dirty = false;
+    } catch (const FileException& e) {
+        LogManager::getInstance()->message(str(F_("Error saving hash data: %1%") % e.getError()));
+    }
+}
+
+void HashManager::HashStore::unpackIndex() {
+    for (size_t k = 0; k < indexFileCount; ++k) {
+        if (indexRemoved[k])
+            continue;
+        const FileRecord& r = indexFiles[k];
+        fileIndex[indexStrings + r.dir].push_back(FileInfo(indexStrings + r.name, TTHValue(r.root), r.timeStamp, indexUsed[k]));
+    }
+
+    for (size_t k = 0; k < indexTreeCount; ++k) {
+        const TreeRecord& r = indexTrees[k];
+        treeIndex.insert(make_pair(TTHValue(r.root), TreeInfo(r.size, r.index, r.blockSize)));
+    }
+
+    index.reset();
+    indexTrees = NULL;
+    indexTreeCount = 0;
+    indexFiles = NULL;
+    indexFileCount = 0;
+    indexStrings = NULL;
+    indexUsed.clear();
+    indexRemoved.clear();
+    indexRemovedCount = 0;
+}
+
+void HashManager::HashStore::writeIndex() {
+    unpackIndex();
+
+    try {
+        vector<TreeRecord> trees;
+        trees.reserve(treeIndex.size());
+        for (TreeIter i = treeIndex.begin(); i != treeIndex.end(); ++i) {
+            TreeRecord r;
+            memcpy(r.root, i->first.data, TTHValue::BYTES);
+            r.size = i->second.getSize();
+            r.index = i->second.getIndex();
+            r.blockSize = i->second.getBlockSize();
+            trees.push_back(r);
+        }
+        sort(trees.begin(), trees.end(), [](const TreeRecord& a, const TreeRecord& b) {
+            return memcmp(a.root, b.root, TTHValue::BYTES) < 0;
+        });
+
+        // Files ordered by directory, then name, with each directory name stored once
+        vector<DirIter> dirs;
+        for (DirIter i = fileIndex.begin(); i != fileIndex.end(); ++i) {
+            if (!i->second.empty())
+                dirs.push_back(i);
+        }
+        sort(dirs.begin(), dirs.end(), [](const DirIter& a, const DirIter& b) { return a->first < b->first; });
+
+        vector<FileRecord> files;
+        string strings;
+        for (auto i = dirs.begin(); i != dirs.end(); ++i) {
+            FileInfoList& fl = (*i)->second;
+            sort(fl.begin(), fl.end(), [](const FileInfo& a, const FileInfo& b) { return a.getFileName() < b.getFileName(); });
+
+            uint32_t dir = strings.size();
+            strings += (*i)->first;
+            strings += '\0';
+
+            for (FileInfoIter j = fl.begin(); j != fl.end(); ++j) {
+                FileRecord r;
+                memcpy(r.root, j->getRoot().data, TTHValue::BYTES);
+                r.dir = dir;
+                r.name = strings.size();
+                r.timeStamp = j->getTimeStamp();
+                r.reserved = 0;
+                files.push_back(r);
+
+                strings += j->getFileName();
+                strings += '\0';
+            }
+        }
+
+        IndexHeader h = { HASH_INDEX_MAGIC, HASH_INDEX_VERSION, trees.size(), files.size(), strings.size() };
+
+        {
             File ff(getIndexFile() + ".tmp", File::WRITE, File::CREATE | File::TRUNCATE);
             BufferedOutputStream<false> f(&ff);
+            f.write(&h, sizeof(h));
+            if (!trees.empty())
+                f.write(&trees[0], trees.size() * sizeof(TreeRecord));
+            if (!files.empty())
+                f.write(&files[0], files.size() * sizeof(FileRecord));
+            f.write(strings);
+            f.flush();
+            ff.flush();
+        }
 
-            string tmp;
-            string b32tmp;
-
-            f.write(SimpleXML::utf8Header);
-            f.write(LIT("<HashStore Version=\"" HASH_FILE_VERSION_STRING "\">\r\n"));
-
-            f.write(LIT("\t<Trees>\r\n"));
-
-            for (TreeIter i = treeIndex.begin(); i != treeIndex.end(); ++i) {
-                const TreeInfo& ti = i->second;
-                f.write(LIT("\t\t<Hash Type=\"TTH\" Index=\""));
-                f.write(Util::toString(ti.getIndex()));
-                f.write(LIT("\" BlockSize=\""));
-                f.write(Util::toString(ti.getBlockSize()));
-                f.write(LIT("\" Size=\""));
-                f.write(Util::toString(ti.getSize()));
-                f.write(LIT("\" Root=\""));
-                b32tmp.clear();
-                f.write(i->first.toBase32(b32tmp));
-                f.write(LIT("\"/>\r\n"));
-            }
+        File::deleteFile(getIndexFile());
+        File::renameFile(getIndexFile() + ".tmp", getIndexFile());
 
-            f.write(LIT("\t</Trees>\r\n\t<Files>\r\n"));
-
-            for (DirIter i = fileIndex.begin(); i != fileIndex.end(); ++i) {
-                const string& dir = i->first;
-                for (FileInfoIter j = i->second.begin(); j != i->second.end(); ++j) {
-                    const FileInfo& fi = *j;
-                    f.write(LIT("\t\t<File Name=\""));
-                    f.write(SimpleXML::escape(dir + fi.getFileName(), tmp, true));
-                    f.write(LIT("\" TimeStamp=\""));
-                    f.write(Util::toString(fi.getTimeStamp()));
-                    f.write(LIT("\" Root=\""));
-                    b32tmp.clear();
-                    f.write(fi.getRoot().toBase32(b32tmp));
-                    f.write(LIT("\"/>\r\n"));
-                }
+        // All in the index now
+        journal.reset();
+        File::deleteFile(getJournalFile());
+    } catch (const FileException& e) {
+        // Everything is still in memory, and the old files are still valid
+        LogManager::getInstance()->message(str(F_("Error saving hash data: %1%") % e.getError()));
+        return;
+    }
+
+    fileIndex.clear();
+    treeIndex.clear();
+    dirty = false;
+
+    loadIndex();
+    loadJournal();
+}
+
+void HashManager::HashStore::loadIndex() {
+    if (File::getSize(getIndexFile()) == -1)
+        return;
+
+    try {
+        unique_ptr<MappedFile> m(new MappedFile(getIndexFile()));
+        const uint8_t* p = m->getData();
+        size_t len = m->getSize();
+
+        const IndexHeader* h = reinterpret_cast<const IndexHeader*>(p);
+        bool valid = len >= sizeof(IndexHeader) && h->magic == HASH_INDEX_MAGIC && h->version == HASH_INDEX_VERSION &&
+            h->trees <= len / sizeof(TreeRecord) && h->files <= len / sizeof(FileRecord) &&
+            sizeof(IndexHeader) + h->trees * sizeof(TreeRecord) + h->files * sizeof(FileRecord) + h->strings == len &&
+            (h->files == 0 || (h->strings > 0 && h->strings <= UINT32_MAX && p[len - 1] == 0));
+
+        if (valid) {
+            indexTrees = reinterpret_cast<const TreeRecord*>(p + sizeof(IndexHeader));
+            indexFiles = reinterpret_cast<const FileRecord*>(indexTrees + h->trees);
+            indexStrings = reinterpret_cast<const char*>(indexFiles + h->files);
+            for (size_t k = 0; k < h->files && valid; ++k) {
+                valid = indexFiles[k].dir < h->strings && indexFiles[k].name < h->strings;
             }
-            f.write(LIT("\t</Files>\r\n</HashStore>"));
-            f.flush();
-            ff.close();
-            File::deleteFile( getIndexFile());
-            File::renameFile(getIndexFile() + ".tmp", getIndexFile());
+        }
 
-            dirty = false;
-        } catch (const FileException& e) {
-            LogManager::getInstance()->message(str(F_("Error saving hash data: %1%") % e.getError()));
+        if (!valid) {
+            indexTrees = NULL;
+            indexFiles = NULL;
+            indexStrings = NULL;
+            LogManager::getInstance()->message(str(F_("Invalid hash index %1%, shared files will be hashed again") % Util::addBrackets(getIndexFile())));
+            return;
         }
+
+        indexTreeCount = h->trees;
+        indexFileCount = h->files;
+        indexUsed.assign(indexFileCount, false);
+        indexRemoved.assign(indexFileCount, false);
+        indexRemovedCount = 0;
+        index = move(m);
+    } catch (const FileException& e) {
+        LogManager::getInstance()->message(str(F_("Error loading hash data: %1%") % e.getError()));
     }
 }
 
+void HashManager::HashStore::loadJournal() {
+    string data;
+    try {
+        File f(getJournalFile(), File::READ, File::OPEN);
+        data = f.read();
+    } catch (const FileException&) {
+        // No journal yet
+    }
+
+    // Replay up to the first incomplete record, which a crash may have left behind
+    size_t pos = 0;
+    while (pos < data.size()) {
+        const char* p = data.data() + pos + 1;
+        size_t left = data.size() - pos - 1;
+        if (data[pos] == JOURNAL_TREE && left >= TTHValue::BYTES + 3 * sizeof(int64_t)) {
+            int64_t values[3];
+            memcpy(values, p + TTHValue::BYTES, sizeof(values));
+            treeIndex[TTHValue((const uint8_t*)p)] = TreeInfo(values[0], values[1], values[2]);
+            pos += 1 + TTHValue::BYTES + sizeof(values);
+        } else if (data[pos] == JOURNAL_FILE && left >= TTHValue::BYTES + 2 * sizeof(uint32_t)) {
+            uint32_t timeStamp, len;
+            memcpy(&timeStamp, p + TTHValue::BYTES, sizeof(timeStamp));
+            memcpy(&len, p + TTHValue::BYTES + sizeof(timeStamp), sizeof(len));
+            size_t recLen = TTHValue::BYTES + 2 * sizeof(uint32_t) + len;
+            if (left < recLen)
+                break;
+            addFileInfo(string(p + TTHValue::BYTES + 2 * sizeof(uint32_t), len), TTHValue((const uint8_t*)p), timeStamp, false);
+            pos += 1 + recLen;
+        } else {
+            break;
+        }
+    }
+
+    try {
+        journal.reset(new File(getJournalFile(), File::RW, File::OPEN | File::CREATE));
+        journal->setPos(pos);
+        journal->setEOF();
+    } catch (const FileException& e) {
+        journal.reset();
+        LogManager::getInstance()->message(str(F_("Error saving hash data: %1%") % e.getError()));
+    }
+    // Replayed entries are safely on disk already
+    dirty = false;
+}
+
 class HashLoader: public SimpleXMLReader::CallBack {
 public:
     HashLoader(HashManager::HashStore& s) :
@@ -498,15 +764,30 @@ private:
 };
 
 void HashManager::HashStore::load() {
-    try {
-        Util::migrate(getIndexFile());
+    loadIndex();
 
-        HashLoader l(*this);
-        File f(getIndexFile(), File::READ, File::OPEN);
-        SimpleXMLReader(&l).parse(f);
-    } catch (const Exception&) {
-        // ...
+    if (!index.get()) {
+        // Migrate the index of older versions
+        Util::migrate(getXmlIndexFile());
+        if (File::getSize(getXmlIndexFile()) != -1) {
+            try {
+                HashLoader l(*this);
+                File f(getXmlIndexFile(), File::READ, File::OPEN);
+                SimpleXMLReader(&l).parse(f);
+            } catch (const Exception&) {
+                // ...
+            }
+
+            loadJournal();
+            writeIndex();
+            if (index.get()) {
+                File::renameFile(getXmlIndexFile(), getXmlIndexFile() + ".bak");
+            }
+            return;
+        }
     }
+
+    loadJournal();
 }
 
 static const string sHashStore = "HashStore";
@@ -570,7 +851,9 @@ void HashLoader::endTag(const string& name, const string&) {
 }
 
 HashManager::HashStore::HashStore() :
+    indexTrees(NULL), indexTreeCount(0), indexFiles(NULL), indexFileCount(0), indexStrings(NULL), indexRemovedCount(0),
     dirty(false) {
+    static_assert(sizeof(TTHValue) == TTHValue::BYTES, "mapped hash values are handed out as TTHValue");
 
     Util::migrate(getDataFile());
 
@@ -583,6 +866,9 @@ HashManager::HashStore::HashStore() :
     }
 }
 
+HashManager::HashStore::~HashStore() {
+}
+
 /**
  * Creates the data files for storing hash values.
  * The data file is very simple in its format. The first 8 bytes
@@ -607,9 +893,24 @@ void HashManager::HashStore::createDataFile(const string& name) {
     }
 }
 
+uint64_t HashManager::Hasher::getDevice(const string& fileName) {
+#ifdef _WIN32
+    struct _stat64 st;
+    if(_wstat64(Text::utf8ToWide(fileName).c_str(), &st) == 0)
+        return st.st_dev;
+#else
+    struct stat st;
+    if(::stat(Text::fromUtf8(fileName).c_str(), &st) == 0)
+        return st.st_dev;
+#endif
+    return 0;
+}
+
 void HashManager::Hasher::hashFile(const string& fileName, int64_t size) {
+    uint64_t device = getDevice(fileName);
+
     Lock l(cs);
-    if (w.insert(make_pair(fileName, size)).second) {
+    if (w[device].insert(make_pair(fileName, size)).second) {
         if(paused > 0)
             paused = 1 ;
         else
@@ -626,10 +927,12 @@ bool HashManager::Hasher::pause() {
 
 void HashManager::Hasher::resume() {
     Lock l(cs);
-    while(paused > 0) {
+    if(paused > 0) {
         paused = 0;
 //        printf("resume::paused: %d\n", paused);fflush(stdout);
-        s.signal();
+        for(size_t i = 0; i < workers.size(); ++i) {
+            s.signal();
+        }
     }
 }
 
@@ -638,40 +941,124 @@ bool HashManager::Hasher::isPaused() const {
     return paused > 0;
 }
 
+void HashManager::Hasher::start() {
+    // Hashing starts paused, see HashManager::on(Second)
+    pause();
+
+    int threads = max(SETTING(HASHING_THREADS), 1);
+    Lock l(cs);
+    for(int i = 0; i < threads; ++i) {
+        workers.push_back(unique_ptr<Worker>(new Worker(*this)));
+        try {
+            workers.back()->start();
+        } catch(const ThreadException& e) {
+            LogManager::getInstance()->message(str(F_("Unable to start a hashing thread: %1%") % e.getError()));
+            workers.pop_back();
+            break;
+        }
+    }
+}
+
+void HashManager::Hasher::join() {
+    for(auto i = workers.begin(); i != workers.end(); ++i) {
+        (*i)->join();
+    }
+}
+
+void HashManager::Hasher::shutdown() {
+    Lock l(cs);
+    stop = true;
+    paused = 0;
+    for(size_t i = 0; i < workers.size(); ++i) {
+        s.signal();
+    }
+}
+
+void HashManager::Hasher::scheduleRebuild() {
+    Lock l(cs);
+    rebuild = true;
+    s.signal();
+}
+
 void HashManager::Hasher::stopHashing(const string& baseDir) {
     Lock l(cs);
-    for (WorkIter i = w.begin(); i != w.end();) {
-        if (Util::strnicmp(baseDir, i->first, baseDir.length()) == 0) {
-            w.erase(i++);
-        } else {
-            ++i;
+    for (DeviceIter d = w.begin(); d != w.end(); ++d) {
+        for (WorkIter i = d->second.begin(); i != d->second.end();) {
+            if (Util::strnicmp(baseDir, i->first, baseDir.length()) == 0) {
+                d->second.erase(i++);
+            } else {
+                ++i;
+            }
         }
     }
 }
 
 void HashManager::Hasher::getStats(string& curFile, int64_t& bytesLeft, size_t& filesLeft) {
     Lock l(cs);
-    curFile = currentFile;
-    filesLeft = w.size();
-    if (running)
-        filesLeft++;
+    curFile.clear();
+    filesLeft = 0;
     bytesLeft = 0;
-    for (WorkMap::const_iterator i = w.begin(); i != w.end(); ++i) {
-        bytesLeft += i->second;
+    for (auto i = workers.begin(); i != workers.end(); ++i) {
+        const Worker& worker = **i;
+        if (worker.running)
+            filesLeft++;
+        if (curFile.empty())
+            curFile = worker.currentFile;
+        bytesLeft += worker.currentSize;
+    }
+    for (DeviceMap::const_iterator d = w.begin(); d != w.end(); ++d) {
+        filesLeft += d->second.size();
+        for (WorkMap::const_iterator i = d->second.begin(); i != d->second.end(); ++i) {
+            bytesLeft += i->second;
+        }
     }
-    bytesLeft += currentSize;
 }
 
-void HashManager::Hasher::instantPause() {
-    bool wait = false;
-    {
-        Lock l(cs);
-        if(paused > 0) {
-            wait = true;
+bool HashManager::Hasher::next(Worker& worker, string& fname) {
+    Lock l(cs);
+
+    auto isFree = [&](DeviceIter d) -> bool {
+        if (d->second.empty())
+            return false;
+        for (auto i = workers.begin(); i != workers.end(); ++i) {
+            if (i->get() != &worker && (*i)->running && (*i)->device == d->first)
+                return false;
         }
+        return true;
+    };
+
+    DeviceIter d = w.find(worker.device);
+    if (d == w.end() || !isFree(d)) {
+        // Take a device no other worker is reading from
+        for (d = w.begin(); d != w.end() && !isFree(d); ++d)
+            ;
+        if (d == w.end())
+            return false;
     }
-    if(wait) {
-//        printf("wait2: %d\n", wait); fflush(stdout);
+
+    worker.device = d->first;
+    worker.running = true;
+    worker.currentFile = fname = d->second.begin()->first;
+    worker.currentSize = d->second.begin()->second;
+    d->second.erase(d->second.begin());
+    if (d->second.empty())
+        w.erase(d);
+    return true;
+}
+
+void HashManager::Hasher::updateSize(Worker& worker, int64_t read) {
+    Lock l(cs);
+    worker.currentSize = max(worker.currentSize - read, static_cast<int64_t>(0));
+}
+
+void HashManager::Hasher::instantPause() {
+    for(;;) {
+        {
+            Lock l(cs);
+            if(paused == 0 || stop)
+                return;
+        }
+//        printf("wait2\n"); fflush(stdout);
         s.wait();
     }
 }
@@ -679,7 +1066,7 @@ void HashManager::Hasher::instantPause() {
 #ifdef _WIN32
 #define BUF_SIZE (256*1024)
 
-bool HashManager::Hasher::fastHash(const string& fname, uint8_t* buf, TigerTree& tth, int64_t size, CRC32Filter* xcrc32) {
+bool HashManager::Hasher::fastHash(Worker& worker, const string& fname, uint8_t* buf, TigerTree& tth, int64_t size, CRC32Filter* xcrc32) {
     HANDLE h = INVALID_HANDLE_VALUE;
     DWORD x, y;
     if (!GetDiskFreeSpaceW(Text::utf8ToWide(Util::getFilePath(fname)).c_str(), &y, &x, &y, &y)) {
@@ -748,10 +1135,7 @@ bool HashManager::Hasher::fastHash(const string& fname, uint8_t* buf, TigerTree&
         if (xcrc32)
             (*xcrc32)(hbuf, hn);
 
-        {
-            Lock l(cs);
-            currentSize = max(currentSize - hn, _LL(0));
-        }
+        updateSize(worker, hn);
 
         if (size == 0) {
             ok = true;
@@ -790,7 +1174,12 @@ bool HashManager::Hasher::fastHash(const string& fname, uint8_t* buf, TigerTree&
 
 #else // !_WIN32
 
-static sigjmp_buf sb_env;
+// Several hashing threads may be in fastHash at once: each one has its own jump target, and the
+// handler stays installed as long as any of them needs it.
+static __thread sigjmp_buf* sb_env = NULL;
+static CriticalSection sb_cs;
+static unsigned sb_users = 0;
+static struct sigaction sb_oldact;
 
 static void sigbus_handler(int signum
 #ifndef __HAIKU__
@@ -800,12 +1189,46 @@ static void sigbus_handler(int signum
     // Jump back to the fastHash which will return error. Apparently truncating
     // a file in Solaris sets si_code to BUS_OBJERR
 #ifndef __HAIKU__
-       if (signum == SIGBUS && (info->si_code == BUS_ADRERR || info->si_code == BUS_OBJERR))
-        siglongjmp(sb_env, 1);
+       if (signum == SIGBUS && sb_env && (info->si_code == BUS_ADRERR || info->si_code == BUS_OBJERR))
+        siglongjmp(*sb_env, 1);
+#endif
+    // Not ours; let the fault happen again with the previous handler
+    sigaction(SIGBUS, &sb_oldact, NULL);
+}
+
+static bool installSigbusHandler() {
+    Lock l(sb_cs);
+    if (sb_users == 0) {
+        struct sigaction act;
+        sigset_t signalset;
+
+        sigemptyset(&signalset);
+
+        act.sa_handler = NULL;
+#ifndef __HAIKU__
+        act.sa_sigaction = sigbus_handler;
 #endif
+        act.sa_mask = signalset;
+#ifdef SA_SIGINFO
+        act.sa_flags = SA_SIGINFO;
+#else
+        act.sa_flags = NULL;
+#endif
+        if (sigaction(SIGBUS, &act, &sb_oldact) == -1)
+            return false;
+    }
+    sb_users++;
+    return true;
 }
 
-bool HashManager::Hasher::fastHash(const string& filename, uint8_t* , TigerTree& tth, int64_t size, CRC32Filter* xcrc32) {
+static void removeSigbusHandler() {
+    Lock l(sb_cs);
+    if (--sb_users == 0 && sigaction(SIGBUS, &sb_oldact, NULL) == -1) {
+        dcdebug("Failed to reset old signal handler for SIGBUS\n");
+    }
+}
+
+bool HashManager::Hasher::fastHash(Worker& worker, const string& filename, uint8_t* , TigerTree& tth, int64_t size, CRC32Filter* xcrc32) {
     instantPause();
 
     static StreamStore streamStore;
@@ -832,22 +1255,8 @@ bool HashManager::Hasher::fastHash(const string& filename, uint8_t* , TigerTree&
 
     // Prepare and setup a signal handler in case of SIGBUS during mmapped file reads.
     // SIGBUS can be sent when the file is truncated or in case of read errors.
-    struct sigaction act, oldact;
-    sigset_t signalset;
-
-    sigemptyset(&signalset);
-
-    act.sa_handler = NULL;
-#ifndef __HAIKU__
-    act.sa_sigaction = sigbus_handler;
-#endif
-    act.sa_mask = signalset;
-#ifdef SA_SIGINFO
-    act.sa_flags = SA_SIGINFO | SA_RESETHAND;
-#else
-    act.sa_flags = NULL;
-#endif
-    if (sigaction(SIGBUS, &act, &oldact) == -1) {
+    sigjmp_buf env;
+    if (!installSigbusHandler()) {
         dcdebug("Failed to set signal handler for fastHash\n");
         close(fd);
         return false;   // Better luck with the slow hash.
@@ -871,7 +1280,8 @@ bool HashManager::Hasher::fastHash(const string& filename, uint8_t* , TigerTree&
         break;
         }
 
-        if (sigsetjmp(sb_env, 1)) {
+        sb_env = &env;
+        if (sigsetjmp(env, 1)) {
             dcdebug("Caught SIGBUS for file %s\n", filename.c_str());
             break;
         }
@@ -899,10 +1309,7 @@ bool HashManager::Hasher::fastHash(const string& filename, uint8_t* , TigerTree&
         if(xcrc32)
             (*xcrc32)(buf, size_read);
 
-        {
-            Lock l(cs);
-            currentSize = max(static_cast<uint64_t>(currentSize - size_read), static_cast<uint64_t>(0));
-        }
+        updateSize(worker, size_read);
 
         if (munmap(buf, size_read) == -1) {
             dcdebug("Error calling munmap for file %s: %s\n", filename.c_str(), Util::translateError(errno).c_str());
@@ -925,9 +1332,8 @@ bool HashManager::Hasher::fastHash(const string& filename, uint8_t* , TigerTree&
 
     close(fd);
 
-    if (sigaction(SIGBUS, &oldact, NULL) == -1) {
-        dcdebug("Failed to reset old signal handler for SIGBUS\n");
-    }
+    sb_env = NULL;
+    removeSigbusHandler();
 
     if (ok)
         streamStore.saveTree(filename, tth);
@@ -936,44 +1342,54 @@ bool HashManager::Hasher::fastHash(const string& filename, uint8_t* , TigerTree&
 }
 
 #endif // !_WIN32
-int HashManager::Hasher::run() {
-    setThreadPriority(Thread::IDLE);
-    setThreadName("Hasher");
+int HashManager::Hasher::run(Worker& worker) {
+    Thread::Priority curPriority = static_cast<Thread::Priority>(priority.load());
+    worker.setThreadPriority(curPriority);
     uint8_t* buf = NULL;
     bool virtualBuf = true;
     string fname;
-    bool last = false;
-    pause();
     for(;;) {
-
-        if (w.empty()) {
-            s.wait();
-        }
+        instantPause();
 
         if(stop)
             break;
         if(rebuild) {
-            HashManager::getInstance()->doRebuild();
-            rebuild = false;
-            LogManager::getInstance()->message(_("Hash database rebuilt"));
+            bool doRebuild;
+            {
+                Lock l(cs);
+                doRebuild = rebuild;
+                rebuild = false;
+            }
+            if(doRebuild) {
+                HashManager::getInstance()->doRebuild();
+                LogManager::getInstance()->message(_("Hash database rebuilt"));
+            }
             continue;
         }
-        {
-            Lock l(cs);
-            if(!w.empty()) {
-                currentFile = fname = w.begin()->first;
-                currentSize = w.begin()->second;
-                w.erase(w.begin());
-                last = w.empty();
-            } else {
-                last = true;
-                fname.clear();
+
+        if(!next(worker, fname)) {
+            // Free the buffer while idle
+            if(buf != NULL) {
+                if(virtualBuf) {
+#ifdef _WIN32
+                    VirtualFree(buf, 0, MEM_RELEASE);
+#endif
+                } else {
+                    delete [] buf;
+                }
+                buf = NULL;
             }
+            s.wait();
+            continue;
+        }
+
+        Thread::Priority newPriority = static_cast<Thread::Priority>(priority.load());
+        if(curPriority != newPriority) {
+            curPriority = newPriority;
+            worker.setThreadPriority(curPriority);
         }
-        running = true;
-        instantPause();
 
-        if(!fname.empty()) {
+        {
             int64_t size = File::getSize(fname);
 #ifdef _WIN32
             if(buf == NULL) {
@@ -1007,9 +1423,9 @@ int HashManager::Hasher::run() {
                 tth = &fastTTH;
 
 #ifdef _WIN32
-                if(!virtualBuf || !BOOLSETTING(FAST_HASH) || !fastHash(fname, buf, fastTTH, size, xcrc32)) {
+                if(!virtualBuf || !BOOLSETTING(FAST_HASH) || !fastHash(worker, fname, buf, fastTTH, size, xcrc32)) {
 #else
-                if(!BOOLSETTING(FAST_HASH) || !fastHash(fname, 0, fastTTH, size, xcrc32)) {
+                if(!BOOLSETTING(FAST_HASH) || !fastHash(worker, fname, 0, fastTTH, size, xcrc32)) {
 #endif
                     tth = &slowTTH;
                     crc32 = CRC32Filter();
@@ -1032,10 +1448,7 @@ int HashManager::Hasher::run() {
                         if(xcrc32)
                             (*xcrc32)(buf, n);
 
-                        {
-                            Lock l(cs);
-                            currentSize = max(static_cast<uint64_t>(currentSize - n), static_cast<uint64_t>(0));
-                        }
+                        updateSize(worker, n);
 
                     instantPause();
                     } while (n> 0 && !stop);
@@ -1056,26 +1469,27 @@ int HashManager::Hasher::run() {
                 } catch(const FileException& e) {
                     LogManager::getInstance()->message(str(F_("Error hashing %1%: %2%") % Util::addBrackets(fname) % e.getError()));
                 }
-            }
-            {
-                Lock l(cs);
-                currentFile.clear();
-                currentSize = 0;
-            }
-            running = false;
-            if(buf != NULL && (last || stop)) {
-                if(virtualBuf) {
+        }
+
+        {
+            Lock l(cs);
+            worker.running = false;
+            worker.currentFile.clear();
+            worker.currentSize = 0;
+        }
+    }
+
+    if(buf != NULL) {
+        if(virtualBuf) {
 #ifdef _WIN32
-                    VirtualFree(buf, 0, MEM_RELEASE);
+            VirtualFree(buf, 0, MEM_RELEASE);
 #endif
-                } else {
-                    delete [] buf;
-                }
-                buf = NULL;
-            }
+        } else {
+            delete [] buf;
         }
-        return 0;
     }
+    return 0;
+}
 
 HashManager::HashPauser::HashPauser() {
     resume = !HashManager::getInstance()->isHashingPaused();
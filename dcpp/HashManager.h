@@ -18,6 +18,8 @@
 
 #pragma once
 
+#include <atomic>
+
 #include "Singleton.h"
 #include "MerkleTree.h"
 #include "Thread.h"
@@ -29,6 +31,7 @@
 #include "Text.h"
 #include "Streams.h"
 #include "HashManagerListener.h"
+#include "MappedFile.h"
 
 #ifdef USE_XATTR
 #include "attr/attributes.h"
@@ -72,7 +75,7 @@ public:
     TTHValue getTTH(const string& aFileName, int64_t aSize);
 
     /** eiskaltdc++ **/
-    const TTHValue* getFileTTHif(const string& aFileName);
+    bool getFileTTHif(const string& aFileName, TTHValue& tth);
 
     bool getTree(const TTHValue& root, TigerTree& tt);
 
@@ -116,9 +119,15 @@ public:
     bool isHashingPaused() const;
 
 private:
-    class Hasher : public Thread {
+    /**
+     * Hashes queued files with a pool of HASHING_THREADS workers. Files are queued by the device
+     * they are on, and each device is read by one worker at a time, so that reads stay sequential
+     * on each disk while several disks (and cores) are busy at once.
+     */
+    class Hasher {
     public:
-        Hasher() : stop(false), running(false), paused(0), rebuild(false), currentSize(0) { }
+        Hasher() : stop(false), paused(0), rebuild(false), priority(Thread::IDLE) { }
+        ~Hasher() { join(); }
 
         void hashFile(const string& fileName, int64_t size);
 
@@ -127,38 +136,79 @@ private:
         void resume();
         bool isPaused() const;
 
+        void start();
+        void join();
+        /** Applied by each worker before its next file; may be called from any thread */
+        void setThreadPriority(Thread::Priority p) { priority = p; }
+
         void stopHashing(const string& baseDir);
-        virtual int run();
-        bool fastHash(const string& fname, uint8_t* buf, TigerTree& tth, int64_t size, CRC32Filter* xcrc32);
         void getStats(string& curFile, int64_t& bytesLeft, size_t& filesLeft);
-        void shutdown() { stop = true; if(paused){ s.signal(); resume();} s.signal(); }
-        void scheduleRebuild() { rebuild = true; if(paused) s.signal(); s.signal(); }
+        void shutdown();
+        void scheduleRebuild();
 
     private:
+        class Worker : public Thread {
+        public:
+            Worker(Hasher& aHasher) : hasher(aHasher), running(false), device(0), currentSize(0) { }
+            virtual int run() {
+                setThreadName("Hasher");
+                return hasher.run(*this);
+            }
+
+        private:
+            friend class Hasher;
+
+            Hasher& hasher;
+
+            // Protected by Hasher::cs
+            bool running;
+            uint64_t device;
+            string currentFile;
+            int64_t currentSize;
+        };
+
         // Case-sensitive (faster), it is rather unlikely that case changes, and if it does it's harmless.
         // map because it's sorted (to avoid random hash order that would create quite strange shares while hashing)
         typedef map<string, int64_t> WorkMap;
         typedef WorkMap::iterator WorkIter;
+        /** Files to hash by device (st_dev) */
+        typedef map<uint64_t, WorkMap> DeviceMap;
+        typedef DeviceMap::iterator DeviceIter;
 
-        WorkMap w;
+        DeviceMap w;
+        vector<unique_ptr<Worker>> workers;
         mutable CriticalSection cs;
+        /** Signaled when files are added, when resuming and when stopping */
         Semaphore s;
 
         bool stop;
-        bool running;
         unsigned paused;
         bool rebuild;
-        string currentFile;
-        int64_t currentSize;
-
+        /** A Thread::Priority, read by the workers without locking */
+        std::atomic<int> priority;
+
+        int run(Worker& worker);
+        /** Pick the next file for a worker, preferably from the device it was reading */
+        bool next(Worker& worker, string& fname);
+        bool fastHash(Worker& worker, const string& fname, uint8_t* buf, TigerTree& tth, int64_t size, CRC32Filter* xcrc32);
+        void updateSize(Worker& worker, int64_t read);
         void instantPause();
+
+        static uint64_t getDevice(const string& fileName);
     };
 
     friend class Hasher;
 
+    /**
+     * The file and tree indices live in HashIndex.dat, which is mapped into memory and looked up in
+     * place. Hashes added since it was written are kept in memory and appended to
+     * HashIndex.journal; once the journal has grown enough, save() merges everything into a new
+     * HashIndex.dat.
+     */
     class HashStore {
     public:
         HashStore();
+        ~HashStore();
         void addFile(const string& aFileName, uint32_t aTimeStamp, const TigerTree& tth, bool aUsed);
 
         void load();
@@ -169,7 +219,7 @@ private:
         bool checkTTH(const string& aFileName, int64_t aSize, uint32_t aTimeStamp);
 
         void addTree(const TigerTree& tt) noexcept;
-        const TTHValue* getTTH(const string& aFileName);
+        bool getTTH(const string& aFileName, TTHValue& tth);
         bool getTree(const TTHValue& root, TigerTree& tth);
         size_t getBlockSize(const TTHValue& root) const;
         bool isDirty() { return dirty; }
@@ -211,17 +261,73 @@ private:
 
         friend class HashLoader;
 
+        /** Hashes that aren't in the mapped index yet, or that replace its entries */
         DirMap fileIndex;
         TreeMap treeIndex;
 
+        /** Layout of HashIndex.dat: header, trees sorted by root, files sorted by directory and name, strings */
+        struct IndexHeader {
+            uint32_t magic;
+            uint32_t version;
+            uint64_t trees;
+            uint64_t files;
+            uint64_t strings;
+        };
+        struct TreeRecord {
+            uint8_t root[TTHValue::BYTES];
+            int64_t size;
+            int64_t index;
+            int64_t blockSize;
+        };
+        struct FileRecord {
+            uint8_t root[TTHValue::BYTES];
+            /** Offsets of null-terminated strings */
+            uint32_t dir;
+            uint32_t name;
+            uint32_t timeStamp;
+            uint32_t reserved;
+        };
+
+        unique_ptr<MappedFile> index;
+        const TreeRecord* indexTrees;
+        size_t indexTreeCount;
+        const FileRecord* indexFiles;
+        size_t indexFileCount;
+        const char* indexStrings;
+        /** Per mapped file record */
+        vector<bool> indexUsed;
+        vector<bool> indexRemoved;
+        size_t indexRemovedCount;
+
+        unique_ptr<File> journal;
+
+        /** Changes not written to HashIndex.dat nor flushed to the journal */
         bool dirty;
 
         void createDataFile(const string& name);
 
+        /** Add to fileIndex, hiding the mapped entry for the file if any */
+        void addFileInfo(const string& aFileName, const TTHValue& aRoot, uint32_t aTimeStamp, bool aUsed);
+
+        void loadIndex();
+        void loadJournal();
+        void appendJournal(const string& aRecord);
+        /** Write fileIndex and treeIndex along with the mapped entries to a new HashIndex.dat */
+        void writeIndex();
+        /** Move the mapped entries into fileIndex and treeIndex and unmap the index */
+        void unpackIndex();
+
+        bool findTree(const TTHValue& root, TreeInfo& ti) const;
+        /** @return Index of a mapped file record that hasn't been replaced or removed, or -1 */
+        ptrdiff_t findIndexFile(const string& fpath, const string& fname) const;
+
         bool loadTree(File& dataFile, const TreeInfo& ti, const TTHValue& root, TigerTree& tt);
         int64_t saveTree(File& dataFile, const TigerTree& tt);
 
-        string getIndexFile() { return Util::getPath(Util::PATH_USER_CONFIG) + "HashIndex.xml"; }
+        string getIndexFile() { return Util::getPath(Util::PATH_USER_CONFIG) + "HashIndex.dat"; }
+        string getJournalFile() { return Util::getPath(Util::PATH_USER_CONFIG) + "HashIndex.journal"; }
+        /** Index of older versions, migrated on first load */
+        string getXmlIndexFile() { return Util::getPath(Util::PATH_USER_CONFIG) + "HashIndex.xml"; }
         string getDataFile() { return Util::getPath(Util::PATH_USER_CONFIG) + "HashData.dat"; }
     };
 
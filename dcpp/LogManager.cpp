@@ -25,6 +25,20 @@
 
 namespace dcpp {
 
+namespace {
+
+/** How often the writer flushes the queue (ms) */
+const uint32_t FLUSH_INTERVAL = 500;
+/** Queued bytes that wake the writer before its flush is due */
+const size_t FLUSH_SIZE = 64 * 1024;
+/** Queued bytes that make loggers wait for the writer */
+const size_t MAX_QUEUE = 4 * 1024 * 1024;
+const size_t MAX_OPEN_FILES = 16;
+/** Files unused for this long are closed, so that they can be moved or deleted meanwhile (ms) */
+const uint64_t MAX_IDLE = 60 * 1000;
+
+}
+
 void LogManager::log(Area area, StringMap& params) noexcept {
     log(getPath(area, params), Util::formatParams(getSetting(area, FORMAT), params, false));
 }
@@ -69,6 +83,10 @@ void LogManager::saveSetting(int area, int sel, const string& setting) {
 }
 
 void LogManager::log(const string& area, const string& msg) noexcept {
+    if(queueLine(area, msg))
+        return;
+
+    // No writer thread (anymore)
     Lock l(cs);
     try {
         string aArea = Util::validateFileName(area);
@@ -81,7 +99,117 @@ void LogManager::log(const string& area, const string& msg) noexcept {
     }
 }
 
-LogManager::LogManager() {
+bool LogManager::queueLine(const string& area, const string& msg) noexcept {
+    bool wake;
+    {
+        FastLock l(queueCs);
+        while(queueBytes >= MAX_QUEUE && running && !stopping) {
+            waiting++;
+            queueCs.unlock();
+            s.signal();
+            drained.wait();
+            queueCs.lock();
+        }
+        if(!running || stopping)
+            return false;
+
+        queue.push_back(make_pair(area, msg));
+        size_t before = queueBytes;
+        queueBytes += area.size() + msg.size();
+        wake = before < FLUSH_SIZE && queueBytes >= FLUSH_SIZE;
+    }
+    if(wake)
+        s.signal();
+    return true;
+}
+
+int LogManager::run() {
+    setThreadName("LogManager");
+    LineList lines;
+    for(;;) {
+        s.wait(FLUSH_INTERVAL);
+
+        bool stop;
+        {
+            FastLock l(queueCs);
+            lines.swap(queue);
+            queueBytes = 0;
+            for(; waiting > 0; --waiting)
+                drained.signal();
+            stop = stopping;
+        }
+
+        write(lines);
+        lines.clear();
+        closeFiles(stop ? 0 : MAX_IDLE);
+
+        if(stop)
+            break;
+    }
+    return 0;
+}
+
+void LogManager::write(const LineList& lines) noexcept {
+    // Gather the lines of each file, so that each one gets a single write
+    unordered_map<string, string> text;
+    StringList order;
+    for(auto i = lines.begin(); i != lines.end(); ++i) {
+        auto j = text.find(i->first);
+        if(j == text.end()) {
+            j = text.insert(make_pair(i->first, string())).first;
+            order.push_back(i->first);
+        }
+        j->second += i->second;
+        j->second += "\r\n";
+    }
+
+    for(auto i = order.begin(); i != order.end(); ++i) {
+        try {
+            File* f = getFile(*i);
+            // Someone else may have appended meanwhile
+            f->setEndPos(0);
+            f->write(text[*i]);
+        } catch (const FileException&) {
+            // ...
+        }
+    }
+}
+
+File* LogManager::getFile(const string& path) {
+    uint64_t now = GET_TICK();
+    for(auto i = files.begin(); i != files.end(); ++i) {
+        if(i->path == path) {
+            i->lastUse = now;
+            return i->file;
+        }
+    }
+
+    if(files.size() >= MAX_OPEN_FILES) {
+        auto lru = min_element(files.begin(), files.end(), [](const OpenFile& a, const OpenFile& b) { return a.lastUse < b.lastUse; });
+        delete lru->file;
+        files.erase(lru);
+    }
+
+    string aArea = Util::validateFileName(path);
+    File::ensureDirectory(aArea);
+    OpenFile f = { path, new File(aArea, File::WRITE, File::OPEN | File::CREATE | File::SHARED), now };
+    files.push_back(f);
+    return f.file;
+}
+
+void LogManager::closeFiles(uint64_t aIdle) noexcept {
+    uint64_t now = GET_TICK();
+    for(auto i = files.begin(); i != files.end();) {
+        if(now - i->lastUse >= aIdle) {
+            delete i->file;
+            i = files.erase(i);
+        } else {
+            ++i;
+        }
+    }
+}
+
+LogManager::LogManager() : queueBytes(0), waiting(0), running(false), stopping(false) {
     options[UPLOAD][FILE]              = SettingsManager::LOG_FILE_UPLOAD;
     options[UPLOAD][FORMAT]            = SettingsManager::LOG_FORMAT_POST_UPLOAD;
     options[DOWNLOAD][FILE]            = SettingsManager::LOG_FILE_DOWNLOAD;
@@ -100,9 +228,25 @@ LogManager::LogManager() {
     options[SPY][FORMAT]               = SettingsManager::LOG_FORMAT_SPY;
     options[CMD_DEBUG][FILE]           = SettingsManager::LOG_FILE_CMD_DEBUG;
     options[CMD_DEBUG][FORMAT]         = SettingsManager::LOG_FORMAT_CMD_DEBUG;
+
+    try {
+        start();
+        running = true;
+    } catch(const ThreadException& e) {
+        dcdebug("LogManager: %s\n", e.getError().c_str());
+    }
 }
 
 LogManager::~LogManager() {
+    if(running) {
+        {
+            FastLock l(queueCs);
+            stopping = true;
+        }
+        s.signal();
+        join();
+        running = false;
+    }
 }
 
 } // namespace dcpp
@@ -20,13 +20,19 @@
 
 #include "typedefs.h"
 #include "CriticalSection.h"
+#include "Semaphore.h"
+#include "Thread.h"
 #include "Singleton.h"
 #include "Speaker.h"
 #include "LogManagerListener.h"
 
 namespace dcpp {
 
-class LogManager : public Singleton<LogManager>, public Speaker<LogManagerListener>
+/**
+ * Logs are written by a thread of their own: log() only queues the line, and the thread writes the
+ * lines of each file together, keeping the most recently used files open.
+ */
+class LogManager : public Singleton<LogManager>, public Speaker<LogManagerListener>, private Thread
 {
 public:
     typedef pair<time_t, string> Pair;
@@ -46,12 +52,42 @@ public:
     void saveSetting(int area, int sel, const string& setting);
 
 private:
+    /** File, line */
+    typedef vector<pair<string, string> > LineList;
+
+    struct OpenFile {
+        string path;
+        File* file;
+        uint64_t lastUse;
+    };
+
     void log(const string& area, const string& msg) noexcept;
+    /** @return false if there's no writer thread to take the line */
+    bool queueLine(const string& area, const string& msg) noexcept;
+
+    virtual int run();
+    void write(const LineList& lines) noexcept;
+    File* getFile(const string& path);
+    void closeFiles(uint64_t aIdle) noexcept;
 
     friend class Singleton<LogManager>;
     CriticalSection cs;
     List lastLogs;
 
+    FastCriticalSection queueCs;
+    LineList queue;
+    size_t queueBytes;
+    /** Loggers waiting for the queue to drain */
+    int waiting;
+    bool running;
+    bool stopping;
+    /** Wakes the writer before its next flush is due */
+    Semaphore s;
+    Semaphore drained;
+
+    /** Only used by the writer */
+    vector<OpenFile> files;
+
     int options[LAST][2];
 
     LogManager();
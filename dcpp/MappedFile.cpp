@@ -0,0 +1,114 @@
+/*
+ * Copyright (C) 2001-2012 Jacek Sieka, arnetheduck on gmail point com
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "stdinc.h"
+#include "MappedFile.h"
+
+#include "Text.h"
+#include "Util.h"
+
+#ifdef _WIN32
+#include "w.h"
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#endif
+
+namespace dcpp {
+
+#ifdef _WIN32
+
+MappedFile::MappedFile(const string& aFileName) : data(0), size(0), file(INVALID_HANDLE_VALUE), mapping(NULL) {
+    file = ::CreateFileW(Text::utf8ToWide(aFileName).c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_RANDOM_ACCESS, NULL);
+    if(file == INVALID_HANDLE_VALUE)
+        throw FileException(Util::translateError(GetLastError()));
+
+    LARGE_INTEGER li;
+    if(!::GetFileSizeEx(file, &li)) {
+        DWORD err = GetLastError();
+        ::CloseHandle(file);
+        throw FileException(Util::translateError(err));
+    }
+    size = static_cast<size_t>(li.QuadPart);
+
+    // Empty files can't be mapped
+    if(size == 0)
+        return;
+
+    mapping = ::CreateFileMapping(file, NULL, PAGE_READONLY, 0, 0, NULL);
+    if(mapping != NULL)
+        data = (const uint8_t*)::MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+
+    if(data == NULL) {
+        DWORD err = GetLastError();
+        if(mapping != NULL)
+            ::CloseHandle(mapping);
+        ::CloseHandle(file);
+        throw FileException(Util::translateError(err));
+    }
+}
+
+MappedFile::~MappedFile() {
+    if(data != NULL)
+        ::UnmapViewOfFile(data);
+    if(mapping != NULL)
+        ::CloseHandle(mapping);
+    ::CloseHandle(file);
+}
+
+#else // !_WIN32
+
+MappedFile::MappedFile(const string& aFileName) : data(0), size(0) {
+    int fd = ::open(Text::fromUtf8(aFileName).c_str(), O_RDONLY);
+    if(fd == -1)
+        throw FileException(Util::translateError(errno));
+
+    struct stat st;
+    if(::fstat(fd, &st) == -1) {
+        int err = errno;
+        ::close(fd);
+        throw FileException(Util::translateError(err));
+    }
+    size = static_cast<size_t>(st.st_size);
+
+    // Empty files can't be mapped
+    if(size > 0) {
+        void* p = ::mmap(0, size, PROT_READ, MAP_SHARED, fd, 0);
+        if(p == MAP_FAILED) {
+            int err = errno;
+            ::close(fd);
+            throw FileException(Util::translateError(err));
+        }
+        data = (const uint8_t*)p;
+    }
+
+    // The mapping stays valid once the descriptor is closed
+    ::close(fd);
+}
+
+MappedFile::~MappedFile() {
+    if(data != NULL)
+        ::munmap((void*)data, size);
+}
+
+#endif // !_WIN32
+
+} // namespace dcpp
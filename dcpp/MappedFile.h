@@ -0,0 +1,46 @@
+/*
+ * Copyright (C) 2001-2012 Jacek Sieka, arnetheduck on gmail point com
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#pragma once
+
+#include "Streams.h"
+#include "noexcept.h"
+
+namespace dcpp {
+
+/** A whole file mapped read-only into memory */
+class MappedFile : boost::noncopyable {
+public:
+    /** @throw FileException if the file can't be opened or mapped */
+    MappedFile(const string& aFileName);
+    ~MappedFile();
+
+    const uint8_t* getData() const noexcept { return data; }
+    size_t getSize() const noexcept { return size; }
+
+private:
+    const uint8_t* data;
+    size_t size;
+
+#ifdef _WIN32
+    HANDLE file;
+    HANDLE mapping;
+#endif
+};
+
+} // namespace dcpp
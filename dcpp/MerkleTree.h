@@ -97,19 +97,21 @@ public:
         if(len == 0 && !(leaves.empty() && blocks.empty()))
             return;
 
-        do {
-            size_t n = min(baseBlockSize, len-i);
-            Hasher h;
-            h.update(&zero, 1);
-            h.update(buf + i, n);
-            if((int64_t)baseBlockSize < blockSize) {
-                blocks.push_back(make_pair(MerkleValue(h.finalize()), baseBlockSize));
-                reduceBlocks();
-            } else {
-                leaves.push_back(MerkleValue(h.finalize()));
-            }
-            i += n;
-        } while(i < len);
+        // Full base blocks are hashed Hasher::LANES at a time
+        for(; len - i >= Hasher::LANES * baseBlockSize; i += Hasher::LANES * baseBlockSize) {
+            updateLanes(buf + i);
+        }
+
+        if(i < len || len == 0) {
+            do {
+                size_t n = min(baseBlockSize, len-i);
+                Hasher h;
+                h.update(&zero, 1);
+                h.update(buf + i, n);
+                addLeaf(MerkleValue(h.finalize()));
+                i += n;
+            } while(i < len);
+        }
         fileSize += len;
     }
 
@@ -196,6 +198,36 @@ private:
         return MerkleValue(h.finalize());
     }
 
+    /** Hash Hasher::LANES consecutive base blocks */
+    void updateLanes(const uint8_t* buf) {
+        uint8_t in[Hasher::LANES][baseBlockSize + 1];
+        uint8_t out[Hasher::LANES][Hasher::BYTES];
+        const uint8_t* inp[Hasher::LANES];
+        uint8_t* outp[Hasher::LANES];
+
+        for(size_t l = 0; l < Hasher::LANES; ++l) {
+            in[l][0] = 0;
+            memcpy(in[l] + 1, buf + l * baseBlockSize, baseBlockSize);
+            inp[l] = in[l];
+            outp[l] = out[l];
+        }
+
+        Hasher::hashLanes(inp, baseBlockSize + 1, outp);
+
+        for(size_t l = 0; l < Hasher::LANES; ++l) {
+            addLeaf(MerkleValue(out[l]));
+        }
+    }
+
+    void addLeaf(const MerkleValue& leaf) {
+        if((int64_t)baseBlockSize < blockSize) {
+            blocks.push_back(make_pair(leaf, baseBlockSize));
+            reduceBlocks();
+        } else {
+            leaves.push_back(leaf);
+        }
+    }
+
     void reduceBlocks() {
         while(blocks.size() > 1) {
             MerkleBlock& a = blocks[blocks.size()-2];
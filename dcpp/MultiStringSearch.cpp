@@ -0,0 +1,110 @@
+/*
+ * Copyright (C) 2001-2012 Jacek Sieka, arnetheduck on gmail point com
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "stdinc.h"
+#include "MultiStringSearch.h"
+
+#include "Text.h"
+
+namespace dcpp {
+
+MultiStringSearch::Mask MultiStringSearch::add(const string& aPattern) noexcept {
+    if(aPattern.empty())
+        return 0;
+
+    string pattern = Text::toLower(aPattern);
+    auto i = find(patterns.begin(), patterns.end(), pattern);
+    if(i != patterns.end())
+        return Mask(1) << (i - patterns.begin());
+
+    if(patterns.size() >= MAX_PATTERNS)
+        return 0;
+
+    patterns.push_back(pattern);
+    compile();
+    return Mask(1) << (patterns.size() - 1);
+}
+
+void MultiStringSearch::clear() noexcept {
+    patterns.clear();
+    compile();
+}
+
+MultiStringSearch::Mask MultiStringSearch::match(const string& aText) const noexcept {
+    string lower;
+    Text::toLower(aText, lower);
+    return matchLower(lower.data(), lower.length());
+}
+
+void MultiStringSearch::compile() noexcept {
+    // Only distinguish the bytes that appear in some pattern
+    memset(charClass, 0, sizeof(charClass));
+    classes = 1;
+    size_t states = 1;
+    for(auto i = patterns.begin(); i != patterns.end(); ++i) {
+        states += i->length();
+        for(auto j = i->begin(); j != i->end(); ++j) {
+            uint16_t& c = charClass[(uint8_t)*j];
+            if(c == 0)
+                c = classes++;
+        }
+    }
+
+    // Build the trie; 0 is both the root and "no edge yet", which is fine since no edge leads back to the root
+    delta.assign(states * classes, 0);
+    out.assign(states, 0);
+    uint32_t used = 1;
+    for(size_t i = 0; i < patterns.size(); ++i) {
+        uint32_t state = 0;
+        for(auto j = patterns[i].begin(); j != patterns[i].end(); ++j) {
+            uint32_t& next = delta[state * classes + charClass[(uint8_t)*j]];
+            if(next == 0)
+                next = used++;
+            state = next;
+        }
+        out[state] |= Mask(1) << i;
+    }
+    delta.resize(used * classes);
+    out.resize(used);
+
+    // Breadth-first, replace missing edges with those of the longest proper suffix (failure link),
+    // which has been completed already, and inherit its matches
+    vector<uint32_t> fail(used, 0);
+    deque<uint32_t> queue;
+    for(uint32_t c = 0; c < classes; ++c) {
+        if(delta[c] != 0)
+            queue.push_back(delta[c]);
+    }
+    while(!queue.empty()) {
+        uint32_t state = queue.front();
+        queue.pop_front();
+        out[state] |= out[fail[state]];
+        for(uint32_t c = 0; c < classes; ++c) {
+            uint32_t& next = delta[state * classes + c];
+            uint32_t suffixNext = delta[fail[state] * classes + c];
+            if(next == 0) {
+                next = suffixNext;
+            } else {
+                fail[next] = suffixNext;
+                queue.push_back(next);
+            }
+        }
+    }
+}
+
+} // namespace dcpp
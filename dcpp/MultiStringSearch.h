@@ -0,0 +1,100 @@
+/*
+ * Copyright (C) 2001-2012 Jacek Sieka, arnetheduck on gmail point com
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#pragma once
+
+#include "typedefs.h"
+#include "noexcept.h"
+
+namespace dcpp {
+
+/**
+ * Matches several patterns against a text in a single pass (Aho-Corasick, compiled to a DFA over
+ * the bytes that occur in the patterns). Like StringSearch, matching is case-insensitive: patterns
+ * are lower-cased when added, and texts are lower-cased unless passed to matchLower.
+ * Each pattern gets one bit of a Mask, and a match returns the bits of the patterns found.
+ */
+class MultiStringSearch {
+public:
+    typedef uint64_t Mask;
+
+    enum { MAX_PATTERNS = sizeof(Mask) * 8 };
+
+    MultiStringSearch() noexcept { clear(); }
+
+    /**
+     * Add a pattern; adding the same pattern twice returns the same bit.
+     * @return The bit for the pattern, 0 if the pattern is empty or there are too many patterns.
+     */
+    Mask add(const string& aPattern) noexcept;
+
+    void clear() noexcept;
+
+    /** Bits of all patterns */
+    Mask getAll() const noexcept { return patterns.size() == MAX_PATTERNS ? ~Mask(0) : (Mask(1) << patterns.size()) - 1; }
+    /** Lower-case patterns, in bit order */
+    const StringList& getPatterns() const noexcept { return patterns; }
+    bool empty() const noexcept { return patterns.empty(); }
+
+    /** Find the patterns that occur in a text */
+    Mask match(const string& aText) const noexcept;
+    Mask matchLower(const string& aText, Mask aStop = ~Mask(0)) const noexcept {
+        return matchLower(aText.data(), aText.length(), aStop);
+    }
+    /**
+     * Find the patterns that occur in an already lower-cased text.
+     * @param aStop Stop scanning as soon as all of these patterns have been found; other bits may
+     * then be missing from the result.
+     */
+    Mask matchLower(const char* aText, size_t aLength, Mask aStop = ~Mask(0)) const noexcept {
+        if(!aStop)
+            return 0;
+
+        const uint8_t* tx = (const uint8_t*)aText;
+        const uint8_t* end = tx + aLength;
+        const uint32_t* next = &delta[0];
+
+        Mask found = 0;
+        uint32_t state = 0;
+        for(; tx < end; ++tx) {
+            state = next[state * classes + charClass[*tx]];
+            if(out[state]) {
+                found |= out[state];
+                if((found & aStop) == aStop)
+                    break;
+            }
+        }
+        return found;
+    }
+
+private:
+    /** Rebuild the automaton; patterns are few, so it's simply redone for every new one */
+    void compile() noexcept;
+
+    StringList patterns;
+
+    /** Number of byte classes; class 0 stands for all bytes that appear in no pattern */
+    uint32_t classes;
+    uint16_t charClass[256];
+    /** State transitions, classes entries per state */
+    vector<uint32_t> delta;
+    /** Patterns found when reaching each state */
+    vector<Mask> out;
+};
+
+} // namespace dcpp
@@ -0,0 +1,119 @@
+/*
+ * Copyright (C) 2001-2012 Jacek Sieka, arnetheduck on gmail point com
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#pragma once
+
+#include "typedefs.h"
+
+namespace dcpp {
+
+/**
+ * Inverted index from every N-byte substring of a set of strings to the ids they were added under.
+ * Unlike BloomFilter, it tells which ids may contain a pattern; the answer is a superset of the ids
+ * whose strings actually contain it, so callers still have to verify the candidates.
+ */
+template<size_t N>
+class NGramIndex {
+    static_assert(N > 0 && N <= sizeof(uint32_t), "n-grams must fit the 32-bit key");
+public:
+    typedef vector<uint32_t> IdList;
+
+    NGramIndex() { }
+    ~NGramIndex() { }
+
+    void add(uint32_t id, const string& s) { add(id, s.data(), s.length()); }
+    void add(uint32_t id, const char* s, size_t len) {
+        if(len < N)
+            return;
+        for(size_t i = 0, l = len - N; i <= l; ++i) {
+            Postings& p = grams[getKey(s, i)];
+            if(!p.ids.empty()) {
+                if(p.ids.back() == id)
+                    continue;
+                if(p.ids.back() > id)
+                    p.sorted = false;
+            }
+            p.ids.push_back(id);
+        }
+    }
+
+    void clear() {
+        grams.clear();
+    }
+
+    /**
+     * Find the ids that may contain s.
+     * @return false if s is too short to be looked up, in which case any id may match.
+     */
+    bool find(const string& s, IdList& ret) {
+        ret.clear();
+        if(s.length() < N)
+            return false;
+
+        vector<Postings*> lists;
+        for(string::size_type i = 0, l = s.length() - N; i <= l; ++i) {
+            auto j = grams.find(getKey(s.data(), i));
+            if(j == grams.end())
+                return true;
+            Postings& p = j->second;
+            if(!p.sorted) {
+                sort(p.ids.begin(), p.ids.end());
+                p.ids.erase(unique(p.ids.begin(), p.ids.end()), p.ids.end());
+                p.sorted = true;
+            }
+            if(std::find(lists.begin(), lists.end(), &p) == lists.end())
+                lists.push_back(&p);
+        }
+
+        // Intersect starting with the shortest list so that the result shrinks as fast as possible
+        sort(lists.begin(), lists.end(), [](const Postings* a, const Postings* b) { return a->ids.size() < b->ids.size(); });
+
+        ret = lists.front()->ids;
+        IdList tmp;
+        for(auto i = lists.begin() + 1; i != lists.end() && !ret.empty(); ++i) {
+            tmp.clear();
+            set_intersection(ret.begin(), ret.end(), (*i)->ids.begin(), (*i)->ids.end(), back_inserter(tmp));
+            ret.swap(tmp);
+        }
+        return true;
+    }
+
+    size_t size() const { return grams.size(); }
+
+private:
+    struct Postings {
+        Postings() : sorted(true) { }
+
+        IdList ids;
+        /** Ids are appended in increasing order during a full rebuild; late additions are sorted on lookup */
+        bool sorted;
+    };
+
+    static uint32_t getKey(const char* s, size_t i) {
+        uint32_t h = 0;
+        const uint8_t* c = (const uint8_t*)s + i;
+        for(size_t j = 0; j < N; ++j) {
+            h = (h << 8) | c[j];
+        }
+        return h;
+    }
+
+    unordered_map<uint32_t, Postings> grams;
+};
+
+} // namespace dcpp
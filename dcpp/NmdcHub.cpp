@@ -35,6 +35,80 @@
 
 namespace dcpp {
 
+namespace {
+
+enum Command {
+    CMD_UNKNOWN,
+    CMD_SEARCH,
+    CMD_MYINFO,
+    CMD_QUIT,
+    CMD_CONNECT_TO_ME,
+    CMD_REV_CONNECT_TO_ME,
+    CMD_SR,
+    CMD_HUB_NAME,
+    CMD_SUPPORTS,
+    CMD_USER_COMMAND,
+    CMD_LOCK,
+    CMD_HELLO,
+    CMD_FORCE_MOVE,
+    CMD_HUB_IS_FULL,
+    CMD_HUB_TOPIC,
+    CMD_VALIDATE_DENIDE,
+    CMD_USER_IP,
+    CMD_NICK_LIST,
+    CMD_OP_LIST,
+    CMD_TO,
+    CMD_GET_PASS,
+    CMD_BAD_PASS,
+    CMD_ZON
+};
+
+struct CommandInfo {
+    const char* name;
+    size_t length;
+    Command command;
+    /** Whether the command reads its parameters converted to UTF-8 */
+    bool convert;
+};
+
+const CommandInfo commands[] = {
+    { "$Search", 7, CMD_SEARCH, true },
+    { "$MyINFO", 7, CMD_MYINFO, true },
+    { "$Quit", 5, CMD_QUIT, true },
+    { "$ConnectToMe", 12, CMD_CONNECT_TO_ME, true },
+    { "$RevConnectToMe", 15, CMD_REV_CONNECT_TO_ME, true },
+    { "$SR", 3, CMD_SR, false },
+    { "$HubName", 8, CMD_HUB_NAME, true },
+    { "$Supports", 9, CMD_SUPPORTS, true },
+    { "$UserCommand", 12, CMD_USER_COMMAND, true },
+    { "$Lock", 5, CMD_LOCK, false },
+    { "$Hello", 6, CMD_HELLO, true },
+    { "$ForceMove", 10, CMD_FORCE_MOVE, true },
+    { "$HubIsFull", 10, CMD_HUB_IS_FULL, false },
+    { "$HubTopic", 9, CMD_HUB_TOPIC, false },
+    { "$ValidateDenide", 15, CMD_VALIDATE_DENIDE, false },
+    { "$UserIP", 7, CMD_USER_IP, true },
+    { "$NickList", 9, CMD_NICK_LIST, true },
+    { "$OpList", 7, CMD_OP_LIST, true },
+    { "$To:", 4, CMD_TO, true },
+    { "$GetPass", 8, CMD_GET_PASS, false },
+    { "$BadPass", 8, CMD_BAD_PASS, false },
+    { "$ZOn", 4, CMD_ZON, false },
+};
+
+/** Look a command up in place, without copying it out of the line */
+const CommandInfo* getCommand(const char* aCmd, size_t aLength) {
+    for(size_t i = 0; i < sizeof(commands) / sizeof(commands[0]); ++i) {
+        const CommandInfo& c = commands[i];
+        // The length and the second character (after '$') tell nearly all commands apart already
+        if(c.length == aLength && c.name[1] == aCmd[1] && memcmp(c.name, aCmd, aLength) == 0)
+            return &c;
+    }
+    return NULL;
+}
+
+}
+
 NmdcHub::NmdcHub(const string& aHubURL, bool secure) :
 Client(aHubURL, '|', secure),
 supportFlags(0),
@@ -173,6 +247,17 @@ void NmdcHub::updateFromTag(Identity& id, const string& tag) {
     id.set("TA", '<' + tag + '>');
 }
 
+string NmdcHub::toUtf8(string str) const {
+    // Most of the traffic is plain ASCII, which is the same in every charset hubs use
+    bool ascii = true;
+    for(string::size_type i = 0, n = str.size(); i < n && ascii; ++i) {
+        ascii = !(str[i] & 0x80);
+    }
+    if(ascii || Text::validateUtf8(str))
+        return str;
+    return Text::toUtf8(str, getEncoding());
+}
+
 void NmdcHub::onLine(const string& aLine) noexcept {
     if(aLine.length() == 0)
         return;
@@ -227,18 +312,17 @@ void NmdcHub::onLine(const string& aLine) noexcept {
         return;
     }
 
-    string cmd;
-    string param;
-    string::size_type x;
+    string::size_type x = aLine.find(' ');
+    const CommandInfo* info = getCommand(aLine.data(), x == string::npos ? aLine.size() : x);
+    Command cmd = info ? info->command : CMD_UNKNOWN;
 
-    if( (x = aLine.find(' ')) == string::npos) {
-        cmd = aLine;
-    } else {
-        cmd = aLine.substr(0, x);
+    // Commands that work on the raw line don't need the parameters converted
+    string param;
+    if(x != string::npos && info && info->convert) {
         param = toUtf8(aLine.substr(x+1));
     }
 
-    if(cmd == "$Search") {
+    if(cmd == CMD_SEARCH) {
         if(state != STATE_NORMAL) {
             return;
         }
@@ -336,7 +420,7 @@ void NmdcHub::onLine(const string& aLine) noexcept {
 
             fire(ClientListener::NmdcSearch(), this, seeker, a, Util::toInt64(size), type, terms);
         }
-    } else if(cmd == "$MyINFO") {
+    } else if(cmd == CMD_MYINFO) {
         string::size_type i, j;
         i = 5;
         j = param.find(' ', i);
@@ -423,7 +507,7 @@ void NmdcHub::onLine(const string& aLine) noexcept {
         }
 
         fire(ClientListener::UserUpdated(), this, u);
-    } else if(cmd == "$Quit") {
+    } else if(cmd == CMD_QUIT) {
         if(!param.empty()) {
             const string& nick = param;
             OnlineUser* u = findUser(nick);
@@ -434,7 +518,7 @@ void NmdcHub::onLine(const string& aLine) noexcept {
 
             putUser(nick);
         }
-    } else if(cmd == "$ConnectToMe") {
+    } else if(cmd == CMD_CONNECT_TO_ME) {
         if(state != STATE_NORMAL) {
             return;
         }
@@ -499,7 +583,7 @@ void NmdcHub::onLine(const string& aLine) noexcept {
             return;
         // For simplicity, we make the assumption that users on a hub have the same character encoding
         ConnectionManager::getInstance()->nmdcConnect(server, static_cast<uint16_t>(Util::toInt(port)), getMyNick(), getHubUrl(), getEncoding(), secure);
-    } else if(cmd == "$RevConnectToMe") {
+    } else if(cmd == CMD_REV_CONNECT_TO_ME) {
         if(state != STATE_NORMAL) {
             return;
         }
@@ -530,9 +614,9 @@ void NmdcHub::onLine(const string& aLine) noexcept {
                 return;
             }
         }
-    } else if(cmd == "$SR") {
+    } else if(cmd == CMD_SR) {
         SearchManager::getInstance()->onSearchResult(aLine);
-    } else if(cmd == "$HubName") {
+    } else if(cmd == CMD_HUB_NAME) {
         // If " - " found, the first part goes to hub name, rest to description
         // If no " - " found, first word goes to hub name, rest to description
 
@@ -551,7 +635,7 @@ void NmdcHub::onLine(const string& aLine) noexcept {
             getHubIdentity().setDescription(unescape(param.substr(i+3)));
         }
         fire(ClientListener::HubUpdated(), this);
-    } else if(cmd == "$Supports") {
+    } else if(cmd == CMD_SUPPORTS) {
         StringTokenizer<string> st(param, ' ');
         StringList& sl = st.getTokens();
         for(auto i = sl.begin(); i != sl.end(); ++i) {
@@ -563,7 +647,7 @@ void NmdcHub::onLine(const string& aLine) noexcept {
                 supportFlags |= SUPPORTS_USERIP2;
             }
         }
-    } else if(cmd == "$UserCommand") {
+    } else if(cmd == CMD_USER_COMMAND) {
         string::size_type i = 0;
         string::size_type j = param.find(' ');
         if(j == string::npos)
@@ -591,7 +675,7 @@ void NmdcHub::onLine(const string& aLine) noexcept {
             string command = unescape(param.substr(i, param.length() - i));
             fire(ClientListener::HubUserCommand(), this, type, ctx, name, command);
         }
-    } else if(cmd == "$Lock") {
+    } else if(cmd == CMD_LOCK) {
         if(state != STATE_PROTOCOL) {
             return;
         }
@@ -639,7 +723,7 @@ void NmdcHub::onLine(const string& aLine) noexcept {
             OnlineUser& ou = getUser(getCurrentNick());
             validateNick(ou.getIdentity().getNick());
         }
-    } else if(cmd == "$Hello") {
+    } else if(cmd == CMD_HELLO) {
         if(!param.empty()) {
             OnlineUser& u = getUser(param);
 
@@ -661,22 +745,22 @@ void NmdcHub::onLine(const string& aLine) noexcept {
 
             fire(ClientListener::UserUpdated(), this, u);
         }
-    } else if(cmd == "$ForceMove") {
+    } else if(cmd == CMD_FORCE_MOVE) {
         disconnect(false);
         fire(ClientListener::Redirect(), this, param);
-    } else if(cmd == "$HubIsFull") {
+    } else if(cmd == CMD_HUB_IS_FULL) {
         fire(ClientListener::HubFull(), this);
-    }else if(cmd == "$HubTopic") {
+    }else if(cmd == CMD_HUB_TOPIC) {
         //dcdebug("Nmdc topic:%s",aLine.c_str());
         string line;
         string str2= _("Hub topic:");
         line=toUtf8(aLine);
         line.replace(0,9,str2);
         fire(ClientListener::StatusMessage(), this, unescape(line), ClientListener::FLAG_NORMAL);
-    } else if(cmd == "$ValidateDenide") {       // Mind the spelling...
+    } else if(cmd == CMD_VALIDATE_DENIDE) {       // Mind the spelling...
         disconnect(false);
         fire(ClientListener::NickTaken(), this);
-    } else if(cmd == "$UserIP") {
+    } else if(cmd == CMD_USER_IP) {
         if(!param.empty()) {
             OnlineUserList v;
             StringTokenizer<string> t(param, "$$");
@@ -702,7 +786,7 @@ void NmdcHub::onLine(const string& aLine) noexcept {
 
             fire(ClientListener::UsersUpdated(), this, v);
         }
-    } else if(cmd == "$NickList") {
+    } else if(cmd == CMD_NICK_LIST) {
         if(!param.empty()) {
             OnlineUserList v;
             StringTokenizer<string> t(param, "$$");
@@ -732,7 +816,7 @@ void NmdcHub::onLine(const string& aLine) noexcept {
 
             fire(ClientListener::UsersUpdated(), this, v);
         }
-    } else if(cmd == "$OpList") {
+    } else if(cmd == CMD_OP_LIST) {
         if(!param.empty()) {
             OnlineUserList v;
             StringTokenizer<string> t(param, "$$");
@@ -755,7 +839,7 @@ void NmdcHub::onLine(const string& aLine) noexcept {
             // updated when they log in (they'll be counted as registered first...)
             myInfo(false);
         }
-    } else if(cmd == "$To:") {
+    } else if(cmd == CMD_TO) {
         string::size_type i = param.find("From:");
         if(i == string::npos)
             return;
@@ -805,21 +889,21 @@ void NmdcHub::onLine(const string& aLine) noexcept {
         }
 
         fire(ClientListener::Message(), this, message);
-    } else if(cmd == "$GetPass") {
+    } else if(cmd == CMD_GET_PASS) {
         OnlineUser& ou = getUser(getMyNick());
         ou.getIdentity().set("RG", "1");
         setMyIdentity(ou.getIdentity());
         fire(ClientListener::GetPassword(), this);
-    } else if(cmd == "$BadPass") {
+    } else if(cmd == CMD_BAD_PASS) {
         setPassword(Util::emptyString);
-    } else if(cmd == "$ZOn") {
+    } else if(cmd == CMD_ZON) {
         try {
             sock->setMode(BufferedSocket::MODE_ZPIPE);
         } catch (const Exception& e) {
-            dcdebug("NmdcHub::onLine %s failed with error: %s\n", cmd.c_str(), e.getError().c_str());
+            dcdebug("NmdcHub::onLine $ZOn failed with error: %s\n", e.getError().c_str());
         }
     } else {
-        dcassert(cmd[0] == '$');
+        dcassert(aLine[0] == '$');
         dcdebug("NmdcHub::onLine Unknown command %s\n", aLine.c_str());
     }
 }
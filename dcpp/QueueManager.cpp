@@ -91,6 +91,13 @@ QueueItem* QueueManager::FileQueue::add(const string& aTarget, int64_t aSize,
 }
 
 void QueueManager::FileQueue::add(QueueItem* qi) {
+    insert(qi);
+    changed(qi);
+    tthIndex.insert(make_pair(qi->getTTH(), qi));
+    sizeIndex.insert(make_pair(qi->getSize(), qi));
+}
+
+void QueueManager::FileQueue::insert(QueueItem* qi) {
     if(lastInsert == queue.end())
         lastInsert = queue.insert(make_pair(const_cast<string*>(&qi->getTarget()), qi)).first;
     else
@@ -101,6 +108,23 @@ void QueueManager::FileQueue::remove(QueueItem* qi) {
     if(lastInsert != queue.end() && Util::stricmp(*lastInsert->first, qi->getTarget()) == 0)
         ++lastInsert;
     queue.erase(const_cast<string*>(&qi->getTarget()));
+    changed(qi);
+
+    auto t = tthIndex.equal_range(qi->getTTH());
+    for(auto i = t.first; i != t.second; ++i) {
+        if(i->second == qi) {
+            tthIndex.erase(i);
+            break;
+        }
+    }
+    auto s = sizeIndex.equal_range(qi->getSize());
+    for(auto i = s.first; i != s.second; ++i) {
+        if(i->second == qi) {
+            sizeIndex.erase(i);
+            break;
+        }
+    }
+
     delete qi;
 }
 
@@ -110,30 +134,24 @@ QueueItem* QueueManager::FileQueue::find(const string& target) {
 }
 
 void QueueManager::FileQueue::find(QueueItem::List& sl, int64_t aSize, const string& suffix) {
-    for(QueueItem::StringIter i = queue.begin(); i != queue.end(); ++i) {
-        if(i->second->getSize() == aSize) {
-            const string& t = i->second->getTarget();
-            if(suffix.empty() || (suffix.length() < t.length() &&
-                Util::stricmp(suffix.c_str(), t.c_str() + (t.length() - suffix.length())) == 0) )
-                sl.push_back(i->second);
-        }
+    auto s = sizeIndex.equal_range(aSize);
+    for(auto i = s.first; i != s.second; ++i) {
+        const string& t = i->second->getTarget();
+        if(suffix.empty() || (suffix.length() < t.length() &&
+            Util::stricmp(suffix.c_str(), t.c_str() + (t.length() - suffix.length())) == 0) )
+            sl.push_back(i->second);
     }
 }
 
 void QueueManager::FileQueue::find(QueueItem::List& ql, const TTHValue& tth) {
-    for(QueueItem::StringIter i = queue.begin(); i != queue.end(); ++i) {
-        QueueItem* qi = i->second;
-        if(qi->getTTH() == tth) {
-            ql.push_back(qi);
-        }
+    auto t = tthIndex.equal_range(tth);
+    for(auto i = t.first; i != t.second; ++i) {
+        ql.push_back(i->second);
     }
 }
 
 bool QueueManager::FileQueue::exists(const TTHValue& tth) const {
-    for(QueueItem::StringMap::const_iterator i = queue.begin(); i != queue.end(); ++i)
-        if(i->second->getTTH() == tth)
-            return true;
-    return false;
+    return tthIndex.find(tth) != tthIndex.end();
 }
 
 static QueueItem* findCandidate(QueueItem* cand, QueueItem::StringIter start, QueueItem::StringIter end, const StringList& recent) {
@@ -185,8 +203,11 @@ void QueueManager::FileQueue::move(QueueItem* qi, const string& aTarget) {
     if(lastInsert != queue.end() && Util::stricmp(*lastInsert->first, qi->getTarget()) == 0)
         lastInsert = queue.end();
     queue.erase(const_cast<string*>(&qi->getTarget()));
+    changed(qi);
     qi->setTarget(aTarget);
-    add(qi);
+    // TTH and size stay the same
+    insert(qi);
+    changed(qi);
 }
 
 bool QueueManager::getQueueInfo(const UserPtr& aUser, string& aTarget, int64_t& aSize, int& aFlags) noexcept {
@@ -528,6 +549,8 @@ lastSave(0),
 queueFile(Util::getPath(Util::PATH_USER_CONFIG) + "Queue.xml"),
 rechecker(this),
 dirty(true),
+journalId(0),
+queueFileSize(0),
 nextSearch(0)
 {
     TimerManager::getInstance()->addListener(this);
@@ -837,6 +860,20 @@ void QueueManager::setDirty() {
     }
 }
 
+void QueueManager::setDirty(QueueItem* qi) {
+    fileQueue.changed(qi);
+    setDirty();
+}
+
+void QueueManager::forget(QueueItem* qi) {
+    fire(QueueManagerListener::Removed(), qi);
+
+    if(!qi->isFinished()) {
+        userQueue.remove(qi);
+    }
+    fileQueue.remove(qi);
+}
+
 string QueueManager::checkTarget(const string& aTarget, bool checkExistence) {
 #ifdef _WIN32
     if(aTarget.length() > MAX_PATH) {
@@ -893,7 +930,7 @@ bool QueueManager::addSource(QueueItem* qi, const HintedUser& aUser, Flags::Mask
     }
 
     fire(QueueManagerListener::SourcesUpdated(), qi);
-    setDirty();
+    setDirty(qi);
 
     return wantConnection;
 }
@@ -933,48 +970,44 @@ QueueItem::Priority QueueManager::hasDownload(const UserPtr& aUser) noexcept {
     }
     return qi->getPriority();
 }
-namespace {
-typedef unordered_map<TTHValue, const DirectoryListing::File*> TTHMap;
-
-// *** WARNING ***
-// Lock(cs) makes sure that there's only one thread accessing this
-static TTHMap tthMap;
-
-void buildMap(const DirectoryListing::Directory* dir) noexcept {
+void QueueManager::matchFiles(const DirectoryListing::Directory* dir, unordered_set<QueueItem*>& matched) noexcept {
+    dir->load();
     for(DirectoryListing::Directory::List::const_iterator j = dir->directories.begin(); j != dir->directories.end(); ++j) {
         if(!(*j)->getAdls())
-            buildMap(*j);
+            matchFiles(*j, matched);
     }
 
+    QueueItem::List ql;
     for(DirectoryListing::File::List::const_iterator i = dir->files.begin(); i != dir->files.end(); ++i) {
         const DirectoryListing::File* df = *i;
-        tthMap.insert(make_pair(df->getTTH(), df));
+        ql.clear();
+        fileQueue.find(ql, df->getTTH());
+        for(QueueItem::Iter k = ql.begin(); k != ql.end(); ++k) {
+            QueueItem* qi = *k;
+            if(qi->isFinished())
+                continue;
+            if(qi->isSet(QueueItem::FLAG_USER_LIST))
+                continue;
+            if(df->getSize() == qi->getSize())
+                matched.insert(qi);
+        }
     }
 }
-}
 
 int QueueManager::matchListing(const DirectoryListing& dl) noexcept {
     int matches = 0;
     {
         Lock l(cs);
-        tthMap.clear();
-        buildMap(dl.getRoot());
+        unordered_set<QueueItem*> matched;
+        matchFiles(dl.getRoot(), matched);
 
-        for(QueueItem::StringMap::const_iterator i = fileQueue.getQueue().begin(); i != fileQueue.getQueue().end(); ++i) {
-            QueueItem* qi = i->second;
-            if(qi->isFinished())
-                continue;
-            if(qi->isSet(QueueItem::FLAG_USER_LIST))
-                continue;
-            TTHMap::iterator j = tthMap.find(qi->getTTH());
-            if(j != tthMap.end() && i->second->getSize() == qi->getSize()) {
-                try {
-                    addSource(qi, dl.getUser(), QueueItem::Source::FLAG_FILE_NOT_AVAILABLE);
-                } catch(...) {
-                    // Ignore...
-                }
-                matches++;
+        for(auto i = matched.begin(); i != matched.end(); ++i) {
+            try {
+                addSource(*i, dl.getUser(), QueueItem::Source::FLAG_FILE_NOT_AVAILABLE);
+            } catch(...) {
+                // Ignore...
             }
+            matches++;
         }
     }
     if(matches > 0)
@@ -1087,6 +1120,7 @@ Download* QueueManager::getDownload(UserConnection& aSource, bool supportsTrees)
                 } else {
                     // Temp target gone?
                     q->resetDownloaded();
+                    setDirty(q);
                 }
             }
         }
@@ -1225,6 +1259,7 @@ void QueueManager::moveStuckFile(QueueItem* qi) {
         fileQueue.remove(qi);
     } else {
         qi->addSegment(Segment(0, qi->getSize()));
+        setDirty(qi);
         fire(QueueManagerListener::StatusUpdated(), qi);
     }
 
@@ -1235,7 +1270,7 @@ void QueueManager::rechecked(QueueItem* qi) {
     fire(QueueManagerListener::RecheckDone(), qi->getTarget());
     fire(QueueManagerListener::StatusUpdated(), qi);
 
-    setDirty();
+    setDirty(qi);
 }
 
 void QueueManager::putDownload(Download* aDownload, bool finished) noexcept {
@@ -1319,6 +1354,7 @@ void QueueManager::putDownload(Download* aDownload, bool finished) noexcept {
                         } else if(aDownload->getType() == Transfer::TYPE_FILE) {
                             q->addSegment(aDownload->getSegment());
                         }
+                        setDirty(q);
 
                         if (q->isFinished() && BOOLSETTING(SFV_CHECK)) {
                                 crcError = checkSfv(q, aDownload);
@@ -1353,6 +1389,7 @@ void QueueManager::putDownload(Download* aDownload, bool finished) noexcept {
                     if(aDownload->getType() != Transfer::TYPE_TREE) {
                         if(q->getDownloadedBytes() == 0) {
                             q->setTempTarget(Util::emptyString);
+                            fileQueue.changed(q);
                         }
                         if(q->isSet(QueueItem::FLAG_USER_LIST)) {
                             // Blah...no use keeping an unfinished file list...
@@ -1365,7 +1402,7 @@ void QueueManager::putDownload(Download* aDownload, bool finished) noexcept {
 
                             if(downloaded > 0) {
                                 q->addSegment(Segment(aDownload->getStartPos(), downloaded));
-                                setDirty();
+                                setDirty(q);
                             }
                         }
                     }
@@ -1508,7 +1545,7 @@ void QueueManager::removeSource(const string& aTarget, const UserPtr& aUser, int
         q->removeSource(aUser, reason);
 
         fire(QueueManagerListener::SourcesUpdated(), q);
-        setDirty();
+        setDirty(q);
     }
 endCheck:
     if(isRunning && removeConn) {
@@ -1538,7 +1575,7 @@ void QueueManager::removeSource(const UserPtr& aUser, int reason) noexcept {
                 userQueue.remove(qi, aUser);
                 qi->removeSource(aUser, reason);
                 fire(QueueManagerListener::SourcesUpdated(), qi);
-                setDirty();
+                setDirty(qi);
             }
         }
 
@@ -1553,7 +1590,7 @@ void QueueManager::removeSource(const UserPtr& aUser, int reason) noexcept {
                 qi->removeSource(aUser, reason);
                 fire(QueueManagerListener::StatusUpdated(), qi);
                 fire(QueueManagerListener::SourcesUpdated(), qi);
-                setDirty();
+                setDirty(qi);
             }
         }
     }
@@ -1579,7 +1616,7 @@ void QueueManager::setPriority(const string& aTarget, QueueItem::Priority p) noe
                                 q->getOnlineUsers(getConn);
             }
             userQueue.setPriority(q, p);
-            setDirty();
+            setDirty(q);
             fire(QueueManagerListener::StatusUpdated(), q);
         }
     }
@@ -1589,86 +1626,147 @@ void QueueManager::setPriority(const string& aTarget, QueueItem::Priority p) noe
     }
 }
 
+namespace {
+
+/** Journal record types */
+const char JOURNAL_ITEM = 'I';
+const char JOURNAL_REMOVE = 'R';
+
+bool isSaved(const QueueItem* qi) {
+    return !qi->isSet(QueueItem::FLAG_USER_LIST) || SETTING(KEEP_LISTS);
+}
+
+void saveItem(QueueItem* qi, OutputStream& f, string& tmp, std::vector<CID>& cids) {
+    string b32tmp;
+    f.write(LIT("\t<Download Target=\""));
+    f.write(SimpleXML::escape(qi->getTarget(), tmp, true));
+    f.write(LIT("\" Size=\""));
+    f.write(Util::toString(qi->getSize()));
+    f.write(LIT("\" Priority=\""));
+    f.write(Util::toString((int)qi->getPriority()));
+    f.write(LIT("\" Added=\""));
+    f.write(Util::toString(qi->getAdded()));
+    f.write(LIT("\" TTH=\""));
+    f.write(qi->getTTH().toBase32(b32tmp));
+    if(!qi->getDone().empty()) {
+        f.write(LIT("\" TempTarget=\""));
+        f.write(SimpleXML::escape(qi->getTempTarget(), tmp, true));
+    }
+    f.write(LIT("\">\r\n"));
+
+    for(QueueItem::SegmentSet::const_iterator i = qi->getDone().begin(); i != qi->getDone().end(); ++i) {
+        f.write(LIT("\t\t<Segment Start=\""));
+        f.write(Util::toString(i->getStart()));
+        f.write(LIT("\" Size=\""));
+        f.write(Util::toString(i->getSize()));
+        f.write(LIT("\"/>\r\n"));
+    }
+
+    for(QueueItem::SourceConstIter j = qi->getSources().begin(); j != qi->getSources().end(); ++j) {
+        if(j->isSet(QueueItem::Source::FLAG_PARTIAL)
+#ifdef WITH_DHT
+                                                    || j->getUser().hint == "DHT"
+#endif
+                                                                                  ) continue;
+
+        const CID& cid = j->getUser().user->getCID();
+        const string& hint = j->getUser().hint;
+
+        f.write(LIT("\t\t<Source CID=\""));
+        f.write(cid.toBase32());
+        if(!hint.empty()) {
+            f.write(LIT("\" Hub=\""));
+            f.write(hint);
+        }
+        f.write(LIT("\"/>\r\n"));
+
+        cids.push_back(cid);
+    }
+
+    f.write(LIT("\t</Download>\r\n"));
+}
+
+}
+
+/**
+ * Append the items changed since the last save to the journal, or write all of Queue.xml when
+ * the journal has grown too big. The data is put together while holding cs; the files are
+ * written without it, so that transfers aren't held up.
+ */
 void QueueManager::saveQueue(bool force) noexcept {
     if(!dirty && !force)
     return;
 
+    Lock sl(saveCS);
+
     std::vector<CID> cids;
+    string data;
+    bool compact = !journal.get() || journal->getSize() > max(queueFileSize / 2, (int64_t)1024*1024);
+    uint32_t id = compact ? (Util::rand() | 1) : journalId;
 
-    try {
+    {
         Lock l(cs);
 
-        File ff(getQueueFile() + ".tmp", File::WRITE, File::CREATE | File::TRUNCATE);
-        BufferedOutputStream<false> f(&ff);
-
-        f.write(SimpleXML::utf8Header);
-        f.write(LIT("<Downloads Version=\"" VERSIONSTRING "\">\r\n"));
+        StringOutputStream f(data);
         string tmp;
-        string b32tmp;
-        for(QueueItem::StringIter i = fileQueue.getQueue().begin(); i != fileQueue.getQueue().end(); ++i) {
-            QueueItem* qi = i->second;
-            if(!qi->isSet(QueueItem::FLAG_USER_LIST)
-                || (qi->isSet(QueueItem::FLAG_USER_LIST)
-                    && SETTING(KEEP_LISTS))) {
-                f.write(LIT("\t<Download Target=\""));
-                f.write(SimpleXML::escape(qi->getTarget(), tmp, true));
-                f.write(LIT("\" Size=\""));
-                f.write(Util::toString(qi->getSize()));
-                f.write(LIT("\" Priority=\""));
-                f.write(Util::toString((int)qi->getPriority()));
-                f.write(LIT("\" Added=\""));
-                f.write(Util::toString(qi->getAdded()));
-                b32tmp.clear();
-                f.write(LIT("\" TTH=\""));
-                f.write(qi->getTTH().toBase32(b32tmp));
-                if(!qi->getDone().empty()) {
-                    f.write(LIT("\" TempTarget=\""));
-                    f.write(SimpleXML::escape(qi->getTempTarget(), tmp, true));
-                }
-                f.write(LIT("\">\r\n"));
-
-                for(QueueItem::SegmentSet::const_iterator i = qi->getDone().begin(); i != qi->getDone().end(); ++i) {
-                    f.write(LIT("\t\t<Segment Start=\""));
-                    f.write(Util::toString(i->getStart()));
-                    f.write(LIT("\" Size=\""));
-                    f.write(Util::toString(i->getSize()));
-                    f.write(LIT("\"/>\r\n"));
-                }
-
-                for(QueueItem::SourceConstIter j = qi->sources.begin(); j != qi->sources.end(); ++j) {
-                    if(j->isSet(QueueItem::Source::FLAG_PARTIAL)
-#ifdef WITH_DHT
-                                                                || j->getUser().hint == "DHT"
-#endif
-                                                                                              ) continue;
-
-                    const CID& cid = j->getUser().user->getCID();
-                    const string& hint = j->getUser().hint;
-
-                    f.write(LIT("\t\t<Source CID=\""));
-                    f.write(cid.toBase32());
-                    if(!hint.empty()) {
-                        f.write(LIT("\" Hub=\""));
-                        f.write(hint);
-                    }
-                    f.write(LIT("\"/>\r\n"));
-
-                    cids.push_back(cid);
+        StringSet& changes = fileQueue.getChanges();
+        if(compact) {
+            f.write(SimpleXML::utf8Header);
+            f.write(LIT("<Downloads Version=\"" VERSIONSTRING "\" Journal=\""));
+            f.write(Util::toString(id));
+            f.write(LIT("\">\r\n"));
+            for(QueueItem::StringIter i = fileQueue.getQueue().begin(); i != fileQueue.getQueue().end(); ++i) {
+                if(isSaved(i->second))
+                    saveItem(i->second, f, tmp, cids);
+            }
+            f.write("</Downloads>\r\n");
+        } else {
+            string item;
+            for(StringSet::const_iterator i = changes.begin(); i != changes.end(); ++i) {
+                QueueItem* qi = fileQueue.find(*i);
+                char type;
+                item.clear();
+                if(qi && isSaved(qi)) {
+                    StringOutputStream is(item);
+                    saveItem(qi, is, tmp, cids);
+                    type = JOURNAL_ITEM;
+                } else {
+                    item = *i;
+                    type = JOURNAL_REMOVE;
                 }
 
-                f.write(LIT("\t</Download>\r\n"));
+                uint32_t len = item.size();
+                data += type;
+                data.append((const char*)&len, sizeof(len));
+                data += item;
             }
         }
+        changes.clear();
+        dirty = false;
+    }
 
-        f.write("</Downloads>\r\n");
-        f.flush();
-        ff.close();
-        File::deleteFile(getQueueFile());
-        File::renameFile(getQueueFile() + ".tmp", getQueueFile());
+    try {
+        if(compact) {
+            journal.reset();
+            {
+                File ff(getQueueFile() + ".tmp", File::WRITE, File::CREATE | File::TRUNCATE);
+                ff.write(data);
+            }
+            File::deleteFile(getQueueFile());
+            File::renameFile(getQueueFile() + ".tmp", getQueueFile());
+            queueFileSize = data.size();
 
-        dirty = false;
+            journal.reset(new File(getJournalFile(), File::WRITE, File::CREATE | File::TRUNCATE));
+            journal->write(&id, sizeof(id));
+            journalId = id;
+        } else if(!data.empty()) {
+            journal->write(data);
+        }
     } catch(const FileException&) {
-        // ...
+        // Write everything the next time
+        journal.reset();
+        Lock l(cs);
+        dirty = true;
     }
     // Put this here to avoid very many saves tries when disk is full...
     lastSave = GET_TICK();
@@ -1687,28 +1785,102 @@ void QueueManager::saveQueue(bool force) noexcept {
 
 class QueueLoader : public SimpleXMLReader::CallBack {
 public:
-    QueueLoader() : cur(NULL), inDownloads(false) { }
+    /** @param aReplace Items already in the queue are replaced instead of added to, as when replaying the journal */
+    QueueLoader(bool aReplace = false) : cur(NULL), inDownloads(false), replace(aReplace), journalId(0) { }
     virtual ~QueueLoader() { }
     virtual void startTag(const string& name, StringPairList& attribs, bool simple);
     virtual void endTag(const string& name, const string& data);
+
+    uint32_t getJournalId() const { return journalId; }
 private:
     string target;
 
     QueueItem* cur;
     bool inDownloads;
+    bool replace;
+    uint32_t journalId;
 };
 
 void QueueManager::loadQueue() noexcept {
+    uint32_t id = 0;
     try {
         QueueLoader l;
         Util::migrate(getQueueFile());
 
         File f(getQueueFile(), File::READ, File::OPEN);
+        queueFileSize = f.getSize();
         SimpleXMLReader(&l).parse(f);
+        id = l.getJournalId();
         dirty = false;
     } catch(const Exception&) {
         // ...
     }
+
+    loadJournal(id);
+    // All of it is saved already
+    fileQueue.getChanges().clear();
+}
+
+void QueueManager::loadJournal(uint32_t aId) {
+    // Without a matching journal, the next save writes Queue.xml anew
+    if(aId == 0)
+        return;
+
+    string data;
+    try {
+        File f(getJournalFile(), File::READ, File::OPEN);
+        data = f.read();
+    } catch(const FileException&) {
+        return;
+    }
+
+    uint32_t id;
+    if(data.size() < sizeof(id))
+        return;
+    memcpy(&id, data.data(), sizeof(id));
+    if(id != aId)
+        return;
+
+    // Replay up to the first incomplete record, which a crash may have left behind
+    size_t pos = sizeof(id);
+    const size_t header = 1 + sizeof(uint32_t);
+    while(data.size() - pos >= header) {
+        char type = data[pos];
+        uint32_t len;
+        memcpy(&len, data.data() + pos + 1, sizeof(len));
+        if(data.size() - pos - header < len)
+            break;
+
+        string record = data.substr(pos + header, len);
+        if(type == JOURNAL_ITEM) {
+            try {
+                QueueLoader l(true);
+                SimpleXMLReader xml(&l);
+                const string start = "<Downloads>", end = "</Downloads>";
+                xml.parse(start.data(), start.size(), true);
+                xml.parse(record.data(), record.size(), true);
+                xml.parse(end.data(), end.size(), false);
+            } catch(const Exception&) {
+                // Skip the item
+            }
+        } else if(type == JOURNAL_REMOVE) {
+            QueueItem* qi = fileQueue.find(record);
+            if(qi)
+                forget(qi);
+        } else {
+            break;
+        }
+        pos += header + len;
+    }
+
+    try {
+        journal.reset(new File(getJournalFile(), File::WRITE, File::OPEN));
+        journal->setPos(pos);
+        journal->setEOF();
+        journalId = id;
+    } catch(const FileException&) {
+        journal.reset();
+    }
 }
 
 int QueueManager::countOnlineSources(const string& aTarget) {
@@ -1745,6 +1917,7 @@ void QueueLoader::startTag(const string& name, StringPairList& attribs, bool sim
     QueueManager* qm = QueueManager::getInstance();
     if(!inDownloads && name == "Downloads") {
         inDownloads = true;
+        journalId = Util::toUInt32(getAttrib(attribs, "Journal", 1));
     } else if(inDownloads) {
         if(cur == NULL && name == sDownload) {
             int64_t size = Util::toInt64(getAttrib(attribs, sSize, 1));
@@ -1774,6 +1947,10 @@ void QueueLoader::startTag(const string& name, StringPairList& attribs, bool sim
                 added = GET_TIME();
 
             QueueItem* qi = qm->fileQueue.find(target);
+            if(qi && replace) {
+                qm->forget(qi);
+                qi = NULL;
+            }
 
             if(qi == NULL) {
                 qi = qm->fileQueue.add(target, size, 0, p, tempTarget, added, TTHValue(tthRoot));
@@ -2031,6 +2208,7 @@ bool QueueManager::checkSfv(QueueItem* qi, Download* d) {
 
             File::deleteFile(qi->getTempTarget());
             qi->resetDownloaded();
+            setDirty(qi);
             dcdebug("QueueManager: CRC32 mismatch for %s\n", qi->getTarget().c_str());
             LogManager::getInstance()->message(_("CRC32 inconsistency (SFV-Check)") + ' ' + Util::addBrackets(qi->getTarget()));
 
@@ -216,10 +216,21 @@ private:
         QueueItem::StringMap& getQueue() { return queue; }
         void move(QueueItem* qi, const string& aTarget);
         void remove(QueueItem* qi);
+
+        /** Note that an item has to be saved again */
+        void changed(const QueueItem* qi) { changes.insert(qi->getTarget()); }
+        /** Targets added, changed, moved away or removed since the last save */
+        StringSet& getChanges() { return changes; }
     private:
+        void insert(QueueItem* qi);
+
         QueueItem::StringMap queue;
         /** A hint where to insert an item... */
         QueueItem::StringIter lastInsert;
+        /** The same items by TTH and by size, for matching search results and file lists */
+        unordered_multimap<TTHValue, QueueItem*> tthIndex;
+        unordered_multimap<int64_t, QueueItem*> sizeIndex;
+        StringSet changes;
     };
 
     /** All queue items indexed by user (this is a cache for the FileQueue really...) */
@@ -266,6 +277,16 @@ private:
     StringList recent;
     /** The queue needs to be saved */
     bool dirty;
+    /** Serializes saves, which write the files without holding cs */
+    CriticalSection saveCS;
+    /**
+     * Changes saved since Queue.xml was last written; items are appended whole, removals as their
+     * target. The journal starts with the id that Queue.xml was written with, so that a journal
+     * left over from an older Queue.xml is never replayed.
+     */
+    unique_ptr<File> journal;
+    uint32_t journalId;
+    int64_t queueFileSize;
     /** Next search */
     uint64_t nextSearch;
     /** File lists not to delete */
@@ -276,6 +297,8 @@ private:
     bool addSource(QueueItem* qi, const HintedUser& aUser, Flags::MaskType addBad);
 
     void processList(const string& name, const HintedUser& user, int flags);
+    /** Find the queue items that the files of a listing directory could be sources for */
+    void matchFiles(const DirectoryListing::Directory* dir, unordered_set<QueueItem*>& matched) noexcept;
 
     void load(const SimpleXML& aXml);
     void moveFile(const string& source, const string& target);
@@ -284,6 +307,11 @@ private:
     void rechecked(QueueItem* qi);
 
     void setDirty();
+    void setDirty(QueueItem* qi);
+    /** Take an item out of the queue, leaving its files alone */
+    void forget(QueueItem* qi);
+    void loadJournal(uint32_t aId);
+    string getJournalFile() const { return getQueueFile() + ".journal"; }
 
     string getListPath(const HintedUser& user);
 
@@ -54,6 +54,7 @@ public:
     virtual void close() noexcept;
 
     virtual bool isSecure() const noexcept { return true; }
+    virtual bool canSendFile() const noexcept { return false; }
     virtual bool isTrusted() const noexcept;
     virtual std::string getCipherName() const noexcept;
     virtual vector<uint8_t> getKeyprint() const noexcept;
@@ -291,7 +291,7 @@ int SearchManager::UdpQueue::run() {
 
     } else if(x.compare(1, 4, "RES ") == 0 && x[x.length() - 1] == 0x0a) {
         AdcCommand c(x.substr(0, x.length()-1));
-        if(c.getParameters().empty())
+        if(c.getParamCount() == 0)
             continue;
         string cid = c.getParam(0);
         if(cid.size() != 39)
@@ -302,13 +302,13 @@ int SearchManager::UdpQueue::run() {
             continue;
 
         // This should be handled by AdcCommand really...
-        c.getParameters().erase(c.getParameters().begin());
+        c.eraseParam(0);
 
         SearchManager::getInstance()->onRES(c, user, remoteIp);
 
     } if(x.compare(1, 4, "PSR ") == 0 && x[x.length() - 1] == 0x0a) {
             AdcCommand c(x.substr(0, x.length()-1));
-            if(c.getParameters().empty())
+            if(c.getParamCount() == 0)
                     continue;
             string cid = c.getParam(0);
             if(cid.size() != 39)
@@ -317,7 +317,7 @@ int SearchManager::UdpQueue::run() {
             UserPtr user = ClientManager::getInstance()->findUser(CID(cid));
             // when user == NULL then it is probably NMDC user, check it later
 
-            c.getParameters().erase(c.getParameters().begin());
+            c.eraseParam(0);
 
             SearchManager::getInstance()->onPSR(c, user, remoteIp);
 
@@ -99,6 +99,7 @@ const string SettingsManager::settingTags[] =
     "UseADLOnlyOnOwnList", "AllowSimUploads", "CheckTargetsPathsOnStart", "NmdcDebug",
     "ShareSkipZeroByte", "RequireTLS", "LogSpy", "AppUnitBase",
     "LogCmdDebug",
+    "ShareRefreshThreads", "ShareMonitor", "HashingThreads", "SocketReactorThreads", "Bzip2Threads",
     "SENTRY",
     // Int64
     "TotalUpload", "TotalDownload",
@@ -308,6 +309,11 @@ SettingsManager::SettingsManager()
     setDefault(CHECK_TARGETS_PATHS_ON_START, false);
     setDefault(SHARE_SKIP_ZERO_BYTE, false);
     setDefault(APP_UNIT_BASE, 0);
+    setDefault(SHARE_REFRESH_THREADS, 4);
+    setDefault(SHARE_MONITOR, true);
+    setDefault(HASHING_THREADS, 2);
+    setDefault(SOCKET_REACTOR_THREADS, 2);
+    setDefault(BZIP2_THREADS, 2);
     setSearchTypeDefaults();
 }
 
@@ -118,6 +118,7 @@ public:
         NMDC_DEBUG, SHARE_SKIP_ZERO_BYTE, REQUIRE_TLS, LOG_SPY,
         APP_UNIT_BASE,
         LOG_CMD_DEBUG,
+        SHARE_REFRESH_THREADS, SHARE_MONITOR, HASHING_THREADS, SOCKET_REACTOR_THREADS, BZIP2_THREADS,
         INT_LAST };
 
     enum Int64Setting { INT64_FIRST = INT_LAST + 1,
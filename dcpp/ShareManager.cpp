@@ -37,6 +37,7 @@
 #include "Download.h"
 #include "HashBloom.h"
 #include "SearchResult.h"
+#include "Semaphore.h"
 #include "version.h"
 #ifdef WITH_DHT
 #include "dht/IndexManager.h"
@@ -55,7 +56,7 @@ namespace dcpp {
 
 ShareManager::ShareManager() : hits(0), xmlListLen(0), bzXmlListLen(0),
     xmlDirty(true), forceXmlRefresh(false), refreshDirs(false), update(false), initial(true), listN(0), refreshing(false),
-    lastXmlUpdate(0), lastFullUpdate(GET_TICK()), bloom(1<<20)
+    lastXmlUpdate(0), lastFullUpdate(GET_TICK()), bloom(1<<20), indexEntries(0), staleIndexEntries(0)
 {
     SettingsManager::getInstance()->addListener(this);
     TimerManager::getInstance()->addListener(this);
@@ -70,6 +71,7 @@ ShareManager::~ShareManager() {
     HashManager::getInstance()->removeListener(this);
 
     join();
+    monitor.stop();
 
     if(bzXmlRef.get()) {
         bzXmlRef.reset();
@@ -79,12 +81,23 @@ ShareManager::~ShareManager() {
 
 ShareManager::Directory::Directory(const string& aName, const ShareManager::Directory::Ptr& aParent) :
     size(0),
-    name(aName),
+    indexId(numeric_limits<uint32_t>::max()),
     parent(aParent.get()),
+    name(aName),
+    lowerName(Text::toLower(aName)),
+    compactedLength(0),
     fileTypes(1 << SearchManager::TYPE_DIRECTORY)
 {
 }
 
+uint32_t ShareManager::Directory::addLowerName(const string& aName) {
+    string tmp;
+    uint32_t pos = lowerNames.length();
+    lowerNames += Text::toLower(aName, tmp);
+    lowerNames += '\0';
+    return pos;
+}
+
 string ShareManager::Directory::getADCPath() const noexcept {
     if(!getParent())
         return '/' + name + '/';
@@ -413,7 +426,7 @@ bool ShareManager::loadCache() noexcept {
         SimpleXMLReader xml(&loader);
 
         dcpp::File ff(Util::getPath(Util::PATH_USER_CONFIG) + "files.xml.bz2", dcpp::File::READ, dcpp::File::OPEN);
-        FilteredInputStream<UnBZFilter, false> f(&ff);
+        FilteredInputStream<ParallelUnBZFilter, false> f(&ff);
 
         xml.parse(f);
 
@@ -539,6 +552,33 @@ void ShareManager::Directory::merge(const Directory::Ptr& source) {
             }
         }
     }
+
+    compactLowerNames();
+}
+
+void ShareManager::Directory::replaceFiles(const File::Set& aFiles) {
+    files.clear();
+    // A new string, so that the memory of a bigger file set is released as well
+    string().swap(lowerNames);
+
+    for(auto i = aFiles.begin(); i != aFiles.end(); ++i) {
+        auto added = files.insert(files.end(), *i);
+        const_cast<File&>(*added).setParent(this);
+    }
+    compactedLength = lowerNames.length();
+}
+
+void ShareManager::Directory::compactLowerNames() {
+    // Only after the arena doubled, so that the copying is amortized over the names added
+    if(lowerNames.length() <= 2 * compactedLength + 1024)
+        return;
+
+    string tmp;
+    for(auto i = files.begin(); i != files.end(); ++i) {
+        const_cast<File&>(*i).moveLowerName(tmp);
+    }
+    lowerNames.swap(tmp);
+    compactedLength = lowerNames.length();
 }
 
 void ShareManager::removeDirectory(const string& realPath) {
@@ -546,6 +586,7 @@ void ShareManager::removeDirectory(const string& realPath) {
         return;
 
     HashManager::getInstance()->stopHashing(realPath);
+    monitor.removeWatches(realPath);
 
     Lock l(cs);
 
@@ -622,8 +663,118 @@ size_t ShareManager::getSharedFiles() const noexcept {
     return tthIndex.size();
 }
 
+/**
+ * Builds directory trees with several threads. The directories waiting to be scanned are kept on
+ * a stack shared by the threads; each scan pushes the subdirectories it finds, and the walk ends
+ * once the stack is empty and no thread is scanning anymore.
+ */
+class DirectoryWalker {
+public:
+    DirectoryWalker(ShareManager& aSm, const ShareManager::ScanTaskList& aTasks) : sm(aSm), tasks(aTasks), busy(0), done(false) { }
+
+    void walk(int aThreads) {
+        // Threads that fail to start just leave surplus signals behind once done
+        threads = aThreads;
+        for(size_t i = 0; i < tasks.size(); ++i) {
+            s.signal();
+        }
+
+        // The calling thread scans too, so the walk completes even if no thread could be started
+        vector<unique_ptr<Worker>> workers;
+        for(int i = 1; i < aThreads; ++i) {
+            workers.push_back(unique_ptr<Worker>(new Worker(*this)));
+            try {
+                workers.back()->start();
+            } catch(const ThreadException& e) {
+                dcdebug("DirectoryWalker: %s\n", e.getError().c_str());
+                workers.pop_back();
+                break;
+            }
+        }
+
+        work();
+
+        for(auto i = workers.begin(); i != workers.end(); ++i) {
+            (*i)->join();
+        }
+    }
+
+private:
+    class Worker : public Thread {
+    public:
+        Worker(DirectoryWalker& aWalker) : walker(aWalker) { }
+        virtual int run() {
+            setThreadName("DirectoryWalker");
+            walker.work();
+            return 0;
+        }
+    private:
+        DirectoryWalker& walker;
+    };
+
+    void work() {
+        ShareManager::ScanTask task;
+        ShareManager::ScanTaskList subdirs;
+        while(true) {
+            s.wait();
+            {
+                Lock l(cs);
+                if(tasks.empty()) {
+                    dcassert(done);
+                    return;
+                }
+                task = tasks.back();
+                tasks.pop_back();
+                busy++;
+            }
+
+            subdirs.clear();
+            sm.scanDirectory(task.first, task.second, subdirs);
+
+            Lock l(cs);
+            busy--;
+            tasks.insert(tasks.end(), subdirs.begin(), subdirs.end());
+            for(size_t i = 0; i < subdirs.size(); ++i) {
+                s.signal();
+            }
+            if(tasks.empty() && busy == 0 && !done) {
+                // Wake everyone up to find the stack empty
+                done = true;
+                for(size_t i = 0; i < threads; ++i) {
+                    s.signal();
+                }
+            }
+        }
+    }
+
+    ShareManager& sm;
+
+    CriticalSection cs;
+    /** One signal per task, plus one per thread when the walk is done */
+    Semaphore s;
+    ShareManager::ScanTaskList tasks;
+    size_t busy;
+    size_t threads;
+    bool done;
+};
+
 ShareManager::Directory::Ptr ShareManager::buildTree(const string& aName, const Directory::Ptr& aParent) {
     auto dir = Directory::create(Util::getLastDir(aName), aParent);
+    walkTree(ScanTaskList(1, make_pair(aName, dir)));
+    return dir;
+}
+
+void ShareManager::walkTree(const ScanTaskList& aTasks) {
+    if(aTasks.empty())
+        return;
+
+    DirectoryWalker walker(*this, aTasks);
+    walker.walk(max(SETTING(SHARE_REFRESH_THREADS), 1));
+}
+
+void ShareManager::scanDirectory(const string& aName, const Directory::Ptr& dir, ScanTaskList& aSubdirs) {
+    // Watch before reading, so that nothing changes unnoticed in between
+    monitor.addWatch(aName);
 
     auto lastFileIter = dir->files.begin();
 
@@ -668,7 +819,9 @@ ShareManager::Directory::Ptr ShareManager::buildTree(const string& aName, const
             if((::strcmp(newName.c_str(), SETTING(TEMP_DOWNLOAD_DIRECTORY).c_str()) != 0)
                     && (::strcmp(newName.c_str(), Util::getPath(Util::PATH_USER_CONFIG).c_str()) != 0)
                     && (::strcmp(newName.c_str(), SETTING(LOG_DIRECTORY).c_str()) != 0)) {
-                dir->directories[name] = buildTree(newName, dir);
+                auto sub = Directory::create(name, dir);
+                dir->directories[name] = sub;
+                aSubdirs.push_back(make_pair(newName, sub));
             }
         } else {
             // Not a directory, assume it's a file...make sure we're not sharing the settings file...
@@ -696,8 +849,6 @@ ShareManager::Directory::Ptr ShareManager::buildTree(const string& aName, const
             }
         }
     }
-
-    return dir;
 }
 
 //NOTE: freedcpp [+
@@ -738,7 +889,9 @@ bool ShareManager::checkHidden(const string& aName) const
 //NOTE: freedcpp +]
 
 void ShareManager::updateIndices(Directory& dir) {
-    bloom.add(Text::toLower(dir.getName()));
+    bloom.add(dir.getLowerName());
+    nameIndex.add(getIndexId(dir), dir.getLowerName());
+    ++indexEntries;
 
     for(auto i = dir.directories.begin(); i != dir.directories.end(); ++i) {
         updateIndices(*i->second);
@@ -746,20 +899,43 @@ void ShareManager::updateIndices(Directory& dir) {
 
     dir.size = 0;
 
-    for(auto i = dir.files.begin(); i != dir.files.end(); ++i) {
-        updateIndices(dir, i);
+    // Duplicates get erased, so advance before updating
+    for(auto i = dir.files.begin(); i != dir.files.end(); ) {
+        updateIndices(dir, i++);
     }
 }
 
 void ShareManager::rebuildIndices() {
     tthIndex.clear();
     bloom.clear();
+    nameIndex.clear();
+    indexedDirs.clear();
+    indexEntries = 0;
+    staleIndexEntries = 0;
 
     for(auto i = directories.begin(); i != directories.end(); ++i) {
         updateIndices(**i);
     }
 }
 
+void ShareManager::removeIndices(Directory& dir) {
+    for(auto i = dir.directories.begin(); i != dir.directories.end(); ++i) {
+        removeIndices(*i->second);
+    }
+
+    for(auto i = dir.files.begin(); i != dir.files.end(); ++i) {
+        auto j = tthIndex.find(i->getTTH());
+        if(j != tthIndex.end() && &*j->second == &*i)
+            tthIndex.erase(j);
+    }
+
+    // The bloom filter and nameIndex can't forget; they only have to give no false negatives until
+    // refreshChanged rebuilds them
+    if(dir.indexId < indexedDirs.size() && indexedDirs[dir.indexId] == &dir)
+        indexedDirs[dir.indexId] = nullptr;
+    staleIndexEntries += 1 + dir.files.size();
+}
+
 void ShareManager::updateIndices(Directory& dir, const Directory::File::Set::iterator& i) {
     const Directory::File& f = *i;
 
@@ -780,7 +956,9 @@ void ShareManager::updateIndices(Directory& dir, const Directory::File::Set::ite
     dir.addType(getType(f.getName()));
 
     tthIndex.insert(make_pair(f.getTTH(), i));
-    bloom.add(Text::toLower(f.getName()));
+    bloom.add(f.getLowerName(), f.getLowerLength());
+    nameIndex.add(getIndexId(dir), f.getLowerName(), f.getLowerLength());
+    ++indexEntries;
 #ifdef WITH_DHT
     dht::IndexManager* im = dht::IndexManager::getInstance();
     if(im && im->isTimeForPublishing())
@@ -788,6 +966,14 @@ void ShareManager::updateIndices(Directory& dir, const Directory::File::Set::ite
 #endif
 }
 
+uint32_t ShareManager::getIndexId(Directory& dir) {
+    if(dir.indexId >= indexedDirs.size() || indexedDirs[dir.indexId] != &dir) {
+        dir.indexId = indexedDirs.size();
+        indexedDirs.push_back(&dir);
+    }
+    return dir.indexId;
+}
+
 void ShareManager::refresh(bool dirs /* = false */, bool aUpdate /* = true */, bool block /* = false */) noexcept {
     if(refreshing.exchange(true) == true) {
         LogManager::getInstance()->message(_("File list refresh in progress, please wait for it to finish before trying to refresh again"));
@@ -832,12 +1018,29 @@ int ShareManager::run() {
     if(dirs.empty())
         refreshDirs = false;
 
+    if(!refreshDirs && !changedDirs.empty()) {
+        if(refreshChanged(changedDirs)) {
+            Lock l(cs);
+            setDirty();
+            forceXmlRefresh = true;
+        } else {
+            refreshDirs = true;
+        }
+        changedDirs.clear();
+    }
+
     if(refreshDirs) {
         HashManager::HashPauser pauser;
         LogManager::getInstance()->message(_("File list refresh initiated"));
 
         lastFullUpdate = GET_TICK();
 
+        if(BOOLSETTING(SHARE_MONITOR) && monitor.start()) {
+            monitor.clearWatches();
+        } else {
+            monitor.stop();
+        }
+
         DirList newDirs;
         for(auto i = dirs.begin(); i != dirs.end(); ++i) {
             if (checkHidden(i->second)) {
@@ -901,7 +1104,7 @@ void ShareManager::generateXmlList() {
                 File f(newXmlName, File::WRITE, File::TRUNCATE | File::CREATE);
                 // We don't care about the leaves...
                 CalcOutputStream<TTFilter<1024*1024*1024>, false> bzTree(&f);
-                FilteredOutputStream<BZFilter, false> bzipper(&bzTree);
+                FilteredOutputStream<ParallelBZFilter, false> bzipper(&bzTree);
                 CountOutputStream<false> count(&bzipper);
                 CalcOutputStream<TTFilter<1024*1024*1024>, false> newXmlFile(&count);
 
@@ -1179,35 +1382,23 @@ SearchManager::TypeModes ShareManager::getType(const string& aFileName) const no
 
 /**
  * Alright, the main point here is that when searching, a search string is most often found in
- * the filename, not directory name, so we want to make that case faster. Also, we want to
- * avoid changing StringLists unless we absolutely have to --> this should only be done if a string
- * has been matched in the directory name. This new stringlist should also be used in all descendants,
- * but not the parents...
+ * the filename, not directory name, so we want to make that case faster. Words that have been
+ * matched in the directory name are dropped from aStrings for all descendants, but not the parents...
  */
-void ShareManager::Directory::search(SearchResultList& aResults, StringSearch::List& aStrings, int aSearchType, int64_t aSize, int aFileType, Client* aClient, StringList::size_type maxResults) const noexcept {
+void ShareManager::Directory::search(SearchResultList& aResults, const MultiStringSearch& aMatcher, MultiStringSearch::Mask aStrings, const SearchFilter& aFilter, int aSearchType, int64_t aSize, int aFileType, Client* aClient, StringList::size_type maxResults) const noexcept {
     // Skip everything if there's nothing to find here (doh! =)
     if(!hasType(aFileType))
         return;
 
-    StringSearch::List* cur = &aStrings;
-    unique_ptr<StringSearch::List> newStr;
+    // ...or if one of the remaining words appears nowhere below
+    if(!aFilter.hasTree(*this, aStrings))
+        return;
 
     // Find any matches in the directory name
-    for(auto k = aStrings.begin(); k != aStrings.end(); ++k) {
-        if(k->match(name)) {
-            if(!newStr.get()) {
-                newStr = unique_ptr<StringSearch::List>(new StringSearch::List(aStrings));
-            }
-            newStr->erase(remove(newStr->begin(), newStr->end(), *k), newStr->end());
-        }
-    }
-
-    if(newStr.get() != 0) {
-        cur = newStr.get();
-    }
+    MultiStringSearch::Mask cur = aStrings & ~aMatcher.matchLower(lowerName, aStrings);
 
     bool sizeOk = (aSearchType != SearchManager::SIZE_ATLEAST) || (aSize == 0);
-    if( (cur->empty()) &&
+    if( (cur == 0) &&
         (((aFileType == SearchManager::TYPE_ANY) && sizeOk) || (aFileType == SearchManager::TYPE_DIRECTORY)) ) {
         // We satisfied all the search words! Add the directory...(NMDC searches don't support directory size)
         SearchResultPtr sr(new SearchResult(SearchResult::TYPE_DIRECTORY, 0, getFullName(), TTHValue()));
@@ -1215,7 +1406,7 @@ void ShareManager::Directory::search(SearchResultList& aResults, StringSearch::L
         ShareManager::getInstance()->setHits(ShareManager::getInstance()->getHits()+1);
     }
 
-    if(aFileType != SearchManager::TYPE_DIRECTORY) {
+    if(aFileType != SearchManager::TYPE_DIRECTORY && aFilter.hasFiles(*this, cur)) {
         for(auto i = files.begin(); i != files.end(); ++i) {
 
             if(aSearchType == SearchManager::SIZE_ATLEAST && aSize > i->getSize()) {
@@ -1223,11 +1414,8 @@ void ShareManager::Directory::search(SearchResultList& aResults, StringSearch::L
             } else if(aSearchType == SearchManager::SIZE_ATMOST && aSize < i->getSize()) {
                 continue;
             }
-            auto j = cur->begin();
-            for(; j != cur->end() && j->match(i->getName()); ++j)
-                ;   // Empty
 
-            if(j != cur->end())
+            if((aMatcher.matchLower(i->getLowerName(), i->getLowerLength(), cur) & cur) != cur)
                 continue;
 
             // Check file type...
@@ -1243,7 +1431,7 @@ void ShareManager::Directory::search(SearchResultList& aResults, StringSearch::L
     }
 
     for(auto l = directories.begin(); (l != directories.end()) && (aResults.size() < maxResults); ++l) {
-        l->second->search(aResults, *cur, aSearchType, aSize, aFileType, aClient, maxResults);
+        l->second->search(aResults, aMatcher, cur, aFilter, aSearchType, aSize, aFileType, aClient, maxResults);
     }
 }
 
@@ -1268,26 +1456,71 @@ void ShareManager::search(SearchResultList& results, const string& aString, int
     if(!bloom.match(sl))
         return;
 
-    StringSearch::List ssl;
+    MultiStringSearch matcher;
     for(auto i = sl.begin(); i != sl.end(); ++i) {
-        if(!i->empty()) {
-            ssl.push_back(StringSearch(*i));
+        if(!i->empty() && !matcher.add(*i)) {
+            dcdebug("Too many search words, ignoring search\n");
+            return;
         }
     }
-    if(ssl.empty())
+    if(matcher.empty())
         return;
 
+    SearchFilter filter;
+    initFilter(filter, matcher, matcher.getAll());
+
     for(auto j = directories.begin(); (j != directories.end()) && (results.size() < maxResults); ++j) {
-        (*j)->search(results, ssl, aSearchType, aSize, aFileType, aClient, maxResults);
+        (*j)->search(results, matcher, matcher.getAll(), filter, aSearchType, aSize, aFileType, aClient, maxResults);
+    }
+}
+
+void ShareManager::initFilter(SearchFilter& filter, const MultiStringSearch& aMatcher, MultiStringSearch::Mask aStrings) {
+    NGramIndex<3>::IdList ids;
+    const StringList& patterns = aMatcher.getPatterns();
+    for(size_t i = 0; i < patterns.size(); ++i) {
+        MultiStringSearch::Mask bit = MultiStringSearch::Mask(1) << i;
+        if(!(aStrings & bit) || !nameIndex.find(patterns[i], ids))
+            continue;
+
+        filter.terms.push_back(SearchFilter::Term());
+        SearchFilter::Term& term = filter.terms.back();
+        term.bit = bit;
+        term.dirs.resize(indexedDirs.size());
+        term.trees.resize(indexedDirs.size());
+
+        for(auto j = ids.begin(); j != ids.end(); ++j) {
+            term.dirs[*j] = true;
+            // Walk up to the root, stopping where an earlier candidate has already been
+            for(const Directory* d = indexedDirs[*j]; d && !term.trees[d->indexId]; d = d->getParent()) {
+                dcassert(indexedDirs[d->indexId] == d);
+                term.trees[d->indexId] = true;
+            }
+        }
+    }
+}
+
+bool ShareManager::SearchFilter::hasFiles(const Directory& aDir, MultiStringSearch::Mask aStrings) const noexcept {
+    for(auto t = terms.begin(); t != terms.end(); ++t) {
+        if((aStrings & t->bit) && aDir.indexId < t->dirs.size() && !t->dirs[aDir.indexId])
+            return false;
+    }
+    return true;
+}
+
+bool ShareManager::SearchFilter::hasTree(const Directory& aDir, MultiStringSearch::Mask aStrings) const noexcept {
+    for(auto t = terms.begin(); t != terms.end(); ++t) {
+        if((aStrings & t->bit) && aDir.indexId < t->trees.size() && !t->trees[aDir.indexId])
+            return false;
     }
+    return true;
 }
 
 namespace {
     inline uint16_t toCode(char a, char b) { return (uint16_t)a | ((uint16_t)b)<<8; }
 }
 
-ShareManager::AdcSearch::AdcSearch(const StringList& params) : include(&includeX), gt(0),
-    lt(numeric_limits<int64_t>::max()), hasRoot(false), isDirectory(false)
+ShareManager::AdcSearch::AdcSearch(const StringList& params) : include(0), exclude(0), tooManyWords(false),
+    gt(0), lt(numeric_limits<int64_t>::max()), hasRoot(false), isDirectory(false)
 {
     for(auto i = params.begin(); i != params.end(); ++i) {
         const string& p = *i;
@@ -1300,9 +1533,13 @@ ShareManager::AdcSearch::AdcSearch(const StringList& params) : include(&includeX
             root = TTHValue(p.substr(2));
             return;
         } else if(toCode('A', 'N') == cmd) {
-            includeX.push_back(StringSearch(p.substr(2)));
+            MultiStringSearch::Mask bit = matcher.add(p.substr(2));
+            tooManyWords |= !bit;
+            include |= bit;
         } else if(toCode('N', 'O') == cmd) {
-            exclude.push_back(StringSearch(p.substr(2)));
+            MultiStringSearch::Mask bit = matcher.add(p.substr(2));
+            tooManyWords |= !bit;
+            exclude |= bit;
         } else if(toCode('E', 'X') == cmd) {
             ext.push_back(p.substr(2));
         } else if(toCode('G', 'R') == cmd) {
@@ -1320,23 +1557,16 @@ ShareManager::AdcSearch::AdcSearch(const StringList& params) : include(&includeX
             isDirectory = (p[2] == '2');
         }
     }
-}
 
-bool ShareManager::AdcSearch::isExcluded(const string& str) {
-    for(auto i = exclude.begin(); i != exclude.end(); ++i) {
-        if(i->match(str))
-            return true;
+    if(!noExt.empty()) {
+        ext = StringList(ext.begin(), set_difference(ext.begin(), ext.end(), noExt.begin(), noExt.end(), ext.begin()));
+        noExt.clear();
     }
-    return false;
 }
 
 bool ShareManager::AdcSearch::hasExt(const string& name) {
     if(ext.empty())
         return true;
-    if(!noExt.empty()) {
-        ext = StringList(ext.begin(), set_difference(ext.begin(), ext.end(), noExt.begin(), noExt.end(), ext.begin()));
-        noExt.clear();
-    }
     for(auto i = ext.cbegin(), iend = ext.cend(); i != iend; ++i) {
         if(name.length() >= i->length() && Util::stricmp(name.c_str() + name.length() - i->length(), i->c_str()) == 0)
             return true;
@@ -1345,34 +1575,25 @@ bool ShareManager::AdcSearch::hasExt(const string& name) {
 }
 
 void ShareManager::Directory::search(SearchResultList& aResults, AdcSearch& aStrings, StringList::size_type maxResults) const noexcept {
-    StringSearch::List* cur = aStrings.include;
-    StringSearch::List* old = aStrings.include;
-
-    unique_ptr<StringSearch::List> newStr;
-
-    // Find any matches in the directory name
-    for(auto k = cur->begin(); k != cur->end(); ++k) {
-        if(k->match(name) && !aStrings.isExcluded(name)) {
-            if(!newStr.get()) {
-                newStr = unique_ptr<StringSearch::List>(new StringSearch::List(*cur));
-            }
-            newStr->erase(remove(newStr->begin(), newStr->end(), *k), newStr->end());
-        }
-    }
+    // Skip everything if one of the words appears nowhere below
+    if(!aStrings.filter.hasTree(*this, aStrings.include))
+        return;
 
-    if(newStr.get() != 0) {
-        cur = newStr.get();
-    }
+    // Find any matches in the directory name; include and exclude words are looked for in one go
+    MultiStringSearch::Mask cur = aStrings.include;
+    MultiStringSearch::Mask found = aStrings.matcher.matchLower(lowerName);
+    if(!(found & aStrings.exclude))
+        cur &= ~found;
 
     bool sizeOk = (aStrings.gt == 0);
-    if( cur->empty() && aStrings.ext.empty() && sizeOk ) {
+    if( cur == 0 && aStrings.ext.empty() && sizeOk ) {
         // We satisfied all the search words! Add the directory...
         SearchResultPtr sr(new SearchResult(SearchResult::TYPE_DIRECTORY, getSize(), getFullName(), TTHValue()));
         aResults.push_back(sr);
         ShareManager::getInstance()->setHits(ShareManager::getInstance()->getHits()+1);
     }
 
-    if(!aStrings.isDirectory) {
+    if(!aStrings.isDirectory && aStrings.filter.hasFiles(*this, cur)) {
         for(auto i = files.begin(); i != files.end(); ++i) {
 
             if(!(i->getSize() >= aStrings.gt)) {
@@ -1381,14 +1602,8 @@ void ShareManager::Directory::search(SearchResultList& aResults, AdcSearch& aStr
                 continue;
             }
 
-            if(aStrings.isExcluded(i->getName()))
-                continue;
-
-            auto j = cur->begin();
-            for(; j != cur->end() && j->match(i->getName()); ++j)
-                ;   // Empty
-
-            if(j != cur->end())
+            found = aStrings.matcher.matchLower(i->getLowerName(), i->getLowerLength());
+            if((found & aStrings.exclude) || (found & cur) != cur)
                 continue;
 
             // Check file type...
@@ -1408,7 +1623,6 @@ void ShareManager::Directory::search(SearchResultList& aResults, AdcSearch& aStr
     for(auto l = directories.begin(); (l != directories.end()) && (aResults.size() < maxResults); ++l) {
         l->second->search(aResults, aStrings, maxResults);
     }
-    aStrings.include = old;
 }
 
 void ShareManager::search(SearchResultList& results, const StringList& params, StringList::size_type maxResults) noexcept {
@@ -1428,11 +1642,19 @@ void ShareManager::search(SearchResultList& results, const StringList& params, S
         return;
     }
 
-    for(auto i = srch.includeX.begin(); i != srch.includeX.end(); ++i) {
-        if(!bloom.match(i->getPattern()))
+    if(srch.tooManyWords) {
+        dcdebug("Too many search words, ignoring search\n");
+        return;
+    }
+
+    const StringList& patterns = srch.matcher.getPatterns();
+    for(size_t i = 0; i < patterns.size(); ++i) {
+        if((srch.include & (MultiStringSearch::Mask(1) << i)) && !bloom.match(patterns[i]))
             return;
     }
 
+    initFilter(srch.filter, srch.matcher, srch.include);
+
     for(auto j = directories.begin(); (j != directories.end()) && (results.size() < maxResults); ++j) {
         (*j)->search(results, srch, maxResults);
     }
@@ -1467,6 +1689,102 @@ ShareManager::Directory::Ptr ShareManager::getDirectory(const string& fname) {
     return Directory::Ptr();
 }
 
+ShareManager::Directory::Ptr ShareManager::getRealDirectory(const string& aRealPath, bool& aMerged) {
+    aMerged = false;
+    for(auto i = shares.begin(); i != shares.end(); ++i) {
+        if(Util::strnicmp(aRealPath, i->first, i->first.length()) == 0) {
+            for(auto j = shares.begin(); j != shares.end(); ++j) {
+                if(j != i && Util::stricmp(j->second, i->second) == 0) {
+                    aMerged = true;
+                    return Directory::Ptr();
+                }
+            }
+            break;
+        }
+    }
+    return getDirectory(aRealPath);
+}
+
+bool ShareManager::refreshChanged(const StringList& aPaths) {
+    for(auto i = aPaths.begin(); i != aPaths.end(); ++i) {
+        const string& path = *i;
+        bool merged;
+
+        Directory::Map known;
+        {
+            Lock l(cs);
+            auto dir = getRealDirectory(path, merged);
+            if(merged) {
+                // Which of the real directories a file comes from isn't kept
+                return false;
+            }
+            if(!dir) {
+                // Gone along with a parent
+                continue;
+            }
+            known = dir->directories;
+        }
+
+        // Scan outside the lock; only new subdirectories need a full walk
+        auto tmp = Directory::create(Util::getLastDir(path));
+        ScanTaskList subdirs, added;
+        scanDirectory(path, tmp, subdirs);
+        for(auto j = subdirs.begin(); j != subdirs.end(); ++j) {
+            if(known.find(j->second->getName()) == known.end())
+                added.push_back(*j);
+        }
+        walkTree(added);
+
+        Lock l(cs);
+        auto dir = getRealDirectory(path, merged);
+        if(merged)
+            return false;
+        if(!dir)
+            continue;
+
+        for(auto j = dir->directories.begin(); j != dir->directories.end(); ) {
+            if(tmp->directories.find(j->first) == tmp->directories.end()) {
+                removeIndices(*j->second);
+                monitor.removeWatches(path + j->first + PATH_SEPARATOR);
+                dir->directories.erase(j++);
+            } else {
+                ++j;
+            }
+        }
+
+        for(auto j = added.begin(); j != added.end(); ++j) {
+            const Directory::Ptr& sub = j->second;
+            if(dir->directories.find(sub->getName()) != dir->directories.end())
+                continue;
+            sub->setParent(dir.get());
+            dir->directories.insert(make_pair(sub->getName(), sub));
+            updateIndices(*sub);
+        }
+
+        for(auto j = dir->files.begin(); j != dir->files.end(); ++j) {
+            auto k = tthIndex.find(j->getTTH());
+            if(k != tthIndex.end() && &*k->second == &*j)
+                tthIndex.erase(k);
+        }
+        staleIndexEntries += dir->files.size();
+        dir->replaceFiles(tmp->files);
+
+        dir->size = 0;
+        for(auto j = dir->files.begin(); j != dir->files.end(); ) {
+            updateIndices(*dir, j++);
+        }
+    }
+
+    // Without full refreshes, searches would otherwise go through ever more names that are gone;
+    // rebuild once the stale names are more than a quarter of the live ones
+    Lock l(cs);
+    if(staleIndexEntries * 5 > indexEntries) {
+        dcdebug("ShareManager: rebuilding the indices, %u of %u names are stale\n", (unsigned)staleIndexEntries, (unsigned)indexEntries);
+        rebuildIndices();
+    }
+    return true;
+}
+
 void ShareManager::on(QueueManagerListener::FileMoved, const string& n) noexcept {
     if(BOOLSETTING(ADD_FINISHED_INSTANTLY)) {
         // Check if finished download is supposed to be shared
@@ -1502,14 +1820,39 @@ void ShareManager::on(HashManagerListener::TTHDone, const string& fname, const T
             int64_t size = File::getSize(fname);
             auto it = d->files.insert(Directory::File(name, size, d, root)).first;
             updateIndices(*d, it);
+            d->compactLowerNames();
         }
         setDirty();
         forceXmlRefresh = true;
     }
 }
 
+void ShareManager::on(TimerManagerListener::Second, uint64_t /*tick*/) noexcept {
+    if(!monitor.isRunning() || refreshing.exchange(true) == true)
+        return;
+
+    // Wait for changes to settle a bit, so that a burst of them is handled at once
+    changedDirs = monitor.getChanges(2000);
+    if(changedDirs.empty()) {
+        refreshing = false;
+        return;
+    }
+
+    update = true;
+    refreshDirs = false;
+    join();
+    try {
+        start();
+    } catch(const ThreadException& e) {
+        changedDirs.clear();
+        refreshing = false;
+        LogManager::getInstance()->message(str(F_("File list refresh failed: %1%") % e.getError()));
+    }
+}
+
 void ShareManager::on(TimerManagerListener::Minute, uint64_t tick) noexcept {
-    if (SETTING(AUTO_REFRESH_TIME) > 0) {
+    // The monitor keeps the share up to date, unless it may have missed something
+    if (SETTING(AUTO_REFRESH_TIME) > 0 && (!monitor.isRunning() || monitor.isIncomplete())) {
         if (lastFullUpdate + SETTING(AUTO_REFRESH_TIME) * 60 * 1000 < tick) {
             refresh(true, true);
         }
@@ -25,9 +25,11 @@
 #include "QueueManagerListener.h"
 #include "Exception.h"
 #include "CriticalSection.h"
-#include "StringSearch.h"
+#include "MultiStringSearch.h"
+#include "ShareMonitor.h"
 #include "Singleton.h"
 #include "BloomFilter.h"
+#include "NGramIndex.h"
 #include "FastAlloc.h"
 #include "MerkleTree.h"
 #include "Pointer.h"
@@ -50,6 +52,7 @@ class OutputStream;
 class MemoryInputStream;
 
 struct ShareLoader;
+class DirectoryWalker;
 class ShareManager : public Singleton<ShareManager>, private SettingsManagerListener, private Thread, private TimerManagerListener,
     private HashManagerListener, private QueueManagerListener
 {
@@ -115,6 +118,7 @@ public:
     GETSET(string, bzXmlFile, BZXmlFile);
 private:
     struct AdcSearch;
+    struct SearchFilter;
     class Directory : public FastAlloc<Directory>, public intrusive_ptr_base<Directory>, boost::noncopyable {
     public:
         typedef boost::intrusive_ptr<Directory> Ptr;
@@ -145,16 +149,17 @@ private:
             };
             typedef set<File, FileLess> Set;
 
-            File() : size(0), parent(0) { }
+            File() : size(0), parent(0), lowerPos(0), lowerLen(0) { }
             File(const string& aName, int64_t aSize, const Directory::Ptr& aParent, const TTHValue& aRoot) :
-            name(aName), tth(aRoot), size(aSize), parent(aParent.get()) { }
+            name(aName), tth(aRoot), size(aSize), parent(0), lowerPos(0), lowerLen(0) { setParent(aParent.get()); }
             File(const File& rhs) :
-            name(rhs.getName()), tth(rhs.getTTH()), size(rhs.getSize()), parent(rhs.getParent()) { }
+            name(rhs.getName()), tth(rhs.getTTH()), size(rhs.getSize()), parent(rhs.getParent()), lowerPos(rhs.lowerPos), lowerLen(rhs.lowerLen) { }
 
             ~File() { }
 
             File& operator=(const File& rhs) {
                 name = rhs.name; size = rhs.size; parent = rhs.parent; tth = rhs.tth;
+                lowerPos = rhs.lowerPos; lowerLen = rhs.lowerLen;
                 return *this;
             }
 
@@ -169,15 +174,42 @@ private:
             string getFullName() const { return parent->getFullName() + name; }
             string getRealPath() const { return parent->getRealPath(name); }
 
+            Directory* getParent() const { return parent; }
+            /** Also copies the lower-case name into the arena of the new parent */
+            void setParent(Directory* aParent) {
+                parent = aParent;
+                if(parent) {
+                    lowerPos = parent->addLowerName(name);
+                    lowerLen = parent->lowerNames.length() - lowerPos - 1;
+                }
+            }
+
+            /** Copy the lower-case name to the end of aNames, which replaces the arena of the parent */
+            void moveLowerName(string& aNames) {
+                uint32_t pos = aNames.length();
+                aNames.append(parent->lowerNames, lowerPos, lowerLen + 1);
+                lowerPos = pos;
+            }
+
+            /** Lower-case name, null-terminated */
+            const char* getLowerName() const { return parent->lowerNames.c_str() + lowerPos; }
+            size_t getLowerLength() const { return lowerLen; }
+
             GETSET(string, name, Name);
             GETSET(TTHValue, tth, TTH);
             GETSET(int64_t, size, Size);
-            GETSET(Directory*, parent, Parent);
+        private:
+            Directory* parent;
+            /** Position of the lower-case name in Directory::lowerNames */
+            uint32_t lowerPos;
+            uint32_t lowerLen;
         };
 
         int64_t size;
         Map directories;
         File::Set files;
+        /** Position in ShareManager::indexedDirs, only meaningful if that entry points back here */
+        uint32_t indexId;
 
         static Ptr create(const string& aName, const Ptr& aParent = Ptr()) { return Ptr(new Directory(aName, aParent)); }
 
@@ -192,7 +224,7 @@ private:
 
         int64_t getSize() const noexcept;
 
-        void search(SearchResultList& aResults, StringSearch::List& aStrings, int aSearchType, int64_t aSize, int aFileType, Client* aClient, StringList::size_type maxResults) const noexcept;
+        void search(SearchResultList& aResults, const MultiStringSearch& aMatcher, MultiStringSearch::Mask aStrings, const SearchFilter& aFilter, int aSearchType, int64_t aSize, int aFileType, Client* aClient, StringList::size_type maxResults) const noexcept;
         void search(SearchResultList& aResults, AdcSearch& aStrings, StringList::size_type maxResults) const noexcept;
 
         void toXml(OutputStream& xmlFile, string& indent, string& tmp2, bool fullList) const;
@@ -201,8 +233,15 @@ private:
         File::Set::const_iterator findFile(const string& aFile) const { return find_if(files.begin(), files.end(), Directory::File::StringComp(aFile)); }
 
         void merge(const Ptr& source);
+        /** Replace the files with copies of aFiles, which may belong to another directory */
+        void replaceFiles(const File::Set& aFiles);
+        /** Drop the names of removed files from lowerNames once it has doubled since it was last compacted */
+        void compactLowerNames();
+
+        const string& getName() const { return name; }
+        void setName(const string& aName) { name = aName; lowerName = Text::toLower(aName); }
+        const string& getLowerName() const { return lowerName; }
 
-        GETSET(string, name, Name);
         GETSET(Directory*, parent, Parent);
     private:
         friend void intrusive_ptr_release(intrusive_ptr_base<Directory>*);
@@ -210,6 +249,20 @@ private:
         Directory(const string& aName, const Ptr& aParent);
         ~Directory() { }
 
+        /** Append the lower-case version of a file name to lowerNames, returning its position */
+        uint32_t addLowerName(const string& aName);
+
+        string name;
+        string lowerName;
+        /**
+         * Lower-case names of the files in this directory, each followed by a null, so that searches
+         * don't have to convert every file name again. Names of files that have since been removed or
+         * moved to another directory stay here until compactLowerNames() or replaceFiles().
+         */
+        string lowerNames;
+        /** Length of lowerNames when it was last compacted */
+        size_t compactedLength;
+
         /** Set of flags that say which SearchManager::TYPE_* a directory contains */
         uint32_t fileTypes;
 
@@ -217,23 +270,51 @@ private:
 
     friend class Directory;
     friend struct ShareLoader;
+    friend class DirectoryWalker;
 
     friend class Singleton<ShareManager>;
     ShareManager();
 
     virtual ~ShareManager();
 
+    /**
+     * Narrows a search down to the directories that can produce results, using nameIndex.
+     * Only terms long enough to be looked up in the index constrain the search.
+     */
+    struct SearchFilter {
+        struct Term {
+            MultiStringSearch::Mask bit;
+            /** Directories whose own name or one of whose file names may contain the pattern */
+            vector<bool> dirs;
+            /** Same as dirs, plus all their ancestors */
+            vector<bool> trees;
+        };
+
+        /** Whether the files of aDir may match all of aStrings */
+        bool hasFiles(const Directory& aDir, MultiStringSearch::Mask aStrings) const noexcept;
+        /** Whether aDir or its descendants may match all of aStrings */
+        bool hasTree(const Directory& aDir, MultiStringSearch::Mask aStrings) const noexcept;
+
+        vector<Term> terms;
+    };
+
     struct AdcSearch {
         AdcSearch(const StringList& params);
 
-        bool isExcluded(const string& str);
         bool hasExt(const string& name);
-        StringSearch::List* include;
-        StringSearch::List includeX;
-        StringSearch::List exclude;
+
+        /** Include and exclude words together, so that each name is scanned once */
+        MultiStringSearch matcher;
+        MultiStringSearch::Mask include;
+        MultiStringSearch::Mask exclude;
+        /** More words than matcher can take; the search is ignored */
+        bool tooManyWords;
+
         StringList ext;
         StringList noExt;
 
+        SearchFilter filter;
+
         int64_t gt;
         int64_t lt;
 
@@ -282,15 +363,40 @@ private:
 
     BloomFilter<5> bloom;
 
+    /** Lower-case directory and file names by directory, see SearchFilter */
+    NGramIndex<3> nameIndex;
+    /** Directories by Directory::indexId */
+    vector<Directory*> indexedDirs;
+    /** Names added to the indices since they were built, and how many of those were removed since */
+    size_t indexEntries;
+    size_t staleIndexEntries;
+
+    /** Watches the shared directories, so that only the changed ones get refreshed */
+    ShareMonitor monitor;
+    /** Real paths of the directories to rescan when refreshDirs isn't set */
+    StringList changedDirs;
+
     Directory::File::Set::const_iterator findFile(const string& virtualFile) const;
 
+    /** A real path to scan, and the node its content goes to */
+    typedef pair<string, Directory::Ptr> ScanTask;
+    typedef vector<ScanTask> ScanTaskList;
+
     Directory::Ptr buildTree(const string& aName, const Directory::Ptr& aParent);
+    /** Scan the directories of aTasks, and all their subdirectories, using SHARE_REFRESH_THREADS threads */
+    void walkTree(const ScanTaskList& aTasks);
+    /** Read the files of one directory, adding an empty node to aDir and a task to aSubdirs for each subdirectory */
+    void scanDirectory(const string& aName, const Directory::Ptr& aDir, ScanTaskList& aSubdirs);
     bool checkHidden(const string& aName) const;
 
     void rebuildIndices();
+    /** Remove a directory and its subdirectories from the indices that support it, counting the names left behind */
+    void removeIndices(Directory& dir);
 
     void updateIndices(Directory& aDirectory);
     void updateIndices(Directory& dir, const Directory::File::Set::iterator& i);
+    uint32_t getIndexId(Directory& dir);
+    void initFilter(SearchFilter& filter, const MultiStringSearch& aMatcher, MultiStringSearch::Mask aStrings);
 
     Directory::Ptr merge(const Directory::Ptr& directory);
 
@@ -302,6 +408,14 @@ private:
     string findRealRoot(const string& virtualRoot, const string& virtualLeaf) const;
 
     Directory::Ptr getDirectory(const string& fname);
+    /**
+     * Find the node of a shared real directory.
+     * @param aMerged Set if the directory is part of a virtual directory shared from several real ones
+     */
+    Directory::Ptr getRealDirectory(const string& aRealPath, bool& aMerged);
+
+    /** Rescan the directories reported by the monitor, keeping the unchanged subdirectories */
+    bool refreshChanged(const StringList& aPaths);
 
     virtual int run();
 
@@ -319,6 +433,7 @@ private:
     }
 
     // TimerManagerListener
+    virtual void on(TimerManagerListener::Second, uint64_t tick) noexcept;
     virtual void on(TimerManagerListener::Minute, uint64_t tick) noexcept;
     void load(SimpleXML& aXml);
     void save(SimpleXML& aXml);
@@ -0,0 +1,229 @@
+/*
+ * Copyright (C) 2001-2012 Jacek Sieka, arnetheduck on gmail point com
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "stdinc.h"
+#include "ShareMonitor.h"
+
+#include "format.h"
+#include "LogManager.h"
+#include "TimerManager.h"
+#include "Util.h"
+
+#ifdef HAVE_INOTIFY
+#include <sys/inotify.h>
+#include <poll.h>
+#include <errno.h>
+#endif
+
+namespace dcpp {
+
+ShareMonitor::ShareMonitor() : fd(-1), stopping(false), incomplete(false) {
+}
+
+ShareMonitor::~ShareMonitor() {
+    stop();
+}
+
+#ifdef HAVE_INOTIFY
+
+namespace {
+    const uint32_t WATCH_MASK = IN_CREATE | IN_CLOSE_WRITE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO |
+        IN_DELETE_SELF | IN_ONLYDIR;
+}
+
+bool ShareMonitor::start() noexcept {
+    if(isRunning())
+        return true;
+
+    fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if(fd == -1) {
+        dcdebug("inotify_init1 failed: %s\n", Util::translateError(errno).c_str());
+        return false;
+    }
+
+    stopping = false;
+    try {
+        Thread::start();
+    } catch(const ThreadException&) {
+        ::close(fd);
+        fd = -1;
+        return false;
+    }
+    return true;
+}
+
+void ShareMonitor::stop() noexcept {
+    if(!isRunning())
+        return;
+
+    stopping = true;
+    join();
+
+    ::close(fd);
+    fd = -1;
+
+    Lock l(cs);
+    paths.clear();
+    watches.clear();
+    changes.clear();
+}
+
+void ShareMonitor::addWatch(const string& aPath) noexcept {
+    if(!isRunning())
+        return;
+
+    int wd = inotify_add_watch(fd, aPath.c_str(), WATCH_MASK);
+
+    Lock l(cs);
+    if(wd == -1) {
+        if(!incomplete && errno == ENOSPC) {
+            LogManager::getInstance()->message(_("Too many shared directories to watch for changes, the share will only be refreshed as a whole (see fs.inotify.max_user_watches)"));
+        }
+        incomplete = true;
+        return;
+    }
+
+    paths[wd] = aPath;
+    watches[aPath] = wd;
+}
+
+void ShareMonitor::removeWatches(const string& aPath) noexcept {
+    if(!isRunning())
+        return;
+
+    Lock l(cs);
+    for(auto i = watches.begin(); i != watches.end(); ) {
+        if(i->first.compare(0, aPath.length(), aPath) == 0) {
+            inotify_rm_watch(fd, i->second);
+            paths.erase(i->second);
+            watches.erase(i++);
+        } else {
+            ++i;
+        }
+    }
+}
+
+void ShareMonitor::clearWatches() noexcept {
+    if(!isRunning())
+        return;
+
+    Lock l(cs);
+    for(auto i = paths.begin(); i != paths.end(); ++i) {
+        inotify_rm_watch(fd, i->first);
+    }
+    paths.clear();
+    watches.clear();
+    changes.clear();
+    incomplete = false;
+}
+
+int ShareMonitor::run() {
+    setThreadName("ShareMonitor");
+
+    // Large enough for a good number of events at once, aligned for inotify_event
+    union {
+        inotify_event event;
+        char buf[64 * 1024];
+    } events;
+
+    while(!stopping) {
+        pollfd pfd = { fd, POLLIN, 0 };
+        if(::poll(&pfd, 1, 1000) <= 0)
+            continue;
+
+        ssize_t len;
+        while((len = ::read(fd, events.buf, sizeof(events.buf))) > 0) {
+            for(char* p = events.buf; p < events.buf + len; ) {
+                const inotify_event* e = reinterpret_cast<const inotify_event*>(p);
+                p += sizeof(inotify_event) + e->len;
+
+                Lock l(cs);
+                if(e->mask & IN_Q_OVERFLOW) {
+                    dcdebug("ShareMonitor: event queue overflow\n");
+                    incomplete = true;
+                    continue;
+                }
+
+                auto i = paths.find(e->wd);
+                if(i == paths.end())
+                    continue;
+
+                if(e->mask & IN_IGNORED) {
+                    // Watch gone, the parent gets its own event for the deletion
+                    watches.erase(i->second);
+                    paths.erase(i);
+                    continue;
+                }
+
+                // New files are picked up once closed; new directories right away so that they get watched
+                if((e->mask & IN_CREATE) && !(e->mask & IN_ISDIR))
+                    continue;
+
+                if(!(e->mask & IN_DELETE_SELF))
+                    addChange(i->second);
+            }
+        }
+    }
+    return 0;
+}
+
+#else // HAVE_INOTIFY
+
+bool ShareMonitor::start() noexcept {
+    return false;
+}
+
+void ShareMonitor::stop() noexcept {
+}
+
+void ShareMonitor::addWatch(const string&) noexcept {
+}
+
+void ShareMonitor::removeWatches(const string&) noexcept {
+}
+
+void ShareMonitor::clearWatches() noexcept {
+}
+
+int ShareMonitor::run() {
+    return 0;
+}
+
+#endif // HAVE_INOTIFY
+
+void ShareMonitor::addChange(const string& aPath) noexcept {
+    changes[aPath] = GET_TICK();
+}
+
+StringList ShareMonitor::getChanges(uint64_t aSettle) noexcept {
+    StringList ret;
+    uint64_t tick = GET_TICK();
+
+    Lock l(cs);
+    for(auto i = changes.begin(); i != changes.end(); ) {
+        if(i->second + aSettle <= tick) {
+            ret.push_back(i->first);
+            changes.erase(i++);
+        } else {
+            ++i;
+        }
+    }
+    return ret;
+}
+
+} // namespace dcpp
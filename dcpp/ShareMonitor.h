@@ -0,0 +1,80 @@
+/*
+ * Copyright (C) 2001-2012 Jacek Sieka, arnetheduck on gmail point com
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#pragma once
+
+#include "Thread.h"
+#include "CriticalSection.h"
+#include "Atomic.h"
+#include "typedefs.h"
+#include "noexcept.h"
+
+namespace dcpp {
+
+/**
+ * Collects the shared directories whose content changed, so that ShareManager can rescan only
+ * those instead of the whole share. Uses inotify where available; elsewhere start() fails and
+ * only full refreshes are done.
+ */
+class ShareMonitor : private Thread {
+public:
+    ShareMonitor();
+    virtual ~ShareMonitor();
+
+    /** @return false if changes can't be monitored on this system */
+    bool start() noexcept;
+    void stop() noexcept;
+    bool isRunning() const noexcept { return fd != -1; }
+
+    /** Watch the files and subdirectories of a directory, but not the content of the subdirectories */
+    void addWatch(const string& aPath) noexcept;
+    /** Stop watching a directory and everything below it */
+    void removeWatches(const string& aPath) noexcept;
+    void clearWatches() noexcept;
+
+    /**
+     * Whether changes may have been missed, because events were dropped or because some directory
+     * couldn't be watched; a full refresh is then needed. Reset by clearWatches.
+     */
+    bool isIncomplete() const noexcept { Lock l(cs); return incomplete; }
+
+    /**
+     * Take the directories that changed, provided their last change is at least aSettle ms old
+     * (files that are still being written keep producing changes).
+     */
+    StringList getChanges(uint64_t aSettle) noexcept;
+
+private:
+    virtual int run();
+
+    void addChange(const string& aPath) noexcept;
+
+    int fd;
+    Atomic<bool,memory_ordering_strong> stopping;
+
+    mutable CriticalSection cs;
+
+    bool incomplete;
+
+    unordered_map<int, string> paths;
+    unordered_map<string, int> watches;
+    /** Directory -> tick of its latest change */
+    unordered_map<string, uint64_t> changes;
+};
+
+} // namespace dcpp
@@ -34,6 +34,10 @@
 #define MSG_NOSIGNAL 0
 #endif
 
+#if defined(__linux__) && defined(MSG_WAITFORONE)
+#define HAVE_MMSG
+#endif
+
 #ifndef IP_TOS
 #define        IP_TOS          1
 #endif
@@ -56,6 +60,11 @@
 #include <sys/sockio.h>
 #endif
 
+#ifdef HAVE_SENDFILE
+#include <sys/sendfile.h>
+#include "File.h"
+#endif
+
 namespace dcpp {
 
 string Socket::udpServer;
@@ -391,6 +400,98 @@ int Socket::read(void* aBuffer, int aBufLen, sockaddr_in &remote) {
     return len;
 }
 
+int Socket::readPackets(Datagram* aPackets, int aCount) {
+    dcassert(type == TYPE_UDP);
+    aCount = min(aCount, (int)MAX_BATCH);
+
+#ifdef HAVE_MMSG
+    mmsghdr msgs[MAX_BATCH];
+    iovec iov[MAX_BATCH];
+    memset(msgs, 0, sizeof(mmsghdr) * aCount);
+    for(int i = 0; i < aCount; ++i) {
+        iov[i].iov_base = aPackets[i].buf;
+        iov[i].iov_len = aPackets[i].len;
+        msgs[i].msg_hdr.msg_name = &aPackets[i].addr;
+        msgs[i].msg_hdr.msg_namelen = sizeof(sockaddr_in);
+        msgs[i].msg_hdr.msg_iov = &iov[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    int n;
+    do {
+        n = ::recvmmsg(sock, msgs, aCount, MSG_DONTWAIT, NULL);
+    } while (n < 0 && getLastError() == EINTR);
+
+    // fall back to single reads on kernels without recvmmsg
+    if(n >= 0 || getLastError() != ENOSYS) {
+        if(check(n, true) < 0) {
+            return 0;
+        }
+        for(int i = 0; i < n; ++i) {
+            aPackets[i].len = msgs[i].msg_len;
+            stats.totalDown += aPackets[i].len;
+        }
+        return n;
+    }
+#endif
+
+    int len = read(aPackets[0].buf, aPackets[0].len, aPackets[0].addr);
+    if(len < 0) {
+        return 0;
+    }
+    aPackets[0].len = len;
+    return 1;
+}
+
+int Socket::writePackets(const Datagram* aPackets, int aCount) {
+    dcassert(type == TYPE_UDP);
+    aCount = min(aCount, (int)MAX_BATCH);
+
+#ifdef HAVE_MMSG
+    mmsghdr msgs[MAX_BATCH];
+    iovec iov[MAX_BATCH];
+    memset(msgs, 0, sizeof(mmsghdr) * aCount);
+    for(int i = 0; i < aCount; ++i) {
+        iov[i].iov_base = aPackets[i].buf;
+        iov[i].iov_len = aPackets[i].len;
+        msgs[i].msg_hdr.msg_name = const_cast<sockaddr_in*>(&aPackets[i].addr);
+        msgs[i].msg_hdr.msg_namelen = sizeof(sockaddr_in);
+        msgs[i].msg_hdr.msg_iov = &iov[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    int n;
+    do {
+        n = ::sendmmsg(sock, msgs, aCount, MSG_NOSIGNAL);
+    } while (n < 0 && getLastError() == EINTR);
+
+    if(n >= 0 || getLastError() != ENOSYS) {
+        check(n);
+        for(int i = 0; i < n; ++i) {
+            stats.totalUp += aPackets[i].len;
+        }
+        return n;
+    }
+#endif
+
+    int sent = 0;
+    for(; sent < aCount; ++sent) {
+        const Datagram& p = aPackets[sent];
+        int len;
+        do {
+            len = ::sendto(sock, (const char*)p.buf, p.len, 0, (const sockaddr*)&p.addr, sizeof(p.addr));
+        } while (len < 0 && getLastError() == EINTR);
+
+        // the failure is reported when the packet is sent again as the first one
+        if(len < 0 && sent > 0) {
+            break;
+        }
+        check(len);
+        stats.totalUp += len;
+    }
+    return sent;
+}
+
 int Socket::readAll(void* aBuffer, int aBufLen, uint32_t timeout) {
     uint8_t* buf = (uint8_t*)aBuffer;
     int i = 0;
@@ -440,6 +541,32 @@ int Socket::write(const void* aBuffer, int aLen) {
     return sent;
 }
 
+bool Socket::canSendFile() const noexcept {
+#ifdef HAVE_SENDFILE
+    return true;
+#else
+    return false;
+#endif
+}
+
+int Socket::sendFile(File& aFile, size_t aLen) {
+#ifdef HAVE_SENDFILE
+    ssize_t sent;
+    do {
+        sent = ::sendfile(sock, aFile.getHandle(), NULL, aLen);
+    } while (sent < 0 && getLastError() == EINTR);
+
+    check(sent, true);
+    if(sent > 0) {
+        stats.totalUp += sent;
+    }
+    return sent;
+#else
+    dcassert(0);
+    throw SocketException(EINVAL);
+#endif
+}
+
 /**
 * Sends data, will block until all data has been sent or an exception occurs
 * @param aBuffer Buffer with data
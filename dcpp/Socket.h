@@ -96,6 +96,14 @@ public:
     void writeAll(const void* aBuffer, int aLen, uint32_t timeout = 0);
     virtual int write(const void* aBuffer, int aLen);
     int write(const string& aData) { return write(aData.data(), (int)aData.length()); }
+    /**
+     * Sends data straight from the current position of a file, which is moved past the bytes sent
+     * @return Number of bytes sent, 0 at the end of the file and -1 if the call would block.
+     * @throw SocketException Send failed.
+     */
+    int sendFile(File& aFile, size_t aLen);
+    /** Whether sendFile can be used with this socket */
+    virtual bool canSendFile() const noexcept;
     virtual void writeTo(const string& aIp, uint16_t aPort, const void* aBuffer, int aLen, bool proxy = true);
     void writeTo(const string& aIp, uint16_t aPort, const string& aData) { writeTo(aIp, aPort, aData.data(), (int)aData.length()); }
     virtual void shutdown() noexcept;
@@ -130,6 +138,32 @@ public:
      */
     int readAll(void* aBuffer, int aBufLen, uint32_t timeout = 0);
 
+    /** A UDP packet for readPackets and writePackets */
+    struct Datagram {
+        sockaddr_in addr;
+        uint8_t* buf;
+        int len;
+    };
+
+    enum { MAX_BATCH = 64 };
+
+    /**
+     * Reads the UDP packets waiting on this socket, up to MAX_BATCH of them in one call where the
+     * system supports it (elsewhere just one, so only call it when the socket is readable).
+     * @param aPackets Buffers to store the packets in; len is the size of the buffer on input and
+     * the length of the packet on output.
+     * @return Number of packets read, 0 if the call would block.
+     * @throw SocketException On any failure.
+     */
+    int readPackets(Datagram* aPackets, int aCount);
+    /**
+     * Sends UDP packets directly to their addresses (no socks relay), up to MAX_BATCH of them in one
+     * call where the system supports it.
+     * @return Number of packets sent, at least one.
+     * @throw SocketException When the first packet couldn't be sent.
+     */
+    int writePackets(const Datagram* aPackets, int aCount);
+
     virtual int wait(uint32_t millis, int waitFor);
     bool isConnected() { return connected; }
 
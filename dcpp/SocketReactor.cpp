@@ -0,0 +1,302 @@
+/*
+ * Copyright (C) 2001-2012 Jacek Sieka, arnetheduck on gmail point com
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "stdinc.h"
+#include "SocketReactor.h"
+
+#include "SettingsManager.h"
+#include "Thread.h"
+#include "TimerManager.h"
+#include "Atomic.h"
+
+#ifdef HAVE_EPOLL
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#endif
+
+namespace dcpp {
+
+#ifdef HAVE_EPOLL
+
+class SocketReactor::Loop : public Thread {
+public:
+    Loop() : fd(-1), wakeFd(-1), stopping(false) { }
+
+    virtual ~Loop() {
+        if(fd != -1) {
+            stopping = true;
+            wake();
+            join();
+            ::close(fd);
+        }
+        if(wakeFd != -1)
+            ::close(wakeFd);
+    }
+
+    bool init() noexcept {
+        fd = epoll_create1(EPOLL_CLOEXEC);
+        wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if(fd == -1 || wakeFd == -1)
+            return false;
+
+        // A NULL handler stands for the wake-up descriptor
+        epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.ptr = NULL;
+        if(epoll_ctl(fd, EPOLL_CTL_ADD, wakeFd, &ev) != 0)
+            return false;
+
+        try {
+            start();
+        } catch(const ThreadException&) {
+            return false;
+        }
+        return true;
+    }
+
+    void attach(Handler* h, socket_t aSock, int aEvents) noexcept {
+        {
+            Lock l(cs);
+            h->sock = aSock;
+            doUpdate(h, aEvents);
+            h->notified = true;
+            notified.push_back(h);
+        }
+        wake();
+    }
+
+    void update(Handler* h, int aEvents) noexcept {
+        // The handler may be attached from another thread while the loop already polls it
+        Lock l(cs);
+        doUpdate(h, aEvents);
+    }
+
+    void notify(Handler* h) noexcept {
+        {
+            Lock l(cs);
+            if(h->notified)
+                return;
+            h->notified = true;
+            notified.push_back(h);
+        }
+        wake();
+    }
+
+    void retry(Handler* h, uint32_t aDelay) noexcept {
+        // Only called from the handler, so the loop picks the new timeout up right after
+        uint64_t due = GET_TICK() + aDelay;
+        Lock l(cs);
+        auto i = find_if(retries.begin(), retries.end(), [h](const Retry& r) { return r.first == h; });
+        if(i != retries.end()) {
+            i->second = min(i->second, due);
+        } else {
+            retries.push_back(make_pair(h, due));
+        }
+    }
+
+    void destroy(Handler* h) noexcept {
+        Lock l(cs);
+        doUpdate(h, 0);
+        h->closed = true;
+
+        notified.erase(remove(notified.begin(), notified.end(), h), notified.end());
+        retries.erase(remove_if(retries.begin(), retries.end(), [h](const Retry& r) { return r.first == h; }), retries.end());
+        dead.push_back(h);
+    }
+
+private:
+    enum { MAX_EVENTS = 256 };
+
+    /** Handler, tick to call it at */
+    typedef pair<Handler*, uint64_t> Retry;
+
+    void doUpdate(Handler* h, int aEvents) noexcept {
+        if(h->events == aEvents)
+            return;
+
+        epoll_event ev;
+        ev.events = 0;
+        if(aEvents & Socket::WAIT_READ)
+            ev.events |= EPOLLIN;
+        if(aEvents & Socket::WAIT_WRITE)
+            ev.events |= EPOLLOUT;
+        ev.data.ptr = h;
+        int op = aEvents == 0 ? EPOLL_CTL_DEL : (h->events == 0 ? EPOLL_CTL_ADD : EPOLL_CTL_MOD);
+        if(epoll_ctl(fd, op, h->sock, &ev) != 0) {
+            dcdebug("SocketReactor: epoll_ctl %d failed for %d: %d\n", op, (int)h->sock, errno);
+        }
+        h->events = aEvents;
+    }
+
+    void wake() noexcept {
+        uint64_t v = 1;
+        if(::write(wakeFd, &v, sizeof(v)) < 0) {
+            // Already signalled
+        }
+    }
+
+    virtual int run() {
+        setThreadName("SocketReactor");
+
+        epoll_event events[MAX_EVENTS];
+        vector<Handler*> ready;
+
+        while(!stopping) {
+            int timeout = -1;
+            {
+                Lock l(cs);
+                if(!retries.empty()) {
+                    uint64_t tick = GET_TICK();
+                    uint64_t due = min_element(retries.begin(), retries.end(),
+                        [](const Retry& a, const Retry& b) { return a.second < b.second; })->second;
+                    timeout = due > tick ? static_cast<int>(due - tick) : 0;
+                }
+            }
+
+            int n = epoll_wait(fd, events, MAX_EVENTS, timeout);
+            if(n < 0) {
+                dcdebug("SocketReactor: epoll_wait failed: %d\n", errno);
+                n = 0;
+            }
+
+            for(int i = 0; i < n; ++i) {
+                Handler* h = static_cast<Handler*>(events[i].data.ptr);
+                if(!h) {
+                    uint64_t v;
+                    if(::read(wakeFd, &v, sizeof(v)) < 0) {
+                        // Nothing to read
+                    }
+                    continue;
+                }
+                if(h->closed)
+                    continue;
+
+                // Errors and hang-ups show up when reading
+                uint32_t e = events[i].events;
+                h->handleEvents(((e & (EPOLLIN | EPOLLHUP | EPOLLERR)) ? Socket::WAIT_READ : 0) |
+                    ((e & EPOLLOUT) ? Socket::WAIT_WRITE : 0));
+            }
+
+            {
+                Lock l(cs);
+                ready.swap(notified);
+                for(auto i = ready.begin(); i != ready.end(); ++i)
+                    (*i)->notified = false;
+
+                uint64_t tick = GET_TICK();
+                for(auto i = retries.begin(); i != retries.end();) {
+                    if(i->second <= tick) {
+                        ready.push_back(i->first);
+                        i = retries.erase(i);
+                    } else {
+                        ++i;
+                    }
+                }
+            }
+
+            for(auto i = ready.begin(); i != ready.end(); ++i) {
+                if(!(*i)->closed)
+                    (*i)->handleEvents(0);
+            }
+            ready.clear();
+
+            vector<Handler*> d;
+            {
+                Lock l(cs);
+                d.swap(dead);
+            }
+            for(auto i = d.begin(); i != d.end(); ++i)
+                delete *i;
+        }
+        return 0;
+    }
+
+    int fd;
+    int wakeFd;
+    Atomic<bool,memory_ordering_strong> stopping;
+
+    CriticalSection cs;
+    vector<Handler*> notified;
+    vector<Retry> retries;
+    vector<Handler*> dead;
+};
+
+#else
+
+class SocketReactor::Loop {
+public:
+    bool init() noexcept { return false; }
+    void attach(Handler*, socket_t, int) noexcept { }
+    void update(Handler*, int) noexcept { }
+    void notify(Handler*) noexcept { }
+    void retry(Handler*, uint32_t) noexcept { }
+    void destroy(Handler*) noexcept { }
+};
+
+#endif
+
+SocketReactor::SocketReactor() : nextLoop(0), started(false) {
+}
+
+SocketReactor::~SocketReactor() {
+    // The loops stop and wait for their threads when deleted
+}
+
+bool SocketReactor::isEnabled() noexcept {
+    Lock l(cs);
+    if(!started) {
+        started = true;
+        for(int i = 0; i < SETTING(SOCKET_REACTOR_THREADS); ++i) {
+            unique_ptr<Loop> loop(new Loop);
+            if(!loop->init()) {
+                dcdebug("SocketReactor: unavailable, sockets keep their own threads\n");
+                loops.clear();
+                break;
+            }
+            loops.push_back(move(loop));
+        }
+    }
+    return !loops.empty();
+}
+
+void SocketReactor::attach(Handler* h, socket_t aSock, int aEvents) noexcept {
+    {
+        Lock l(cs);
+        dcassert(!loops.empty());
+        h->loop = loops[nextLoop++ % loops.size()].get();
+    }
+    h->loop->attach(h, aSock, aEvents);
+}
+
+void SocketReactor::update(Handler* h, int aEvents) noexcept {
+    h->loop->update(h, aEvents);
+}
+
+void SocketReactor::notify(Handler* h) noexcept {
+    h->loop->notify(h);
+}
+
+void SocketReactor::retry(Handler* h, uint32_t aDelay) noexcept {
+    h->loop->retry(h, aDelay);
+}
+
+void SocketReactor::destroy(Handler* h) noexcept {
+    h->loop->destroy(h);
+}
+
+} // namespace dcpp
@@ -0,0 +1,93 @@
+/*
+ * Copyright (C) 2001-2012 Jacek Sieka, arnetheduck on gmail point com
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#pragma once
+
+#include "Singleton.h"
+#include "CriticalSection.h"
+#include "Socket.h"
+#include "typedefs.h"
+#include "noexcept.h"
+
+namespace dcpp {
+
+/**
+ * A few epoll event loops that drive established connections, instead of a thread per
+ * BufferedSocket. A handler is only ever called from the loop it was attached to, so it needs no
+ * locking against itself. Where epoll isn't available, isEnabled() is false and sockets keep
+ * their own threads.
+ */
+class SocketReactor : public Singleton<SocketReactor> {
+    class Loop;
+public:
+    class Handler {
+    public:
+        Handler() : loop(NULL), sock(INVALID_SOCKET), events(0), notified(false), closed(false) { }
+        virtual ~Handler() { }
+
+        /**
+         * Called from the loop.
+         * @param aEvents Socket::WAIT_READ and/or Socket::WAIT_WRITE if the socket is ready, 0 when
+         * the handler was only notified.
+         */
+        virtual void handleEvents(int aEvents) = 0;
+
+    private:
+        friend class SocketReactor;
+
+        Loop* loop;
+        socket_t sock;
+        /** Socket::WAIT_* flags polled for; 0 when the socket isn't registered */
+        int events;
+        bool notified;
+        bool closed;
+    };
+
+    /** Whether sockets should be handed over to the reactor */
+    bool isEnabled() noexcept;
+
+    /**
+     * Start polling a socket for aEvents (Socket::WAIT_*); the handler is notified right away.
+     * Call it before the handler can be notified from another thread.
+     */
+    void attach(Handler* h, socket_t aSock, int aEvents) noexcept;
+    /** Change the events polled for; with 0 the socket is not polled at all */
+    void update(Handler* h, int aEvents) noexcept;
+    /** Stop polling the socket, which must be done before closing it; notifications still work */
+    void detach(Handler* h) noexcept { update(h, 0); }
+    /** Have the loop call the handler as soon as possible; may be called from any thread */
+    void notify(Handler* h) noexcept;
+    /** Have the loop call the handler in aDelay ms, e.g. when its traffic is throttled */
+    void retry(Handler* h, uint32_t aDelay) noexcept;
+    /** Delete the handler once the loop is done with it; only called from the handler itself */
+    void destroy(Handler* h) noexcept;
+
+private:
+    friend class Singleton<SocketReactor>;
+
+    SocketReactor();
+    virtual ~SocketReactor();
+
+    CriticalSection cs;
+    /** Started on first use, as settings aren't loaded yet when the reactor is created */
+    vector<unique_ptr<Loop> > loops;
+    size_t nextLoop;
+    bool started;
+};
+
+} // namespace dcpp
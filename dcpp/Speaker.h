@@ -22,7 +22,9 @@
 #include <vector>
 #include <algorithm>
 #include <iterator>
+#include <atomic>
 #include "CriticalSection.h"
+#include "Thread.h"
 #include "noexcept.h"
 
 namespace dcpp {
@@ -31,45 +33,149 @@ using std::forward;
 using std::vector;
 using std::find;
 
+/** The Speakers whose fire() the current thread is in, innermost last */
+struct SpeakerFiring {
+    enum { MAX_DEPTH = 32 };
+
+    const void* speakers[MAX_DEPTH];
+    int depth;
+
+    void push(const void* aSpeaker) {
+        if(depth < MAX_DEPTH)
+            speakers[depth] = aSpeaker;
+        ++depth;
+    }
+    void pop() { --depth; }
+
+    /** Deeper nesting isn't recorded; it's then assumed to include aSpeaker, as waiting could deadlock */
+    bool contains(const void* aSpeaker) const {
+        if(depth > MAX_DEPTH)
+            return true;
+        return find(speakers, speakers + depth, aSpeaker) != speakers + depth;
+    }
+};
+
+inline SpeakerFiring& speakerFiring() {
+    static __thread SpeakerFiring firing = { { 0 }, 0 };
+    return firing;
+}
+
+/**
+ * Listeners are kept in an immutable list that is replaced on every change (copy-on-write):
+ * fire() only loads the current list, without locking or copying. Fires of one Speaker may
+ * run at the same time on several threads. Like before, a listener isn't called anymore once
+ * removeListener returns, unless the removal happens from within a fire() of the same Speaker.
+ */
 template<typename Listener>
 class Speaker {
     typedef vector<Listener*> ListenerList;
 
 public:
-    Speaker() noexcept { }
-    virtual ~Speaker() { }
+    Speaker() noexcept : listeners(new ListenerList), generation(0) {
+        firing[0] = 0;
+        firing[1] = 0;
+    }
+    virtual ~Speaker() {
+        delete listeners.load();
+        for(auto i = retired.begin(); i != retired.end(); ++i)
+            delete *i;
+    }
 
     template<typename... T>
     void fire(T&&... type) noexcept {
-        Lock l(listenerCS);
-        tmp = listeners;
-        for(auto i = tmp.begin(); i != tmp.end(); ++i) {
+        unsigned g = enter();
+        speakerFiring().push(this);
+        const ListenerList* l = listeners.load();
+        for(auto i = l->begin(); i != l->end(); ++i) {
             (*i)->on(std::forward<T>(type)...);
         }
+        speakerFiring().pop();
+        --firing[g & 1];
     }
 
     void addListener(Listener* aListener) {
         Lock l(listenerCS);
-        if(find(listeners.begin(), listeners.end(), aListener) == listeners.end())
-            listeners.push_back(aListener);
+        const ListenerList* cur = listeners.load();
+        if(find(cur->begin(), cur->end(), aListener) == cur->end()) {
+            ListenerList* tmp = new ListenerList(*cur);
+            tmp->push_back(aListener);
+            retired.push_back(listeners.exchange(tmp));
+        }
     }
 
     void removeListener(Listener* aListener) {
-        Lock l(listenerCS);
-        auto it = find(listeners.begin(), listeners.end(), aListener);
-        if(it != listeners.end())
-            listeners.erase(it);
+        {
+            Lock l(listenerCS);
+            const ListenerList* cur = listeners.load();
+            auto it = find(cur->begin(), cur->end(), aListener);
+            if(it == cur->end())
+                return;
+            ListenerList* tmp = new ListenerList(cur->begin(), it);
+            tmp->insert(tmp->end(), it + 1, cur->end());
+            retired.push_back(listeners.exchange(tmp));
+        }
+        waitFire();
     }
 
     void removeListeners() {
-        Lock l(listenerCS);
-        listeners.clear();
+        {
+            Lock l(listenerCS);
+            retired.push_back(listeners.exchange(new ListenerList));
+        }
+        waitFire();
     }
 
 protected:
-    ListenerList listeners;
-    ListenerList tmp;
+    bool hasListeners() const noexcept { return !listeners.load()->empty(); }
+
+private:
+    /**
+     * Count a fire() in the current generation. The generation is checked again once counted, so a
+     * fire() counted in a generation also started while it was current.
+     */
+    unsigned enter() noexcept {
+        while(true) {
+            unsigned g = generation.load();
+            ++firing[g & 1];
+            if(generation.load() == g)
+                return g;
+            --firing[g & 1];
+        }
+    }
+
+    /**
+     * Wait for the fire() calls that may still see a replaced list, then free those lists. Starting
+     * a new generation leaves the fires started before it counted in the old one, which only
+     * shrinks; later fires are counted in the new one and see the current list. Waiting from
+     * within a fire() of this Speaker would never end, so the lists are then kept for later.
+     */
+    void waitFire() {
+        if(speakerFiring().contains(this))
+            return;
+
+        Lock w(waitCS);
+        vector<ListenerList*> old;
+        unsigned g;
+        {
+            Lock l(listenerCS);
+            old.swap(retired);
+            g = generation++;
+        }
+        while(firing[g & 1].load() != 0)
+            Thread::yield();
+        for(auto i = old.begin(); i != old.end(); ++i)
+            delete *i;
+    }
+
+    std::atomic<ListenerList*> listeners;
+    std::atomic<unsigned> generation;
+    /** fire() calls running, by generation parity */
+    std::atomic<int> firing[2];
+    /** Lists replaced while fire() may have been using them */
+    vector<ListenerList*> retired;
     CriticalSection listenerCS;
+    /** One generation is waited for at a time, so the older one has always ended */
+    CriticalSection waitCS;
 };
 
 } // namespace dcpp
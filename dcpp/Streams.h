@@ -73,6 +73,15 @@ public:
      *         actually read from the stream source in this call.
      */
     virtual size_t read(void* buf, size_t& len) = 0;
+    /**
+     * Zero-copy support: the file that the next bytes of the stream come straight from, so that
+     * they can be sent from its current position without being read.
+     * @param len Lowered to the number of bytes that may be taken from the file.
+     * @return NULL if the data doesn't come unaltered from a file.
+     */
+    virtual File* getSource(size_t& /*len*/) { return 0; }
+    /** Account for len bytes taken directly from the file returned by getSource. */
+    virtual void skipped(size_t /*len*/) { }
 private:
     InputStream(const InputStream&);
     InputStream& operator=(const InputStream&);
@@ -124,6 +133,16 @@ public:
         return x;
     }
 
+    File* getSource(size_t& len) {
+        len = (size_t)min(maxBytes, (uint64_t)len);
+        return len == 0 ? 0 : s->getSource(len);
+    }
+
+    void skipped(size_t len) {
+        maxBytes -= len;
+        s->skipped(len);
+    }
+
 private:
     InputStream* s;
     uint64_t maxBytes;
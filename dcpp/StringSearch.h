@@ -27,8 +27,7 @@ namespace dcpp {
  * A class that implements a fast substring search algo suited for matching
  * one pattern against many strings (currently Quick Search, a variant of
  * Boyer-Moore. Code based on "A very fast substring search algorithm" by
- * D. Sunday).
- * @todo Perhaps find an algo suitable for matching multiple substrings.
+ * D. Sunday). See MultiStringSearch for matching several patterns at once.
  */
 class StringSearch {
 public:
@@ -62,17 +61,30 @@ public:
         string lower;
         Text::toLower(aText, lower);
 
+        return matchLower(lower.c_str(), lower.length());
+    }
+
+    /** Match an already lower-cased text against the pattern */
+    bool matchLower(const string& aText) const noexcept {
+        return matchLower(aText.c_str(), aText.length());
+    }
+
+    /**
+     * Match an already lower-cased text against the pattern without any allocation.
+     * The text must be followed by at least one readable byte, such as the terminating null.
+     */
+    bool matchLower(const char* aText, size_t aLength) const noexcept {
         // uint8_t to avoid problems with signed char pointer arithmetic
-        uint8_t *tx = (uint8_t*)lower.c_str();
+        uint8_t *tx = (uint8_t*)aText;
         uint8_t *px = (uint8_t*)pattern.c_str();
 
         string::size_type plen = pattern.length();
 
-        if(aText.length() < plen) {
+        if(aLength < plen) {
             return false;
         }
 
-        uint8_t *end = tx + aText.length() - plen + 1;
+        uint8_t *end = tx + aLength - plen + 1;
         while(tx < end) {
             size_t i = 0;
             for(; px[i] && (px[i] == tx[i]); ++i)
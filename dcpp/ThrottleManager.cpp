@@ -29,84 +29,169 @@
 #include "ClientManager.h"
 
 namespace dcpp {
-/**
- * Manager for throttling traffic flow.
- * Inspired by Token Bucket algorithm: http://en.wikipedia.org/wiki/Token_bucket
- */
+
+namespace {
+
+/** Capacity of the buckets, as the time (ms) they take to fill up */
+const int64_t BURST = 250;
+
+/** Smallest share of a bucket handed out at once, so that many transfers don't mean tiny writes */
+const int64_t MIN_SLICE = 1024;
+
+/** Longest sleep before rechecking whether throttling is still on */
+const uint32_t MAX_WAIT = 1000;
+
+/** Monotonic time (us); milliseconds of GET_TICK() would be a lot of tokens at high rates */
+int64_t getMicroTick() {
+#ifdef _WIN32
+    static LARGE_INTEGER freq = { { 0, 0 } };
+    if(freq.QuadPart == 0)
+        QueryPerformanceFrequency(&freq);
+    LARGE_INTEGER now;
+    QueryPerformanceCounter(&now);
+    // Split up, so that the multiplication doesn't overflow
+    return now.QuadPart / freq.QuadPart * 1000000 + now.QuadPart % freq.QuadPart * 1000000 / freq.QuadPart;
+#else
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<int64_t>(ts.tv_sec) * 1000000 + ts.tv_nsec / 1000;
+#endif
+}
+
+/** Time (us) tokens take to come in at aRate bytes/s, rounded up */
+int64_t getDuration(int64_t aTokens, int64_t aRate) {
+    return (aTokens * 1000000 + aRate - 1) / aRate;
+}
+
+}
+
+int64_t ThrottleManager::Bucket::take(int64_t aWanted, int64_t aRate) noexcept {
+    int64_t now = getMicroTick();
+    int64_t e = empty.load();
+    for(;;) {
+        // A bucket that's been left alone for a while is full, but no more than that
+        int64_t start = max(e, now - BURST * 1000);
+        int64_t available = (now - start) * aRate / 1000000;
+        if(available <= 0)
+            return 0;
+
+        int64_t tokens = min(aWanted, available);
+        if(empty.compare_exchange_weak(e, start + getDuration(tokens, aRate)))
+            return tokens;
+    }
+}
+
+void ThrottleManager::Bucket::giveBack(int64_t aTokens, int64_t aRate) noexcept {
+    if(aTokens > 0)
+        empty -= aTokens * 1000000 / aRate;
+}
+
+uint32_t ThrottleManager::Bucket::getWait(int64_t aTokens, int64_t aRate) const noexcept {
+    int64_t wait = empty.load() + getDuration(aTokens, aRate) - getMicroTick();
+    return wait > 0 ? static_cast<uint32_t>(min<int64_t>((wait + 999) / 1000, MAX_WAIT)) : 0;
+}
+
+int64_t ThrottleManager::getSlice(int64_t aRate, size_t aTransfers) {
+    int64_t capacity = aRate * BURST / 1000;
+    return min(capacity, max(capacity / static_cast<int64_t>(max(aTransfers, (size_t)1)), MIN_SLICE));
+}
 
 /*
  * Throttles traffic and reads a packet from the network
  */
-int ThrottleManager::read(Socket* sock, void* buffer, size_t len)
+int ThrottleManager::read(Socket* sock, void* buffer, size_t len, bool* throttled)
 {
-    int64_t readSize = -1;
     size_t downs = DownloadManager::getInstance()->getDownloadCount();
-    auto downLimit = getDownLimit(); // avoid even intra-function races
-    if(!BOOLSETTING(THROTTLE_ENABLE) || !getCurThrottling() || downLimit == 0 || downs == 0)
+    int64_t rate = static_cast<int64_t>(getDownLimit()) * 1024; // avoid even intra-function races
+    if(!BOOLSETTING(THROTTLE_ENABLE) || !getCurThrottling() || rate == 0 || downs == 0)
         return sock->read(buffer, len);
 
+    downRate = rate;
+    int64_t slice = getSlice(rate, downs);
+    int64_t tokens = down.take(min(slice, static_cast<int64_t>(len)), rate);
+    if(tokens > 0)
     {
-        Lock l(downCS);
-
-        if(downTokens > 0)
-        {
-            int64_t slice = (downLimit * 1024) / downs;
-            readSize = min(slice, min(static_cast<int64_t>(len), downTokens));
-
-            // read from socket
-            readSize = sock->read(buffer, static_cast<size_t>(readSize));
-
-            if(readSize > 0)
-                downTokens -= readSize;
-        }
+        int readSize = sock->read(buffer, static_cast<size_t>(tokens));
+        // Whatever wasn't there to be read is left for the others
+        down.giveBack(tokens - max(readSize, 0), rate);
+        return readSize;
     }
 
-    if(readSize != -1)
+    if(throttled)
+        *throttled = true;
+    else
+        waitToken(down, slice, rate);
+    return -1;  // from BufferedSocket: -1 = retry, 0 = connection close
+}
+
+int64_t ThrottleManager::takeUp(size_t& len, int64_t& rate, bool* throttled)
+{
+    size_t ups = UploadManager::getInstance()->getUploadCount();
+    rate = static_cast<int64_t>(getUpLimit()) * 1024; // avoid even intra-function races
+    if(!BOOLSETTING(THROTTLE_ENABLE) || !getCurThrottling() || rate == 0 || ups == 0)
+        return -1;
+
+    upRate = rate;
+    int64_t slice = getSlice(rate, ups);
+    int64_t tokens = up.take(min(slice, static_cast<int64_t>(len)), rate);
+    if(tokens > 0)
     {
-        Thread::yield(); // give a chance to other transfers to get a token
-        return readSize;
+        len = static_cast<size_t>(tokens);
+        return tokens;
     }
 
-    waitToken();
-    return -1;  // from BufferedSocket: -1 = retry, 0 = connection close
+    if(throttled)
+        *throttled = true;
+    else
+        waitToken(up, slice, rate);
+    return 0;
 }
 
 /*
  * Throttles traffic and writes a packet to the network
  * Handle this a little bit differently than downloads due to OpenSSL stupidity
  */
-int ThrottleManager::write(Socket* sock, void* buffer, size_t& len)
+int ThrottleManager::write(Socket* sock, void* buffer, size_t& len, bool* throttled)
 {
-    bool gotToken = false;
-    size_t ups = UploadManager::getInstance()->getUploadCount();
-    auto upLimit = getUpLimit(); // avoid even intra-function races
-    if(!BOOLSETTING(THROTTLE_ENABLE) || !getCurThrottling() || upLimit == 0 || ups == 0)
+    int64_t rate;
+    int64_t tokens = takeUp(len, rate, throttled);
+    if(tokens == -1)
         return sock->write(buffer, len);
+    if(tokens == 0)
+        return 0;   // from BufferedSocket: -1 = failed, 0 = retry
 
-    {
-        Lock l(upCS);
-
-        if(upTokens > 0)
-        {
-            size_t slice = (upLimit * 1024) / ups;
-            len = min(slice, min(len, static_cast<size_t>(upTokens)));
-            upTokens -= len;
-
-            gotToken = true; // token successfuly assigned
-        }
-    }
-
-    if(gotToken)
-    {
-        // write to socket
-        int sent = sock->write(buffer, len);
+    int sent = sock->write(buffer, len);
+    up.giveBack(tokens - max(sent, 0), rate);
+    return sent;
+}
 
-        Thread::yield(); // give a chance to other transfers get a token
-        return sent;
-    }
+/*
+ * Throttles traffic and sends a part of a file straight to the network
+ */
+int ThrottleManager::sendFile(Socket* sock, File& f, size_t& len, bool* throttled)
+{
+    int64_t rate;
+    int64_t tokens = takeUp(len, rate, throttled);
+    if(tokens == -1)
+        return sock->sendFile(f, len);
+    if(tokens == 0)
+        return -1;  // from BufferedSocket: -1 = retry, 0 = end of file
+
+    int sent = sock->sendFile(f, len);
+    up.giveBack(tokens - max(sent, 0), rate);
+    return sent;
+}
 
-    waitToken();
-    return 0;   // from BufferedSocket: -1 = failed, 0 = retry
+uint32_t ThrottleManager::getRetryDelay() const {
+    // Whichever direction is throttled, it's ready once it's got a token again
+    uint32_t wait = MAX_WAIT;
+    int64_t rate = downRate;
+    if(rate > 0)
+        wait = min(wait, down.getWait(MIN_SLICE, rate));
+    rate = upRate;
+    if(rate > 0)
+        wait = min(wait, up.getWait(MIN_SLICE, rate));
+    return max(wait, (uint32_t)1);
 }
 
 SettingsManager::IntSetting ThrottleManager::getCurSetting(SettingsManager::IntSetting setting) {
@@ -154,25 +239,11 @@ void ThrottleManager::setSetting(SettingsManager::IntSetting setting, int value)
         ClientManager::getInstance()->infoUpdated();
 }
 
-bool ThrottleManager::getCurThrottling() {
-    Lock l(stateCS);
-    return activeWaiter != -1;
-}
-
-void ThrottleManager::waitToken() {
-    // no tokens, wait for them, so long as throttling still active
-    // avoid keeping stateCS lock on whole function
-    CriticalSection *curCS = 0;
-    {
-        Lock l(stateCS);
-        if (activeWaiter != -1)
-            curCS = &waitCS[activeWaiter];
-    }
-    // possible post-CS aW shifts: 0->1/1->0: lock lands in wrong place, will
-    // either fall through immediately or wait depending on whether in
-    // stateCS-protected transition elsewhere; 0/1-> -1: falls through. Both harmless.
-    if (curCS)
-        Lock l(*curCS);
+void ThrottleManager::waitToken(const Bucket& aBucket, int64_t aSlice, int64_t aRate) {
+    // Sleep until this transfer's share is there, rather than until any token is
+    uint32_t wait = aBucket.getWait(aSlice, aRate);
+    if(wait > 0)
+        Thread::sleep(wait);
 }
 
 ThrottleManager::~ThrottleManager(void)
@@ -181,38 +252,10 @@ ThrottleManager::~ThrottleManager(void)
     TimerManager::getInstance()->removeListener(this);
 }
 
-#ifdef _WIN32
-
 void ThrottleManager::shutdown() {
-    Lock l(stateCS);
-    if (activeWaiter != -1) {
-        waitCS[activeWaiter].unlock();
-        activeWaiter = -1;
-    }
-}
-#else //*nix
-
-void ThrottleManager::shutdown()
-{
-    bool wait = false;
-    {
-        Lock l(stateCS);
-        if (activeWaiter != -1)
-        {
-            n_lock = activeWaiter;
-            activeWaiter = -1;
-            halt = 1;
-            wait = true;
-        }
-    }
-
-    // wait shutdown...
-    if (wait)
-    {
-        Lock l(shutdownCS);
-    }
+    // Waiters wake up within MAX_WAIT and then no longer throttle
+    halted = true;
 }
-#endif //*nix
 
 // TimerManagerListener
 void ThrottleManager::on(TimerManagerListener::Second, uint64_t /* aTick */) noexcept
@@ -221,67 +264,6 @@ void ThrottleManager::on(TimerManagerListener::Second, uint64_t /* aTick */) noe
     if(newSlots != SETTING(SLOTS)) {
         setSetting(SettingsManager::SLOTS, newSlots);
     }
-
-    {
-        Lock l(stateCS);
-
-#ifndef _WIN32 //*nix
-
-        if (halt == 1)
-        {
-            halt = -1;
-
-            // unlock shutdown and token wait
-            dcassert(n_lock == 0 || n_lock == 1);
-            waitCS[n_lock].unlock();
-            shutdownCS.unlock();
-
-            return;
-        }
-        else if (halt == -1)
-        {
-            return;
-        }
-#endif
-        if (activeWaiter == -1)
-        {
-            // This will create slight weirdness for the read/write calls between
-            // here and the first activeWaiter-toggle below.
-            waitCS[activeWaiter = 0].lock();
-
-#ifndef _WIN32 //*nix
-
-            // lock shutdown
-            shutdownCS.lock();
-#endif
-        }
-    }
-
-    int downLimit = getDownLimit();
-    int upLimit   = getUpLimit();
-
-    // readd tokens
-    {
-        Lock l(downCS);
-        downTokens = downLimit * 1024;
-    }
-
-    {
-        Lock l(upCS);
-        upTokens = upLimit * 1024;
-    }
-
-    // let existing events drain out (fairness).
-    // www.cse.wustl.edu/~schmidt/win32-cv-1.html documents various
-    // fairer strategies, but when only broadcasting, irrelevant
-    {
-        Lock l(stateCS);
-
-        dcassert(activeWaiter == 0 || activeWaiter == 1);
-        waitCS[1-activeWaiter].lock();
-        activeWaiter = 1-activeWaiter;
-        waitCS[1-activeWaiter].unlock();
-    }
 }
 
 }   // namespace dcpp
@@ -18,6 +18,8 @@
 
 #pragma once
 
+#include <atomic>
+
 #include "Singleton.h"
 #include "Socket.h"
 #include "TimerManager.h"
@@ -27,7 +29,11 @@ namespace dcpp
 {
 /**
  * Manager for throttling traffic flow.
- * Inspired by Token Bucket algorithm: http://en.wikipedia.org/wiki/Token_bucket
+ * Each direction has a token bucket (http://en.wikipedia.org/wiki/Token_bucket) that fills up
+ * continuously at the configured rate, kept as the time at which it was empty so that taking
+ * tokens is a single compare-and-swap. Each call gets at most an equal share of the bucket's
+ * capacity among the running transfers, and callers that find it empty sleep until their share
+ * is there.
  */
 class ThrottleManager :
     public Singleton<ThrottleManager>, private TimerManagerListener
@@ -36,14 +42,25 @@ public:
 
     /*
      * Throttles traffic and reads a packet from the network
+     * If throttled is given, it's set instead of waiting for a token when there's none left
      */
-    int read(Socket* sock, void* buffer, size_t len);
+    int read(Socket* sock, void* buffer, size_t len, bool* throttled = NULL);
 
     /*
      * Throttles traffic and writes a packet to the network
      * Handle this a little bit differently than downloads due to OpenSSL stupidity
+     * If throttled is given, it's set instead of waiting for a token when there's none left
      */
-    int write(Socket* sock, void* buffer, size_t& len);
+    int write(Socket* sock, void* buffer, size_t& len, bool* throttled = NULL);
+
+    /*
+     * Throttles traffic and sends a part of a file straight to the network
+     * Returns -1 when there's no token, as 0 means the end of the file
+     */
+    int sendFile(Socket* sock, File& f, size_t& len, bool* throttled = NULL);
+
+    /** Time (ms) until a throttled transfer should try again */
+    uint32_t getRetryDelay() const;
 
     static SettingsManager::IntSetting getCurSetting(SettingsManager::IntSetting setting);
 
@@ -54,39 +71,51 @@ public:
 
     void shutdown();
 private:
-    // stack up throttled read & write threads
-    CriticalSection stateCS;
-    CriticalSection waitCS[2];
-    long activeWaiter;
-
-#ifndef _WIN32 //*nix
-
-    // shutdown wait
-    CriticalSection shutdownCS;
-    long n_lock, halt;
-#endif
-    // download limiter
-    CriticalSection downCS;
-    int64_t         downTokens;
-
-    // upload limiter
-    CriticalSection upCS;
-    int64_t         upTokens;
+    class Bucket {
+    public:
+        Bucket() : empty(0) { }
+
+        /**
+         * Take up to aWanted tokens (bytes) from a bucket filling at aRate bytes/s.
+         * @return The tokens taken, 0 if the bucket is empty
+         */
+        int64_t take(int64_t aWanted, int64_t aRate) noexcept;
+        /** Put back tokens taken but not used */
+        void giveBack(int64_t aTokens, int64_t aRate) noexcept;
+        /** @return Time (ms) until aTokens tokens are there */
+        uint32_t getWait(int64_t aTokens, int64_t aRate) const noexcept;
+
+    private:
+        /** Time (us) at which the bucket was empty; it's full BURST ms later */
+        std::atomic<int64_t> empty;
+    };
+
+    Bucket down;
+    Bucket up;
+    /** Rates (bytes/s) the buckets were last used with */
+    std::atomic<int64_t> downRate;
+    std::atomic<int64_t> upRate;
+
+    std::atomic<bool> halted;
 
     friend class Singleton<ThrottleManager>;
 
-    ThrottleManager(void) : activeWaiter(-1), downTokens(0), upTokens(0)
+    ThrottleManager(void) : downRate(0), upRate(0), halted(false)
     {
-#ifndef _WIN32 //*nix
-        n_lock = halt = 0;
-#endif
         TimerManager::getInstance()->addListener(this);
     }
 
     ~ThrottleManager(void);
 
-    bool getCurThrottling();
-    void waitToken();
+    bool getCurThrottling() const { return !halted; }
+    /** Share of a bucket's capacity that a transfer may take at once */
+    static int64_t getSlice(int64_t aRate, size_t aTransfers);
+    void waitToken(const Bucket& aBucket, int64_t aSlice, int64_t aRate);
+    /**
+     * Take tokens for an upload, reducing len to the tokens taken.
+     * @return The tokens taken, -1 if uploads aren't throttled
+     */
+    int64_t takeUp(size_t& len, int64_t& rate, bool* throttled);
 
     // TimerManagerListener
     void on(TimerManagerListener::Second, uint64_t /* aTick */) noexcept;
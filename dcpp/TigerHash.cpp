@@ -265,6 +265,102 @@ uint8_t* TigerHash::finalize() {
 	return getResult();
 }
 
+// Multi-lane variant of the compress function: the same rounds on LANES states at once, lane by
+// lane within each round so that the lookups of the lanes don't depend on each other.
+
+#define round_lanes(a,b,c,j,mul) \
+	round(a##0,b##0,c##0,X[j][0],mul) \
+	round(a##1,b##1,c##1,X[j][1],mul) \
+	round(a##2,b##2,c##2,X[j][2],mul) \
+	round(a##3,b##3,c##3,X[j][3],mul)
+
+#define pass_lanes(a,b,c,mul) \
+	round_lanes(a,b,c,0,mul) \
+	round_lanes(b,c,a,1,mul) \
+	round_lanes(c,a,b,2,mul) \
+	round_lanes(a,b,c,3,mul) \
+	round_lanes(b,c,a,4,mul) \
+	round_lanes(c,a,b,5,mul) \
+	round_lanes(a,b,c,6,mul) \
+	round_lanes(b,c,a,7,mul)
+
+#define key_schedule_lanes \
+	for(size_t l = 0; l < LANES; ++l) { \
+	 uint64_t &x0 = X[0][l], &x1 = X[1][l], &x2 = X[2][l], &x3 = X[3][l], \
+	  &x4 = X[4][l], &x5 = X[5][l], &x6 = X[6][l], &x7 = X[7][l]; \
+	 key_schedule }
+
+#define feedforward_lane(l) \
+	a##l ^= aa##l; \
+	b##l -= bb##l; \
+	c##l += cc##l;
+
+// Same sequence as the 64-bit compress: rotating the roles of a, b and c between passes is what
+// the 32-bit variant does by swapping.
+#define compress_lanes \
+	aa0 = a0; bb0 = b0; cc0 = c0; \
+	aa1 = a1; bb1 = b1; cc1 = c1; \
+	aa2 = a2; bb2 = b2; cc2 = c2; \
+	aa3 = a3; bb3 = b3; cc3 = c3; \
+	pass_lanes(a,b,c,5) \
+	key_schedule_lanes \
+	pass_lanes(c,a,b,7) \
+	key_schedule_lanes \
+	pass_lanes(b,c,a,9) \
+	feedforward_lane(0) \
+	feedforward_lane(1) \
+	feedforward_lane(2) \
+	feedforward_lane(3)
+
+void TigerHash::hashLanes(const uint8_t* const data[LANES], size_t len, uint8_t* const out[LANES]) {
+	static_assert(LANES == 4, "compress_lanes is written out for 4 lanes");
+
+#ifdef TIGER_BIG_ENDIAN
+	for(size_t l = 0; l < LANES; ++l) {
+		TigerHash h;
+		h.update(data[l], len);
+		memcpy(out[l], h.finalize(), BYTES);
+	}
+#else
+	uint64_t a0, a1, a2, a3, b0, b1, b2, b3, c0, c1, c2, c3;
+	uint64_t aa0, aa1, aa2, aa3, bb0, bb1, bb2, bb3, cc0, cc1, cc2, cc3;
+	a0 = a1 = a2 = a3 = _ULL(0x0123456789ABCDEF);
+	b0 = b1 = b2 = b3 = _ULL(0xFEDCBA9876543210);
+	c0 = c1 = c2 = c3 = _ULL(0xF096A5B4C3B2E187);
+
+	// Padding as in finalize: 0x01, zeroes, then the length in bits in the last 8 bytes
+	const size_t full = len / BLOCK_SIZE;
+	const size_t rest = len % BLOCK_SIZE;
+	const size_t tailBlocks = (rest + 1 > BLOCK_SIZE - sizeof(uint64_t)) ? 2 : 1;
+	const uint64_t bits = (uint64_t)len << 3;
+
+	uint8_t tail[LANES][2 * BLOCK_SIZE];
+	for(size_t l = 0; l < LANES; ++l) {
+		memcpy(tail[l], data[l] + full * BLOCK_SIZE, rest);
+		tail[l][rest] = 0x01;
+		memset(tail[l] + rest + 1, 0, tailBlocks * BLOCK_SIZE - rest - 1);
+		memcpy(tail[l] + tailBlocks * BLOCK_SIZE - sizeof(uint64_t), &bits, sizeof(uint64_t));
+	}
+
+	uint64_t X[8][LANES];
+	for(size_t k = 0; k < full + tailBlocks; ++k) {
+		for(size_t l = 0; l < LANES; ++l) {
+			const uint8_t* str = (k < full) ? data[l] + k * BLOCK_SIZE : tail[l] + (k - full) * BLOCK_SIZE;
+			for(size_t j = 0; j < 8; ++j) {
+				memcpy(&X[j][l], str + j * sizeof(uint64_t), sizeof(uint64_t));
+			}
+		}
+
+		compress_lanes
+	}
+
+	const uint64_t res[LANES][3] = { { a0, b0, c0 }, { a1, b1, c1 }, { a2, b2, c2 }, { a3, b3, c3 } };
+	for(size_t l = 0; l < LANES; ++l) {
+		memcpy(out[l], res[l], BYTES);
+	}
+#endif
+}
+
 uint64_t TigerHash::table[4*256] = {
 	_ULL(0x02AAB17CF7E90C5E)   /*    0 */,    _ULL(0xAC424B03E243A8EC)   /*    1 */,
 		_ULL(0x72CD5BE30DD5FCD3)   /*    2 */,    _ULL(0x6D019B93F6F97F3A)   /*    3 */,
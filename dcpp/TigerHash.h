@@ -55,6 +55,17 @@ public:
 	uint8_t* finalize();
 
 	uint8_t* getResult() { return (uint8_t*) res; }
+
+	/** Number of messages hashLanes works on at once */
+	enum { LANES = 4 };
+
+	/**
+	 * Hash LANES messages of the same length at once. The compressions of the messages are
+	 * interleaved, so that their table lookups overlap instead of waiting on each other; the
+	 * results are the same as when hashing each message on its own.
+	 * @param out LANES buffers of BYTES bytes each
+	 */
+	static void hashLanes(const uint8_t* const data[LANES], size_t len, uint8_t* const out[LANES]);
 private:
 	enum { BLOCK_SIZE = 512/8 };
 	/** 512 bit blocks for the compress function */
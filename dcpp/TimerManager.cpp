@@ -20,8 +20,11 @@
 
 #include "TimerManager.h"
 
+#include "Pointer.h"
+
 #ifndef TIMER_OLD_BOOST
 #include <boost/date_time/posix_time/ptime.hpp>
+#include <boost/date_time/posix_time/posix_time_types.hpp>
 #endif
 namespace dcpp {
 
@@ -31,65 +34,226 @@ timeval TimerManager::tv;
 using namespace boost::posix_time;
 #endif
 
-TimerManager::TimerManager() {
+namespace {
+
+/** Set on the timer thread, so that cancel doesn't wait for the callback it's called from */
+__thread bool timerThread = false;
+
+}
+
+TimerManager::TimerManager() : stopping(false), queued(0), wheelTime(0), wakeTime(0), nextId(0), current(0) {
 #ifdef TIMER_OLD_BOOST
     gettimeofday(&tv, NULL);
-#else
-    // This mutex will be unlocked only upon shutdown
-    boostmtx.lock();
 #endif
+    wheelTime = getTick();
 }
 
 TimerManager::~TimerManager() {
-    dcassert(listeners.empty());
+    dcassert(!hasListeners());
+
+    for(auto i = timers.begin(); i != timers.end(); ++i) {
+        i->second->id = 0;
+    }
+    for(size_t i = 0; i < (1 << ROOT_BITS); ++i) {
+        for_each(root[i].begin(), root[i].end(), DeleteFunction());
+    }
+    for(int l = 0; l < LEVELS; ++l) {
+        for(size_t i = 0; i < (1 << LEVEL_BITS); ++i) {
+            for_each(levels[l][i].begin(), levels[l][i].end(), DeleteFunction());
+        }
+    }
 }
 
 void TimerManager::shutdown() {
-#ifdef TIMER_OLD_BOOST
+    {
+        Lock l(cs);
+        stopping = true;
+    }
     s.signal();
-#else
-    boostmtx.unlock();
-#endif
     join();
 }
 
+TimerManager::TimerId TimerManager::schedule(uint64_t aDelay, const Callback& f, uint64_t aPeriod) {
+    Timer* t = new Timer;
+    t->due = getTick() + aDelay;
+    t->period = aPeriod;
+    t->f = f;
+
+    bool wake;
+    {
+        Lock l(cs);
+        t->id = ++nextId;
+        timers[t->id] = t;
+        add(t);
+        wake = t->due < wakeTime;
+    }
+    if(wake)
+        s.signal();
+    return t->id;
+}
+
+bool TimerManager::cancel(TimerId aId) {
+    Lock l(cs);
+    while(current && current->id == aId && !timerThread) {
+        l.unlock();
+        Thread::yield();
+        l.lock();
+    }
+
+    if(current && current->id == aId) {
+        current->id = 0;
+        return true;
+    }
+
+    auto i = timers.find(aId);
+    if(i == timers.end())
+        return false;
+    i->second->id = 0;
+    timers.erase(i);
+    return true;
+}
+
+void TimerManager::add(Timer* t) {
+    uint64_t due = max(t->due, wheelTime);
+    uint64_t delta = due - wheelTime;
+    queued++;
+
+    if(delta < (1 << ROOT_BITS)) {
+        root[due & ((1 << ROOT_BITS) - 1)].push_back(t);
+        return;
+    }
+
+    for(int l = 0; l < LEVELS; ++l) {
+        int shift = ROOT_BITS + (l + 1) * LEVEL_BITS;
+        if(l == LEVELS - 1 && delta >= (1ULL << shift)) {
+            // Further than the wheels reach; it'll be put back once the last wheel comes around
+            due = wheelTime + (1ULL << shift) - 1;
+        }
+        if(delta < (1ULL << shift) || l == LEVELS - 1) {
+            levels[l][(due >> (shift - LEVEL_BITS)) & ((1 << LEVEL_BITS) - 1)].push_back(t);
+            return;
+        }
+    }
+}
+
+size_t TimerManager::cascade(int aLevel) {
+    size_t index = (wheelTime >> (ROOT_BITS + aLevel * LEVEL_BITS)) & ((1 << LEVEL_BITS) - 1);
+    Slot slot;
+    slot.swap(levels[aLevel][index]);
+    for(auto i = slot.begin(); i != slot.end(); ++i) {
+        queued--;
+        if((*i)->id == 0) {
+            delete *i;
+        } else {
+            add(*i);
+        }
+    }
+    return index;
+}
+
+uint64_t TimerManager::getNextDue() const {
+    if(queued == 0)
+        return numeric_limits<uint64_t>::max();
+
+    // The coarser wheels cascade when the root wheel comes around; the root wheel is scanned up to there
+    if((wheelTime & ((1 << ROOT_BITS) - 1)) == 0)
+        return wheelTime;
+    uint64_t end = (wheelTime | ((1 << ROOT_BITS) - 1)) + 1;
+    for(uint64_t t = wheelTime; t < end; ++t) {
+        if(!root[t & ((1 << ROOT_BITS) - 1)].empty())
+            return t;
+    }
+    return end;
+}
+
+void TimerManager::runTimers(uint64_t aTick) {
+    Slot expired;
+    size_t pos = 0;
+    for(;;) {
+        Timer* t;
+        {
+            Lock l(cs);
+            if(current) {
+                t = current;
+                current = 0;
+                if(t->id != 0 && t->period != 0) {
+                    t->due = max(t->due + t->period, aTick);
+                    timers[t->id] = t;
+                    add(t);
+                } else {
+                    delete t;
+                }
+            }
+
+            while(pos == expired.size() && wheelTime <= aTick) {
+                if(queued == 0) {
+                    wheelTime = aTick + 1;
+                    break;
+                }
+
+                size_t index = wheelTime & ((1 << ROOT_BITS) - 1);
+                for(int level = 0; index == 0 && level < LEVELS; ++level) {
+                    index = cascade(level);
+                }
+
+                expired.clear();
+                pos = 0;
+                expired.swap(root[wheelTime & ((1 << ROOT_BITS) - 1)]);
+                queued -= expired.size();
+                wheelTime++;
+            }
+
+            if(pos == expired.size())
+                return;
+
+            t = expired[pos++];
+            if(t->id == 0) {
+                delete t;
+                continue;
+            }
+            timers.erase(t->id);
+            current = t;
+        }
+
+        t->f(aTick);
+    }
+}
+
 int TimerManager::run() {
     setThreadName("TimerManager");
+    timerThread = true;
+
     int nextMin = 0;
-#ifdef TIMER_OLD_BOOST
-    uint64_t x = getTick();
-    uint64_t nextTick = x + 1000;
-
-    while(!s.wait(nextTick > x ? nextTick - x : 0)) {
-        uint64_t z = getTick();
-        nextTick = z + 1000;
-        fire(TimerManagerListener::Second(), z);
-        if(nextMin++ >= 60) {
-            fire(TimerManagerListener::Minute(), z);
-             nextMin = 0;
-         }
-        x = getTick();
-    }
-#else
-    ptime now = microsec_clock::universal_time();
-    ptime nextSecond = now + seconds(1);
-
-    while(!boostmtx.timed_lock(nextSecond)) {
-        uint64_t t = getTick();
-        now = microsec_clock::universal_time();
-        nextSecond += seconds(1);
-        if(nextSecond < now) {
-                nextSecond = now;
+    uint64_t nextSecond = getTick() + 1000;
+    for(;;) {
+        uint64_t now = getTick();
+        uint64_t wake;
+        {
+            Lock l(cs);
+            if(stopping)
+                break;
+            wake = wakeTime = min(nextSecond, getNextDue());
         }
+        if(wake > now) {
+            s.wait(wake - now);
+            now = getTick();
+        }
+
+        runTimers(now);
 
-        fire(TimerManagerListener::Second(), t);
-        if(nextMin++ >= 60) {
-            fire(TimerManagerListener::Minute(), t);
-            nextMin = 0;
+        if(now >= nextSecond) {
+            nextSecond += 1000;
+            if(nextSecond < now) {
+                nextSecond = now;
+            }
+
+            fire(TimerManagerListener::Second(), now);
+            if(nextMin++ >= 60) {
+                fire(TimerManagerListener::Minute(), now);
+                nextMin = 0;
+            }
         }
     }
-    boostmtx.unlock();
-#endif
 
     dcdebug("TimerManager done\n");
     return 0;
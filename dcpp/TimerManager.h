@@ -18,15 +18,13 @@
 
 #pragma once
 
+#include <functional>
+
 #include "Thread.h"
 #include "Speaker.h"
 #include "Singleton.h"
-
-#ifdef TIMER_OLD_BOOST
-    #include "Semaphore.h"
-#else
-    #include <boost/thread/mutex.hpp>
-#endif
+#include "Semaphore.h"
+#include "CriticalSection.h"
 
 #ifndef _WIN32
     #include <ctime>
@@ -49,21 +47,82 @@ public:
     virtual void on(Minute, uint64_t) noexcept { }
 };
 
+/**
+ * Besides the Second and Minute events, runs callbacks scheduled to the millisecond. These are kept
+ * in a hierarchical timer wheel: a root wheel of 256 1 ms slots, and 4 wheels of 64 slots each 64
+ * times coarser, whose timers are moved to the finer wheels as their time comes closer.
+ * Callbacks run on the timer thread, so they must not block.
+ */
 class TimerManager : public Speaker<TimerManagerListener>, public Singleton<TimerManager>, public Thread
 {
 public:
+    typedef uint64_t TimerId;
+    /** Gets the tick the callback runs at */
+    typedef std::function<void (uint64_t)> Callback;
+
     void shutdown();
 
+    /**
+     * Run f in aDelay ms, and then every aPeriod ms unless aPeriod is 0.
+     * @return Id for cancel, never 0
+     */
+    TimerId schedule(uint64_t aDelay, const Callback& f, uint64_t aPeriod = 0);
+    /**
+     * Cancel a timer. Once this returns, its callback isn't running and won't run anymore (unless
+     * called from the callback itself, which may then return normally).
+     * @return false if there's no such timer, e.g. because it ran already
+     */
+    bool cancel(TimerId aId);
+
     static time_t getTime() { return (time_t)time(NULL); }
     static uint64_t getTick();
 private:
     friend class Singleton<TimerManager>;
+
+    struct Timer {
+        /** 0 once cancelled; the timer is then deleted when its slot is reached */
+        TimerId id;
+        uint64_t due;
+        uint64_t period;
+        Callback f;
+    };
+
+    enum {
+        ROOT_BITS = 8,
+        LEVEL_BITS = 6,
+        LEVELS = 4
+    };
+
+    typedef vector<Timer*> Slot;
+
+    void add(Timer* t);
+    /** Move the timers of a slot of a coarser wheel down; @return The slot's index */
+    size_t cascade(int aLevel);
+    /** @return The tick to wake up at for the timers */
+    uint64_t getNextDue() const;
+    void runTimers(uint64_t aTick);
+
 #ifdef TIMER_OLD_BOOST
-    Semaphore s;
     static timeval tv;
-#else
-    boost::timed_mutex boostmtx;
 #endif
+    Semaphore s;
+    bool stopping;
+
+    CriticalSection cs;
+    Slot root[1 << ROOT_BITS];
+    Slot levels[LEVELS][1 << LEVEL_BITS];
+    /** Timers in the wheels that aren't cancelled */
+    unordered_map<TimerId, Timer*> timers;
+    /** Timers in the wheels, cancelled ones included */
+    size_t queued;
+    /** Timers due up to this tick (excluded) have been taken from the wheels */
+    uint64_t wheelTime;
+    /** Tick the timer thread will wake up at */
+    uint64_t wakeTime;
+    TimerId nextId;
+    /** Timer whose callback is running */
+    Timer* current;
+
     TimerManager();
     virtual ~TimerManager();
 
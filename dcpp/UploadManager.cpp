@@ -645,7 +645,7 @@ void UploadManager::on(AdcCommand::GFI, UserConnection* aSource, const AdcComman
         return;
     }
 
-    if(c.getParameters().size() < 2) {
+    if(c.getParamCount() < 2) {
         aSource->send(AdcCommand(AdcCommand::SEV_RECOVERABLE, AdcCommand::ERROR_PROTOCOL_GENERIC, "Missing parameters"));
         return;
     }
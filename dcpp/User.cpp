@@ -27,7 +27,13 @@
 
 namespace dcpp {
 
-FastCriticalSection Identity::cs;
+FastCriticalSection Identity::cs[Identity::LOCKS];
+
+namespace {
+
+inline short toKey(const char* name) { return *(const short*)name; }
+
+}
 
 OnlineUser::OnlineUser(const UserPtr& ptr, ClientBase& client_, uint32_t sid_) : identity(ptr, sid_), client(client_), isInList(false) {
 
@@ -49,9 +55,41 @@ bool Identity::isUdpActive() const {
     return (!user->isSet(User::NMDC)) ? supports(AdcHub::UDP4_FEATURE) : !user->isSet(User::PASSIVE);
 }
 
+Identity& Identity::operator=(const Identity& rhs) {
+    if(this == &rhs)
+        return *this;
+
+    // Copy under the source's lock only, so that two locks are never held at once
+    InfMap tmpInfo;
+    UserPtr tmpUser;
+    int64_t tmpBytesShared;
+    int tmpStatus, tmpSlots, tmpClientType;
+    uint8_t tmpFieldFlags;
+    {
+        FastLock l(rhs.getLock());
+        tmpInfo = rhs.info;
+        tmpUser = rhs.user;
+        tmpBytesShared = rhs.bytesShared;
+        tmpStatus = rhs.status;
+        tmpSlots = rhs.slots;
+        tmpClientType = rhs.clientType;
+        tmpFieldFlags = rhs.fieldFlags;
+    }
+
+    FastLock l(getLock());
+    info.swap(tmpInfo);
+    user = tmpUser;
+    bytesShared = tmpBytesShared;
+    status = tmpStatus;
+    slots = tmpSlots;
+    clientType = tmpClientType;
+    fieldFlags = tmpFieldFlags;
+    return *this;
+}
+
 void Identity::getParams(StringMap& sm, const string& prefix, bool compatibility, bool dht) const {
     {
-        FastLock l(cs);
+        FastLock l(getLock());
         for(InfMap::const_iterator i = info.begin(); i != info.end(); ++i) {
             sm[prefix + string((char*)(&i->first), 2)] = i->second;
         }
@@ -85,8 +123,8 @@ void Identity::getParams(StringMap& sm, const string& prefix, bool compatibility
 }
 
 bool Identity::isClientType(ClientType ct) const {
-    int type = Util::toInt(get("CT"));
-    return (type & ct) == ct;
+    FastLock l(getLock());
+    return (clientType & ct) == ct;
 }
 
 string Identity::getTag() const {
@@ -99,24 +137,77 @@ string Identity::getTag() const {
 }
 
 string Identity::get(const char* name) const {
-    FastLock l(cs);
-    InfMap::const_iterator i = info.find(*(short*)name);
-    return i == info.end() ? Util::emptyString : i->second;
+    short key = toKey(name);
+    FastLock l(getLock());
+    for(InfIterC i = info.begin(); i != info.end(); ++i) {
+        if(i->first == key)
+            return i->second;
+    }
+    return Util::emptyString;
 }
 
 bool Identity::isSet(const char* name) const {
-    FastLock l(cs);
-    InfMap::const_iterator i = info.find(*(short*)name);
-    return i != info.end();
+    short key = toKey(name);
+    FastLock l(getLock());
+    for(InfIterC i = info.begin(); i != info.end(); ++i) {
+        if(i->first == key)
+            return true;
+    }
+    return false;
 }
 
-
 void Identity::set(const char* name, const string& val) {
-    FastLock l(cs);
-    if(val.empty())
-        info.erase(*(short*)name);
-    else
-        info[*(short*)name] = val;
+    short key = toKey(name);
+    FastLock l(getLock());
+    updateField(key, val);
+
+    InfIter i = info.begin();
+    for(; i != info.end() && i->first != key; ++i)
+        ;
+
+    if(val.empty()) {
+        if(i != info.end()) {
+            if(i + 1 != info.end())
+                *i = move(info.back());
+            info.pop_back();
+        }
+    } else if(i != info.end()) {
+        i->second = val;
+    } else {
+        info.push_back(make_pair(key, val));
+    }
+}
+
+void Identity::updateField(short key, const string& val) {
+    uint8_t flag = 0;
+    if(key == toKey("SS")) {
+        bytesShared = Util::toInt64(val);
+    } else if(key == toKey("ST")) {
+        status = Util::toInt(val);
+    } else if(key == toKey("SL")) {
+        slots = Util::toInt(val);
+    } else if(key == toKey("CT")) {
+        clientType = Util::toInt(val);
+    } else if(key == toKey("OP")) {
+        flag = FIELD_OP;
+    } else if(key == toKey("HU")) {
+        flag = FIELD_HU;
+    } else if(key == toKey("BO")) {
+        flag = FIELD_BO;
+    } else if(key == toKey("HI")) {
+        flag = FIELD_HI;
+    } else if(key == toKey("RG")) {
+        flag = FIELD_RG;
+    } else if(key == toKey("AW")) {
+        flag = FIELD_AW;
+    }
+
+    if(flag) {
+        if(val.empty())
+            fieldFlags &= ~flag;
+        else
+            fieldFlags |= flag;
+    }
 }
 
 bool Identity::supports(const string& name) const {
@@ -132,7 +223,7 @@ bool Identity::supports(const string& name) const {
 std::map<string, string> Identity::getInfo() const {
     std::map<string, string> ret;
 
-    FastLock l(cs);
+    FastLock l(getLock());
     for(InfIterC i = info.begin(); i != info.end(); ++i) {
         ret[string((char*)(&i->first), 2)] = i->second;
     }
@@ -132,10 +132,10 @@ public:
         NAT             = 0x20
     };
 
-    Identity() { }
-    Identity(const UserPtr& ptr, uint32_t aSID) : user(ptr) { setSID(aSID); }
-    Identity(const Identity& rhs) { *this = rhs; } // Use operator= since we have to lock before reading...
-    Identity& operator=(const Identity& rhs) { FastLock l(cs); user = rhs.user; info = rhs.info; return *this; }
+    Identity() : sid(0) { clearFields(); }
+    Identity(const UserPtr& ptr, uint32_t aSID) : user(ptr), sid(0) { clearFields(); setSID(aSID); }
+    Identity(const Identity& rhs) : sid(0) { clearFields(); *this = rhs; } // Use operator= since we have to lock before reading...
+    Identity& operator=(const Identity& rhs);
     ~Identity() { }
 // GS is already defined on some systems (e.g. OpenSolaris)
 #ifdef GS
@@ -151,10 +151,12 @@ public:
     GS(Connection, "CO")
 
     void setBytesShared(const string& bs) { set("SS", bs); }
-    int64_t getBytesShared() const { return Util::toInt64(get("SS")); }
+    int64_t getBytesShared() const { FastLock l(getLock()); return bytesShared; }
 
     void setStatus(const string& st) { set("ST", st); }
-    StatusFlags getStatus() const { return static_cast<StatusFlags>(Util::toInt(get("ST"))); }
+    StatusFlags getStatus() const { FastLock l(getLock()); return static_cast<StatusFlags>(status); }
+
+    int getSlots() const { FastLock l(getLock()); return slots; }
 
     void setOp(bool op) { set("OP", op ? "1" : Util::emptyString); }
     void setHub(bool hub) { set("HU", hub ? "1" : Util::emptyString); }
@@ -162,12 +164,12 @@ public:
     void setHidden(bool hidden) { set("HI", hidden ? "1" : Util::emptyString); }
     string getTag() const;
     bool supports(const string& name) const;
-    bool isHub() const { return isClientType(CT_HUB) || isSet("HU"); }
-    bool isOp() const { return isClientType(CT_OP) || isClientType(CT_SU) || isClientType(CT_OWNER) || isSet("OP"); }
-    bool isRegistered() const { return isClientType(CT_REGGED) || isSet("RG"); }
-    bool isHidden() const { return isClientType(CT_HIDDEN) || isSet("HI"); }
-    bool isBot() const { return isClientType(CT_BOT) || isSet("BO"); }
-    bool isAway() const { return isSet("AW"); }
+    bool isHub() const { return hasType(CT_HUB, FIELD_HU); }
+    bool isOp() const { return hasType(CT_OP, FIELD_OP) || hasType(CT_SU, 0) || hasType(CT_OWNER, 0); }
+    bool isRegistered() const { return hasType(CT_REGGED, FIELD_RG); }
+    bool isHidden() const { return hasType(CT_HIDDEN, FIELD_HI); }
+    bool isBot() const { return hasType(CT_BOT, FIELD_BO); }
+    bool isAway() const { return hasType(0, FIELD_AW); }
     bool isTcpActive(const Client* = NULL) const;
     bool isUdpActive() const;
     std::map<string, string> getInfo() const;
@@ -183,12 +185,43 @@ public:
     GETSET(UserPtr, user, User);
     GETSET(uint32_t, sid, SID);
 private:
-    typedef std::unordered_map<short, string> InfMap;
+    /** Fields whose presence alone is a flag */
+    enum {
+        FIELD_OP = 1 << 0,
+        FIELD_HU = 1 << 1,
+        FIELD_BO = 1 << 2,
+        FIELD_HI = 1 << 3,
+        FIELD_RG = 1 << 4,
+        FIELD_AW = 1 << 5
+    };
+
+    /** Identities lock one of these, chosen by their address, instead of a lock each */
+    enum { LOCKS = 64 };
+
+    /** Few fields are set, so a flat list beats a hash map */
+    typedef vector<pair<short, string> > InfMap;
     typedef InfMap::iterator InfIter;
     typedef InfMap::const_iterator InfIterC;
     InfMap info;
 
-    static FastCriticalSection cs;
+    /** Parsed copies of the fields read the most, kept up to date by set */
+    int64_t bytesShared;
+    int status;
+    int slots;
+    int clientType;
+    uint8_t fieldFlags;
+
+    void clearFields() { bytesShared = 0; status = 0; slots = 0; clientType = 0; fieldFlags = 0; }
+    void updateField(short key, const string& val);
+    /** @return Whether the client type has all bits of ct, or any of the fields is set */
+    bool hasType(int ct, uint8_t fields) const {
+        FastLock l(getLock());
+        return (ct != 0 && (clientType & ct) == ct) || (fieldFlags & fields) != 0;
+    }
+
+    FastCriticalSection& getLock() const { return cs[(reinterpret_cast<size_t>(this) / sizeof(Identity)) % LOCKS]; }
+
+    static FastCriticalSection cs[LOCKS];
 };
 
 class Client;
@@ -198,7 +198,7 @@ void UserConnection::supports(const StringList& feat) {
 }
 
 void UserConnection::handle(AdcCommand::STA t, const AdcCommand& c) {
-    if(c.getParameters().size() >= 2) {
+    if(c.getParamCount() >= 2) {
         const string& code = c.getParam(0);
         if(!code.empty() && code[0] - '0' == AdcCommand::SEV_FATAL) {
             fire(UserConnectionListener::ProtocolError(), this, c.getParam(1));
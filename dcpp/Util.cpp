@@ -49,17 +49,12 @@
 
 #include "CID.h"
 
-#include "FastAlloc.h"
-
 #ifdef USE_IDNA
 #include <idna.h>
 #endif
 
 namespace dcpp {
 
-#ifndef _DEBUG
-FastCriticalSection FastAllocBase::cs;
-#endif
 time_t Util::startTime = time(NULL);
 string Util::emptyString;
 wstring Util::emptyStringW;
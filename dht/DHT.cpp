@@ -462,7 +462,7 @@ namespace dht
         addNode(node, true);
 
         // do we wait for any search results from this user?
-        SearchManager::getInstance()->processSearchResults(node->getUser(), Util::toInt(node->getIdentity().get("SL")));
+        SearchManager::getInstance()->processSearchResults(node->getUser(), node->getIdentity().getSlots());
 
         if(it & PING)
         {
@@ -505,7 +505,7 @@ namespace dht
     // status message
     void DHT::handle(AdcCommand::STA, const Node::Ptr& node, AdcCommand& c) throw()
     {
-        if(c.getParameters().size() < 3)
+        if(c.getParamCount() < 3)
             return;
 
         string fromIP = node->getIdentity().getIp();
@@ -621,7 +621,7 @@ namespace dht
     // partial file request
     void DHT::handle(AdcCommand::PSR, const Node::Ptr& node, AdcCommand& c) throw()
     {
-        c.getParameters().erase(c.getParameters().begin());  // remove CID from UDP command
+        c.eraseParam(0);  // remove CID from UDP command
         dcpp::SearchManager::getInstance()->onPSR(c, node->getUser(), node->getIdentity().getIp());
     }
 
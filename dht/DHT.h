@@ -52,6 +52,9 @@ namespace dht
 
         uint16_t getPort() const { return BOOLSETTING(USE_DHT) ? socket.getPort() : 0; }
 
+        /** Returns traffic counters of the UDP socket */
+        const UDPSocket::Stats& getSocketStats() const { return socket.getStats(); }
+
         /** Process incoming command */
         void dispatch(const string& aLine, const string& ip, uint16_t port, bool isUdpKeyValid);
 
@@ -65,7 +68,7 @@ namespace dht
         bool addNode(const Node::Ptr& node, bool makeOnline);
 
         /** Returns counts of nodes available in k-buckets */
-        size_t getNodesCount() { Lock l(cs); return bucket->getNodes().size(); }
+        size_t getNodesCount() { Lock l(cs); return bucket->getNodesCount(); }
 
         /** Removes dead nodes */
         void checkExpiration(uint64_t aTick);
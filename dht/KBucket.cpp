@@ -78,23 +78,82 @@ namespace dht
     }
 
 
-    KBucket::KBucket(void)
+    namespace
+    {
+        /** Finds the user's node in the list and moves it to the end as the most recently seen one */
+        Node::Ptr touch(KBucket::NodeList& nodes, const UserPtr& u)
+        {
+            for(KBucket::NodeList::iterator it = nodes.begin(); it != nodes.end(); ++it)
+            {
+                if(u->getCID() == (*it)->getUser()->getCID())
+                {
+                    Node::Ptr node = *it;
+
+                    // put node at the end of the list
+                    nodes.erase(it);
+                    nodes.push_back(node);
+                    return node;
+                }
+            }
+
+            return NULL;
+        }
+
+        /** Puts node offline when it's dropped from the table; nodes are put online by DHT::addNode */
+        void putOffline(const Node::Ptr& node)
+        {
+            if(node->isOnline())
+            {
+                ClientManager::getInstance()->putOffline(node.get());
+                node->setOnline(false);
+                node->dec();
+            }
+        }
+
+        void putOffline(KBucket::NodeList& nodes)
+        {
+            for(KBucket::NodeList::iterator it = nodes.begin(); it != nodes.end(); ++it)
+                putOffline(*it);
+            nodes.clear();
+        }
+    }
+
+    KBucket::KBucket(void) : myCID(ClientManager::getInstance()->getMe()->getCID()), buckets(1), count(0)
     {
     }
 
     KBucket::~KBucket(void)
     {
         // empty table
-        for(NodeList::iterator it = nodes.begin(); it != nodes.end(); ++it)
+        for(std::vector<Bucket>::iterator i = buckets.begin(); i != buckets.end(); ++i)
         {
-            Node::Ptr& node = *it;
-            if(node->isOnline())
+            putOffline(i->nodes);
+            putOffline(i->replacements);
+        }
+        buckets.clear();
+    }
+
+    /*
+     * Returns index of the bucket where the node with this CID belongs
+     */
+    size_t KBucket::getBucket(const CID& cid) const
+    {
+        // length of the prefix shared with our CID
+        size_t prefix = 0;
+        for(int i = 0; i < CID::SIZE; ++i)
+        {
+            uint8_t d = cid.data()[i] ^ myCID.data()[i];
+            if(d != 0)
             {
-                ClientManager::getInstance()->putOffline(node.get());
-                node->dec();
+                for(; !(d & 0x80); d <<= 1)
+                    prefix++;
+                break;
             }
+
+            prefix += 8;
         }
-        nodes.clear();
+
+        return min(prefix, buckets.size() - 1);
     }
 
     /*
@@ -104,21 +163,11 @@ namespace dht
     {
         if(u->isSet(User::DHT)) // is this user already known in DHT?
         {
-            Node::Ptr node = NULL;
-
             // no online node found, try get from routing table
-            for(NodeList::iterator it = nodes.begin(); it != nodes.end(); ++it)
-            {
-                if(u->getCID() == (*it)->getUser()->getCID())
-                {
-                    node = *it;
-
-                    // put node at the end of the list
-                    nodes.erase(it);
-                    nodes.push_back(node);
-                    break;
-                }
-            }
+            Bucket& b = buckets[getBucket(u->getCID())];
+            Node::Ptr node = touch(b.nodes, u);
+            if(node == NULL)
+                node = touch(b.replacements, u);
 
             if(node == NULL && u->isOnline())
             {
@@ -142,8 +191,11 @@ namespace dht
                          // TODO: don't allow update when new IP already exists for different node
 
                         // erase old IP and remember new one
-                        ipMap.erase(oldIp + ":" + oldPort);
-                        ipMap.insert(ip + ":" + Util::toString(port));
+                        if(node->isInList)
+                        {
+                            ipMap.erase(oldIp + ":" + oldPort);
+                            ipMap.insert(ip + ":" + Util::toString(port));
+                        }
                     }
 
                     if(!node->isIpVerified())
@@ -177,17 +229,32 @@ namespace dht
         if(node->isInList)
             return true;    // node is already in the table
 
+        const CID& cid = node->getUser()->getCID();
+        if(cid == myCID)
+            return false;
+
         string ip = node->getIdentity().getIp();
         string port = node->getIdentity().getUdpPort();
 
         // allow only one same IP:port
-        bool isAcceptable = (ipMap.find(ip + ":" + port) == ipMap.end());
+        if(ipMap.find(ip + ":" + port) != ipMap.end())
+            return false;
+
+        // only the bucket with the closest nodes is split, the farther ones keep their long living nodes
+        size_t i = getBucket(cid);
+        while(buckets[i].nodes.size() >= K && i == buckets.size() - 1 && buckets.size() < ID_BITS)
+        {
+            split();
+            i = getBucket(cid);
+        }
 
-        if((nodes.size() < (K * ID_BITS)) && isAcceptable)
+        Bucket& b = buckets[i];
+        if(b.nodes.size() < K)
         {
-            nodes.push_back(node);
+            b.nodes.push_back(node);
             node->isInList = true;
             ipMap.insert(ip + ":" + port);
+            count++;
 
             if(DHT::getInstance())
                 DHT::getInstance()->setDirty();
@@ -195,7 +262,79 @@ namespace dht
             return true;
         }
 
-        return isAcceptable;
+        // bucket is full, keep the node in case some of the current ones dies
+        NodeList::iterator j = std::find(b.replacements.begin(), b.replacements.end(), node);
+        if(j != b.replacements.end())
+            b.replacements.erase(j);
+        else if(b.replacements.size() >= K)
+        {
+            // the least recently seen candidate makes room
+            putOffline(b.replacements.front());
+            b.replacements.pop_front();
+        }
+
+        b.replacements.push_back(node);
+        return true;
+    }
+
+    /*
+     * Splits the last bucket into two
+     */
+    void KBucket::split()
+    {
+        size_t last = buckets.size() - 1;
+        buckets.push_back(Bucket());
+
+        Bucket& from = buckets[last];
+        Bucket& to = buckets[last + 1];
+
+        // move nodes sharing longer prefix with us to the new bucket, keeping their order
+        NodeList* lists[][2] = { { &from.nodes, &to.nodes }, { &from.replacements, &to.replacements } };
+        for(size_t l = 0; l < 2; ++l)
+        {
+            NodeList& src = *lists[l][0];
+            for(NodeList::iterator i = src.begin(); i != src.end();)
+            {
+                if(getBucket((*i)->getUser()->getCID()) > last)
+                {
+                    lists[l][1]->push_back(*i);
+                    i = src.erase(i);
+                }
+                else
+                {
+                    ++i;
+                }
+            }
+        }
+
+        fill(from);
+        fill(to);
+    }
+
+    /*
+     * Moves replacement candidates to the bucket when it has free room
+     */
+    void KBucket::fill(Bucket& b)
+    {
+        while(b.nodes.size() < K && !b.replacements.empty())
+        {
+            // the most recently seen candidate is most likely still alive
+            Node::Ptr node = b.replacements.back();
+            b.replacements.pop_back();
+
+            string ipPort = node->getIdentity().getIp() + ":" + node->getIdentity().getUdpPort();
+            if(ipMap.insert(ipPort).second)
+            {
+                b.nodes.push_back(node);
+                node->isInList = true;
+                count++;
+            }
+            else
+            {
+                // another node has taken its IP:port meanwhile
+                putOffline(node);
+            }
+        }
     }
 
     /*
@@ -203,12 +342,32 @@ namespace dht
      */
     void KBucket::getClosestNodes(const CID& cid, Node::Map& closest, unsigned int max, uint8_t maxType) const
     {
-        for(NodeList::const_iterator it = nodes.begin(); it != nodes.end(); ++it)
+        // Nodes of the CID's bucket are the closest ones, then come nodes from all buckets closer to us
+        // (they differ from the CID at the same bit) and then the farther buckets, one by one.
+        // Buckets are taken whole, so stop once enough nodes closer than the rest have been seen.
+        size_t b = getBucket(cid);
+        unsigned int found = getClosestNodes(buckets[b], cid, closest, max, maxType);
+
+        if(found < max)
+        {
+            for(size_t i = b + 1; i < buckets.size(); ++i)
+                found += getClosestNodes(buckets[i], cid, closest, max, maxType);
+        }
+
+        for(size_t i = b; i-- > 0 && found < max;)
+            found += getClosestNodes(buckets[i], cid, closest, max, maxType);
+    }
+
+    unsigned int KBucket::getClosestNodes(const Bucket& b, const CID& cid, Node::Map& closest, unsigned int max, uint8_t maxType) const
+    {
+        unsigned int found = 0;
+        for(NodeList::const_iterator it = b.nodes.begin(); it != b.nodes.end(); ++it)
         {
             const Node::Ptr& node = *it;
             if(node->getType() <= maxType && node->isIpVerified() && !node->getUser()->isSet(User::PASSIVE))
             {
                 CID distance = Utils::getDistance(cid, node->getUser()->getCID());
+                found++;
 
                 if(closest.size() < max)
                 {
@@ -226,6 +385,8 @@ namespace dht
                 }
             }
         }
+
+        return found;
     }
 
     /*
@@ -235,73 +396,87 @@ namespace dht
     {
         bool dirty = false;
 
-        // we should ping oldest node from every bucket here
-        // but since we have only one bucket now, simulate it by pinging more nodes
-        unsigned int pingCount = max(K, min((int)2 * K, (int)(nodes.size() / (K * 10)) + 1)); // <-- pings 10 - 20 oldest nodes
-        unsigned int pinged = 0;
+        // ping the oldest expired nodes from every bucket, more of them when there are just a few buckets
+        unsigned int pingCount = max(1, K / (int)buckets.size());
+        dcdrun(unsigned int pinged = 0);
         dcdrun(unsigned int removed = 0);
 
-        // first, remove dead nodes
-        NodeList::iterator i = nodes.begin();
-        while(i != nodes.end())
+        for(std::vector<Bucket>::iterator b = buckets.begin(); b != buckets.end(); ++b)
         {
-            Node::Ptr& node = *i;
+            unsigned int bucketPinged = 0;
+            bool bucketDirty = false;
 
-            if(node->getType() == 4 && node->expires > 0 && node->expires <= currentTime)
+            // first, remove dead nodes
+            NodeList::iterator i = b->nodes.begin();
+            while(i != b->nodes.end())
             {
-                if(node->unique(2))
+                Node::Ptr& node = *i;
+
+                if(node->getType() == 4 && node->expires > 0 && node->expires <= currentTime)
                 {
-                    // node is dead, remove it
-                    string ip   = node->getIdentity().getIp();
-                    string port = node->getIdentity().getUdpPort();
-                    ipMap.erase(ip + ":" + port);
+                    if(node->unique(2))
+                    {
+                        // node is dead, remove it
+                        string ip   = node->getIdentity().getIp();
+                        string port = node->getIdentity().getUdpPort();
+                        ipMap.erase(ip + ":" + port);
+
+                        putOffline(node);
 
-                    if(node->isOnline())
+                        node->isInList = false;
+                        i = b->nodes.erase(i);
+                        count--;
+                        bucketDirty = true;
+
+                        dcdrun(removed++);
+                    }
+                    else
                     {
-                        ClientManager::getInstance()->putOffline(node.get());
-                        node->dec();
+                        ++i;
                     }
 
-                    i = nodes.erase(i);
-                    dirty = true;
-
-                    dcdrun(removed++);
+                    continue;
                 }
-                else
+
+                if(node->expires == 0)
+                    node->expires = currentTime;
+
+                // select the oldest expired node
+                if(bucketPinged < pingCount && node->getType() < 4 && node->expires <= currentTime)
                 {
-                    ++i;
+                    // ping the oldest (expired) node
+                    node->setTimeout(currentTime);
+                    DHT::getInstance()->info(node->getIdentity().getIp(), static_cast<uint16_t>(Util::toInt(node->getIdentity().getUdpPort())), DHT::PING, node->getUser()->getCID(), node->getUdpKey());
+                    bucketPinged++;
+                    dcdrun(pinged++);
                 }
 
-                continue;
+                ++i;
             }
 
-            if(node->expires == 0)
-                node->expires = currentTime;
-
-            // select the oldest expired node
-            if(pinged < pingCount && node->getType() < 4 && node->expires <= currentTime)
+            // replace dead nodes with the candidates
+            if(bucketDirty)
             {
-                // ping the oldest (expired) node
-                node->setTimeout(currentTime);
-                DHT::getInstance()->info(node->getIdentity().getIp(), static_cast<uint16_t>(Util::toInt(node->getIdentity().getUdpPort())), DHT::PING, node->getUser()->getCID(), node->getUdpKey());
-                pinged++;
+                fill(*b);
+                dirty = true;
             }
-
-            ++i;
         }
 
 #ifdef _DEBUG
         int verified = 0; int types[5] = { 0 };
-        for(NodeList::const_iterator j = nodes.begin(); j != nodes.end(); ++j)
+        for(std::vector<Bucket>::const_iterator b = buckets.begin(); b != buckets.end(); ++b)
         {
-            Node::Ptr n = *j;
-            if(n->isIpVerified()) verified++;
+            for(NodeList::const_iterator j = b->nodes.begin(); j != b->nodes.end(); ++j)
+            {
+                Node::Ptr n = *j;
+                if(n->isIpVerified()) verified++;
 
-            dcassert(n->getType() >= 0 && n->getType() <= 4);
-            types[n->getType()]++;
+                dcassert(n->getType() >= 0 && n->getType() <= 4);
+                types[n->getType()]++;
+            }
         }
 
-        dcdebug("DHT Nodes: %d (%d verified), Types: %d/%d/%d/%d/%d, pinged %d of %d, removed %d\n", nodes.size(), verified, types[0], types[1], types[2], types[3], types[4], pinged, pingCount, removed);
+        dcdebug("DHT Nodes: %d (%d verified) in %d buckets, Types: %d/%d/%d/%d/%d, pinged %d, removed %d\n", count, verified, buckets.size(), types[0], types[1], types[2], types[3], types[4], pinged, removed);
 #endif
 
         return dirty;
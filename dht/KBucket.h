@@ -71,6 +71,12 @@ namespace dht
         bool        online; // getUser()->isOnline() returns true when node is online in any hub, we need info when he is online in DHT
     };
 
+    /**
+     * Routing table. Nodes are kept in k-buckets by the length of the prefix their CID shares with
+     * ours: bucket i holds nodes differing from us first in bit i, the last bucket holds all nodes
+     * closer than that and is split whenever it overflows. Each bucket keeps at most K nodes, least
+     * recently seen first, plus up to K replacement candidates that take the place of dead nodes.
+     */
     class KBucket
     {
     public:
@@ -88,8 +94,8 @@ namespace dht
         /** Finds "max" closest nodes and stores them to the list */
         void getClosestNodes(const CID& cid, Node::Map& closest, unsigned int max, uint8_t maxType) const;
 
-        /** Return list of all nodes in this bucket */
-        const NodeList& getNodes() const { return nodes; }
+        /** Return count of nodes in the routing table, without replacement candidates */
+        size_t getNodesCount() const { return count; }
 
         /** Removes dead nodes */
         bool checkExpiration(uint64_t currentTime);
@@ -102,10 +108,37 @@ namespace dht
 
     private:
 
-        /** List of nodes in this bucket */
-        NodeList nodes;
+        struct Bucket
+        {
+            /** Nodes in this bucket, least recently seen first */
+            NodeList nodes;
 
-        /** List of known IPs in this bucket */
+            /** Nodes which didn't fit, least recently seen first */
+            NodeList replacements;
+        };
+
+        /** Returns index of the bucket where the node with this CID belongs */
+        size_t getBucket(const CID& cid) const;
+
+        /** Splits the last bucket into two */
+        void split();
+
+        /** Adds nodes from the bucket to closest, returns count of nodes matching the criteria */
+        unsigned int getClosestNodes(const Bucket& b, const CID& cid, Node::Map& closest, unsigned int max, uint8_t maxType) const;
+
+        /** Moves replacement candidates to the bucket when it has free room */
+        void fill(Bucket& b);
+
+        /** Our CID, buckets are ordered by the distance from it */
+        const CID myCID;
+
+        /** Buckets from the farthest to the closest one */
+        std::vector<Bucket> buckets;
+
+        /** Count of nodes in all buckets */
+        size_t count;
+
+        /** List of known IPs in the routing table */
         StringSet ipMap;
 
     };
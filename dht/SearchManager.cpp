@@ -379,7 +379,7 @@ namespace dht
                         }
                         else
                         {
-                            sr->setSlots(Util::toInt(source->getIdentity().get("SL")));
+                            sr->setSlots(source->getIdentity().getSlots());
                             dcpp::SearchManager::getInstance()->fire(SearchManagerListener::SR(), sr);
                         }
                     }
@@ -437,18 +437,23 @@ namespace dht
      */
     void SearchManager::publishFile(const Node::Map& nodes, const string& tth, int64_t size, bool partial)
     {
+        AdcCommand pub(AdcCommand::CMD_PUB, AdcCommand::TYPE_UDP);
+        pub.addParam("TR", tth);
+        pub.addParam("SI", Util::toString(size));
+
+        if(partial)
+            pub.addParam("PF", "1");
+
+        // the parameters common to all nodes are serialized once, each copy only adds its own
+        pub.preserialize();
+
         // send PUB command to K nodes
         int n = K;
         for(Node::Map::const_iterator i = nodes.begin(); i != nodes.end() && n > 0; ++i, --n)
         {
             const Node::Ptr& node = i->second;
 
-            AdcCommand cmd(AdcCommand::CMD_PUB, AdcCommand::TYPE_UDP);
-            cmd.addParam("TR", tth);
-            cmd.addParam("SI", Util::toString(size));
-
-            if(partial)
-                cmd.addParam("PF", "1");
+            AdcCommand cmd(pub);
 
             //i->second->setTimeout();
             DHT::getInstance()->send(cmd, node->getIdentity().getIp(), static_cast<uint16_t>(Util::toInt(node->getIdentity().getUdpPort())), node->getUser()->getCID(), node->getUdpKey());
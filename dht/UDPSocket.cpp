@@ -36,13 +36,15 @@ namespace dht
 {
 
     #define BUFSIZE                 16384
+    #define BATCH                   16      // packets read or sent at once
     #define MAGICVALUE_UDP          0x5b
 
-    UDPSocket::UDPSocket(void) : stop(false), port(0), delay(100)
-#ifdef _DEBUG
-        , sentBytes(0), receivedBytes(0), sentPackets(0), receivedPackets(0)
-#endif
+    UDPSocket::UDPSocket(void) : stop(false), port(0), delay(100), inBuf(BATCH * BUFSIZE), unpackBuf(BUFSIZE), compressionLevel(Z_BEST_COMPRESSION)
     {
+        memset(&deflater, 0, sizeof(deflater));
+        memset(&inflater, 0, sizeof(inflater));
+        deflateInit(&deflater, compressionLevel);
+        inflateInit(&inflater);
     }
 
     UDPSocket::~UDPSocket(void)
@@ -51,9 +53,10 @@ namespace dht
 
         for_each(sendQueue.begin(), sendQueue.end(), DeleteFunction());
 
-#ifdef _DEBUG
-        dcdebug("DHT stats, received: %d bytes, sent: %d bytes\n", receivedBytes, sentBytes);
-#endif
+        deflateEnd(&deflater);
+        inflateEnd(&inflater);
+
+        dcdebug("DHT stats, received: %d bytes, sent: %d bytes\n", (int)stats.receivedBytes, (int)stats.sentBytes);
     }
 
     /*
@@ -103,55 +106,72 @@ namespace dht
     {
         if(socket->wait(delay, Socket::WAIT_READ) == Socket::WAIT_READ)
         {
-            sockaddr_in remoteAddr = { 0 };
-            boost::scoped_array<uint8_t> buf(new uint8_t[BUFSIZE]);
-            int len = socket->read(&buf[0], BUFSIZE, remoteAddr);
-            dcdrun(receivedBytes += len);
-            dcdrun(receivedPackets++);
+            // take all waiting packets at once
+            Socket::Datagram packets[BATCH];
+            for(int i = 0; i < BATCH; ++i)
+            {
+                memset(&packets[i].addr, 0, sizeof(packets[i].addr));
+                packets[i].buf = &inBuf[i * BUFSIZE];
+                packets[i].len = BUFSIZE;
+            }
 
-            if(len > 1)
+            int n = socket->readPackets(packets, BATCH);
+            stats.receivedPackets += n;
+
+            for(int i = 0; i < n; ++i)
             {
-                bool isUdpKeyValid = false;
-                if(buf[0] != ADC_PACKED_PACKET_HEADER && buf[0] != ADC_PACKET_HEADER)
-                {
-                    // it seems to be encrypted packet
-                    if(!decryptPacket(&buf[0], len, inet_ntoa(remoteAddr.sin_addr), isUdpKeyValid))
-                        return;
-                }
-                //else
-                //  return; // non-encrypted packets are forbidden
+                stats.receivedBytes += packets[i].len;
+                if(!processPacket(packets[i].buf, packets[i].len, packets[i].addr))
+                    stats.droppedPackets++;
+            }
+        }
+    }
 
-                unsigned long destLen = BUFSIZE; // what size should be reserved?
-                boost::scoped_array<uint8_t> destBuf(new uint8_t[destLen]);
-                if(buf[0] == ADC_PACKED_PACKET_HEADER) // is this compressed packet?
-                {
-                    if(!decompressPacket(destBuf.get(), destLen, buf.get(), len))
-                        return;
-                }
-                else
-                {
-                    memcpy(destBuf.get(), buf.get(), len);
-                    destLen = len;
-                }
+    bool UDPSocket::processPacket(uint8_t* buf, int len, const sockaddr_in& remoteAddr)
+    {
+        if(len <= 1)
+            return false;
 
-                // process decompressed packet
-                string s((char*)destBuf.get(), destLen);
-                if(s[0] == ADC_PACKET_HEADER && s[s.length() - 1] == ADC_PACKET_FOOTER) // is it valid ADC command?
-                {
-                    string ip = inet_ntoa(remoteAddr.sin_addr);
-                    uint16_t port = ntohs(remoteAddr.sin_port);
-                    COMMAND_DEBUG(s.substr(0, s.length() - 1), DebugManager::DHT_IN,  ip + ":" + Util::toString(port));
-                    DHT::getInstance()->dispatch(s.substr(0, s.length() - 1), ip, port, isUdpKeyValid);
-                }
+        string ip = inet_ntoa(remoteAddr.sin_addr);
 
-                Thread::sleep(25);
-            }
+        bool isUdpKeyValid = false;
+        if(buf[0] != ADC_PACKED_PACKET_HEADER && buf[0] != ADC_PACKET_HEADER)
+        {
+            // it seems to be encrypted packet
+            if(!decryptPacket(buf, len, ip, isUdpKeyValid))
+                return false;
+        }
+        //else
+        //  return false; // non-encrypted packets are forbidden
+
+        const uint8_t* data = buf;
+        unsigned long dataLen = len;
+        if(len > 0 && buf[0] == ADC_PACKED_PACKET_HEADER) // is this compressed packet?
+        {
+            dataLen = unpackBuf.size();
+            if(!decompressPacket(&unpackBuf[0], dataLen, buf, len))
+                return false;
+
+            data = &unpackBuf[0];
         }
+
+        // process decompressed packet
+        if(dataLen == 0 || data[0] != ADC_PACKET_HEADER || data[dataLen - 1] != ADC_PACKET_FOOTER) // is it valid ADC command?
+            return false;
+
+        string s((const char*)data, dataLen - 1);
+        uint16_t port = ntohs(remoteAddr.sin_port);
+        COMMAND_DEBUG(s, DebugManager::DHT_IN,  ip + ":" + Util::toString(port));
+        DHT::getInstance()->dispatch(s, ip, port, isUdpKeyValid);
+
+        return true;
     }
 
     void UDPSocket::checkOutgoing(uint64_t& timer) throw(SocketException)
     {
-        std::unique_ptr<Packet> packet;
+        std::unique_ptr<Packet> packets[BATCH];
+        size_t n = 0;
+        size_t backlog = 0;
         uint64_t now = GET_TICK();
 
         {
@@ -160,38 +180,112 @@ namespace dht
             size_t queueSize = sendQueue.size();
             if(queueSize && (now - timer > delay))
             {
-                // take the first packet in queue
-                packet.reset(sendQueue.front());
-                sendQueue.pop_front();
+                n = 1;
 
                 //dcdebug("Sending DHT %s packet: %d bytes, %d ms, queue size: %d\n", packet->cmdChar, packet->length, (uint32_t)(now - timer), queueSize);
 
                 if(queueSize > 9)
+                {
+                    // long queue is sent at queueSize packets per second, take all packets due since the last time
+                    n = delay ? static_cast<size_t>((now - timer) / delay) : BATCH;
+                    n = std::max((size_t)1, std::min(n, std::min(queueSize, (size_t)BATCH)));
+
                     delay = 1000 / queueSize;
+                }
                 timer = now;
+
+                for(size_t i = 0; i < n; ++i)
+                {
+                    packets[i].reset(sendQueue.front());
+                    sendQueue.pop_front();
+                }
+
+                backlog = sendQueue.size();
             }
         }
 
-        if(packet.get())
+        if(n == 0)
+            return;
+
+        // compress faster while there are more packets waiting than can be sent at once
+        int level = backlog > BATCH ? Z_BEST_SPEED : Z_BEST_COMPRESSION;
+        if(level != compressionLevel)
+        {
+            deflateReset(&deflater);
+            if(deflateParams(&deflater, level, Z_DEFAULT_STRATEGY) == Z_OK)
+                compressionLevel = level;
+        }
+
+        size_t offsets[BATCH + 1];
+        offsets[0] = 0;
+        for(size_t i = 0; i < n; ++i)
+            offsets[i + 1] = offsets[i] + compressBound(packets[i]->data.length()) + 2;
+
+        if(outBuf.size() < offsets[n])
+            outBuf.resize(offsets[n]);
+
+        Socket::Datagram datagrams[BATCH];
+        const Packet* sources[BATCH];
+        size_t count = 0;
+        for(size_t i = 0; i < n; ++i)
         {
-            try
+            const Packet& packet = *packets[i];
+            Socket::Datagram& d = datagrams[count];
+
+            memset(&d.addr, 0, sizeof(d.addr));
+            d.addr.sin_family = AF_INET;
+            d.addr.sin_port = htons(packet.port);
+            d.addr.sin_addr.s_addr = inet_addr(packet.ip.c_str());
+            if(packet.port == 0 || d.addr.sin_addr.s_addr == INADDR_NONE)
             {
-                unsigned long length = compressBound(packet->data.length()) + 2;
-                std::unique_ptr<uint8_t[]> data(new uint8_t[length]);
+                stats.failedPackets++;
+                continue;
+            }
+
+            unsigned long length = offsets[i + 1] - offsets[i];
+            d.buf = &outBuf[offsets[i]];
 
-                // compress packet
-                compressPacket(packet->data, data.get(), length);
+            // compress packet
+            compressPacket(packet.data, d.buf, length);
 
-                // encrypt packet
-                encryptPacket(packet->targetCID, packet->udpKey, data.get(), length);
+            // encrypt packet
+            encryptPacket(packet.targetCID, packet.udpKey, d.buf, length);
 
-                dcdrun(sentBytes += packet->data.length());
-                dcdrun(sentPackets++);
-                socket->writeTo(packet->ip, packet->port, data.get(), length);
+            d.len = static_cast<int>(length);
+            sources[count++] = &packet;
+        }
+
+        // socks relay needs packets to be wrapped one by one
+        bool proxy = SETTING(OUTGOING_CONNECTIONS) == SettingsManager::OUTGOING_SOCKS5;
+
+        size_t sent = 0;
+        while(sent < count)
+        {
+            try
+            {
+                if(proxy)
+                {
+                    socket->writeTo(sources[sent]->ip, sources[sent]->port, datagrams[sent].buf, datagrams[sent].len);
+                    stats.sentBytes += datagrams[sent].len;
+                    stats.sentPackets++;
+                    sent++;
+                }
+                else
+                {
+                    int i = socket->writePackets(&datagrams[sent], static_cast<int>(count - sent));
+                    for(int j = 0; j < i; ++j)
+                        stats.sentBytes += datagrams[sent + j].len;
+                    stats.sentPackets += i;
+                    sent += i;
+                }
             }
             catch(SocketException& e)
             {
                 dcdebug("DHT::run Write error: %s\n", e.getError().c_str());
+
+                // skip the packet which failed
+                stats.failedPackets++;
+                sent++;
             }
         }
     }
@@ -219,8 +313,26 @@ namespace dht
         // antiflood variables
         uint64_t timer = GET_TICK();
 
+        // packet rates
+        uint64_t rateTimer = timer;
+        uint64_t lastReceived = stats.receivedPackets;
+        uint64_t lastSent = stats.sentPackets;
+
         while(!stop)
         {
+            uint64_t now = GET_TICK();
+            if(now - rateTimer >= 1000)
+            {
+                uint64_t received = stats.receivedPackets;
+                uint64_t sent = stats.sentPackets;
+                stats.receivedRate = static_cast<uint32_t>((received - lastReceived) * 1000 / (now - rateTimer));
+                stats.sentRate = static_cast<uint32_t>((sent - lastSent) * 1000 / (now - rateTimer));
+
+                rateTimer = now;
+                lastReceived = received;
+                lastSent = sent;
+            }
+
             try
             {
                 // check outgoing queue
@@ -294,11 +406,17 @@ namespace dht
 
     void UDPSocket::compressPacket(const string& data, uint8_t* destBuf, unsigned long& destSize)
     {
-        int result = compress2(destBuf + 1, &destSize, (uint8_t*)data.data(), data.length(), Z_BEST_COMPRESSION);
-        if(result == Z_OK && destSize <= data.length())
+        deflateReset(&deflater);
+        deflater.next_in = (Bytef*)data.data();
+        deflater.avail_in = data.length();
+        deflater.next_out = destBuf + 1;
+        deflater.avail_out = destSize - 1;
+
+        int result = deflate(&deflater, Z_FINISH);
+        if(result == Z_STREAM_END && deflater.total_out <= data.length())
         {
             destBuf[0] = ADC_PACKED_PACKET_HEADER;
-            destSize += 1;
+            destSize = deflater.total_out + 1;
         }
         else
         {
@@ -340,13 +458,20 @@ namespace dht
     bool UDPSocket::decompressPacket(uint8_t* destBuf, unsigned long& destLen, const uint8_t* buf, size_t len)
     {
         // decompress incoming packet
-        int result = uncompress(destBuf, &destLen, buf + 1, len - 1);
-        if(result != Z_OK)
+        inflateReset(&inflater);
+        inflater.next_in = (Bytef*)buf + 1;
+        inflater.avail_in = len - 1;
+        inflater.next_out = destBuf;
+        inflater.avail_out = destLen;
+
+        int result = inflate(&inflater, Z_FINISH);
+        if(result != Z_STREAM_END)
         {
             // decompression error!!!
             return false;
         }
 
+        destLen = inflater.total_out;
         return true;
     }
 
@@ -24,6 +24,8 @@
 #include "dcpp/MerkleTree.h"
 #include "dcpp/Socket.h"
 #include "dcpp/Thread.h"
+#include <atomic>
+#include <zlib.h>
 
 namespace dht
 {
@@ -61,6 +63,26 @@ namespace dht
         UDPSocket(void);
         ~UDPSocket(void);
 
+        struct Stats
+        {
+            Stats() : receivedPackets(0), sentPackets(0), receivedBytes(0), sentBytes(0), droppedPackets(0), failedPackets(0), receivedRate(0), sentRate(0) { }
+
+            std::atomic<uint64_t> receivedPackets;
+            std::atomic<uint64_t> sentPackets;
+            std::atomic<uint64_t> receivedBytes;
+            std::atomic<uint64_t> sentBytes;
+
+            /** Incoming packets which couldn't be decrypted or unpacked or weren't ADC commands */
+            std::atomic<uint64_t> droppedPackets;
+
+            /** Outgoing packets which couldn't be sent */
+            std::atomic<uint64_t> failedPackets;
+
+            /** Packets per second, updated every second */
+            std::atomic<uint32_t> receivedRate;
+            std::atomic<uint32_t> sentRate;
+        };
+
         /** Disconnects UDP socket */
         void disconnect() throw();
 
@@ -70,6 +92,9 @@ namespace dht
         /** Returns port used to listening to UDP socket */
         uint16_t getPort() const { return port; }
 
+        /** Returns traffic counters of this socket */
+        const Stats& getStats() const { return stats; }
+
         /** Sends command to ip and port */
         void send(AdcCommand& cmd, const string& ip, uint16_t port, const CID& targetCID, const CID& udpKey);
 
@@ -92,14 +117,21 @@ namespace dht
         /** Locks access to sending queue */
         CriticalSection cs;
 
-#ifdef _DEBUG
-        // debug constants to optimize bandwidth
-        size_t sentBytes;
-        size_t receivedBytes;
+        Stats stats;
+
+        /** Buffers for packets read at once and for the unpacked packet being processed */
+        std::vector<uint8_t> inBuf;
+        std::vector<uint8_t> unpackBuf;
+
+        /** Buffer for packets sent at once */
+        std::vector<uint8_t> outBuf;
 
-        size_t sentPackets;
-        size_t receivedPackets;
-#endif
+        /** Streams kept between packets, so that zlib doesn't allocate its state for every one */
+        z_stream deflater;
+        z_stream inflater;
+
+        /** Level used by the deflater, lowered while the send queue is long */
+        int compressionLevel;
 
         /** Thread for receiving UDP packets */
         int run();
@@ -107,6 +139,8 @@ namespace dht
         void checkIncoming() throw(SocketException);
         void checkOutgoing(uint64_t& timer) throw(SocketException);
 
+        bool processPacket(uint8_t* buf, int len, const sockaddr_in& remoteAddr);
+
         void compressPacket(const string& data, uint8_t* destBuf, unsigned long& destSize);
         void encryptPacket(const CID& targetCID, const CID& udpKey, uint8_t* destBuf, unsigned long& destSize);
 
@@ -16,6 +16,10 @@
 #include "ServerThread.h"
 #include "VersionGlobal.h"
 #include "dcpp/format.h"
+#include "dcpp/FastAlloc.h"
+#ifdef WITH_DHT
+#include "dht/DHT.h"
+#endif
 #include "json/jsonrpc-cpp/jsonrpc_common.h"
 
 using namespace std;
@@ -411,6 +415,53 @@ bool JsonRpcMethods::ShowRatio(const Json::Value& root, Json::Value& response)
     return true;
 }
 
+bool JsonRpcMethods::ShowAllocStats(const Json::Value& root, Json::Value& response)
+{
+    if (isDebug) std::cout << "ShowAllocStats (root): " << root << std::endl;
+    response["jsonrpc"] = "2.0";
+    response["id"] = root["id"];
+    response["result"] = Json::Value(Json::arrayValue);
+#ifndef _DEBUG
+    vector<FastAllocBase::Stats> stats;
+    FastAllocBase::getStats(stats);
+    for (auto i = stats.begin(); i != stats.end(); ++i) {
+        Json::Value parameters;
+        parameters["type"] = i->name;
+        parameters["size"] = Json::Value::UInt(i->size);
+        parameters["allocated"] = Json::Value::UInt64(i->allocated);
+        parameters["live"] = Json::Value::UInt64(i->live);
+        parameters["live_bytes"] = Json::Value::UInt64(i->live * i->size);
+        response["result"].append(parameters);
+    }
+#endif
+    if (isDebug) std::cout << "ShowAllocStats (response): " << response << std::endl;
+    return true;
+}
+
+bool JsonRpcMethods::ShowDHTStats(const Json::Value& root, Json::Value& response)
+{
+    if (isDebug) std::cout << "ShowDHTStats (root): " << root << std::endl;
+    response["jsonrpc"] = "2.0";
+    response["id"] = root["id"];
+    response["result"] = Json::Value(Json::objectValue);
+#ifdef WITH_DHT
+    if (BOOLSETTING(USE_DHT) && dht::DHT::getInstance()) {
+        const dht::UDPSocket::Stats& stats = dht::DHT::getInstance()->getSocketStats();
+        response["result"]["nodes"] = Json::Value::UInt64(dht::DHT::getInstance()->getNodesCount());
+        response["result"]["received_packets"] = Json::Value::UInt64(stats.receivedPackets);
+        response["result"]["sent_packets"] = Json::Value::UInt64(stats.sentPackets);
+        response["result"]["received_bytes"] = Json::Value::UInt64(stats.receivedBytes);
+        response["result"]["sent_bytes"] = Json::Value::UInt64(stats.sentBytes);
+        response["result"]["dropped_packets"] = Json::Value::UInt64(stats.droppedPackets);
+        response["result"]["failed_packets"] = Json::Value::UInt64(stats.failedPackets);
+        response["result"]["received_rate"] = Json::Value::UInt(stats.receivedRate);
+        response["result"]["sent_rate"] = Json::Value::UInt(stats.sentRate);
+    }
+#endif
+    if (isDebug) std::cout << "ShowDHTStats (response): " << response << std::endl;
+    return true;
+}
+
 bool JsonRpcMethods::SetPriorityQueueItem(const Json::Value& root, Json::Value& response) {
     if (isDebug) std::cout << "SetPriorityQueueItem (root): " << root << std::endl;
     response["jsonrpc"] = "2.0";
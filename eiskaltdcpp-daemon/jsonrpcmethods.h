@@ -34,6 +34,8 @@ class JsonRpcMethods
     bool ReturnSearchResults(const Json::Value& root, Json::Value& response);
     bool ShowVersion(const Json::Value& root, Json::Value& response);
     bool ShowRatio(const Json::Value& root, Json::Value& response);
+    bool ShowAllocStats(const Json::Value& root, Json::Value& response);
+    bool ShowDHTStats(const Json::Value& root, Json::Value& response);
     bool SetPriorityQueueItem(const Json::Value& root, Json::Value& response);
     bool MoveQueueItem(const Json::Value& root, Json::Value& response);
     bool RemoveQueueItem(const Json::Value& root, Json::Value& response);
@@ -35,10 +35,10 @@ QString HashManagerScript::getTTH(const QString &aFileName, quint64 size) const{
 }
 
 QString HashManagerScript::getTTH(const QString &aFileName) const{
-    const dcpp::TTHValue *v = HM->getFileTTHif(_tq(aFileName));
+    dcpp::TTHValue v;
 
-    if (v)
-        return _q(v->toBase32());
+    if (HM->getFileTTHif(_tq(aFileName), v))
+        return _q(v.toBase32());
     else
         return "";
 }
@@ -351,12 +351,12 @@ static QScriptValue getMagnets(QScriptContext *ctx, QScriptEngine *engine){
         if (!file.exists())
             continue;
 
-        const dcpp::TTHValue *tth = dcpp::HashManager::getInstance()->getFileTTHif(_tq(f));
+        dcpp::TTHValue tth;
 
-        if (tth)
+        if (dcpp::HashManager::getInstance()->getFileTTHif(_tq(f), tth))
             magnets.push_back(WulforUtil::getInstance()->makeMagnet(f.split(QDir::separator(), QString::SkipEmptyParts).last(),
                                                                     file.size(),
-                                                                    _q(tth->toBase32())
+                                                                    _q(tth.toBase32())
                                                                     ));
     }
 
@@ -260,13 +260,14 @@ void ChatEdit::dropEvent(QDropEvent *e)
                 QString str = QDir::toNativeSeparators( fi.absoluteFilePath() );
 
                 if ( fi.exists() && fi.isFile() && !str.isEmpty() ) {
-                    const TTHValue *tth = HashManager::getInstance()->getFileTTHif(str.toStdString());
-                    if ( !tth ) {
+                    TTHValue tth;
+                    bool found = HashManager::getInstance()->getFileTTHif(str.toStdString(), tth);
+                    if ( !found ) {
                         str = QDir::toNativeSeparators( fi.canonicalFilePath() ); // try to follow symlinks
-                        tth = HashManager::getInstance()->getFileTTHif(str.toStdString());
+                        found = HashManager::getInstance()->getFileTTHif(str.toStdString(), tth);
                     }
-                    if (tth)
-                        urlStr = WulforUtil::getInstance()->makeMagnet(fi.fileName(), fi.size(), _q(tth->toBase32()));
+                    if (found)
+                        urlStr = WulforUtil::getInstance()->makeMagnet(fi.fileName(), fi.size(), _q(tth.toBase32()));
                 }
             };
 
@@ -372,7 +372,8 @@ bool FileBrowserModel::canFetchMore(const QModelIndex &parent) const{
 
     FileBrowserItem *item = parent.isValid()? static_cast<FileBrowserItem*>(parent.internalPointer()) : rootItem;
 
-    return (item->dir && (item->dir->directories.size() != item->childCount()));
+    // The count is known without parsing a lazily loaded directory; fetchMore() loads it
+    return (item->dir && (item->dir->getDirectoryCount() != static_cast<size_t>(item->childCount())));
 }
 
 void FileBrowserModel::fetchBranch(const QModelIndex &parent, dcpp::DirectoryListing::Directory *dir){
@@ -407,7 +408,7 @@ bool FileBrowserModel::hasChildren(const QModelIndex &parent) const{
 
     FileBrowserItem *item = static_cast<FileBrowserItem*>(parent.internalPointer());
 
-    return (item->dir && !item->dir->directories.empty());
+    return (item->dir && item->dir->getDirectoryCount() != 0);
 }
 
 void FileBrowserModel::fetchMore(const QModelIndex &parent){
@@ -421,6 +422,7 @@ void FileBrowserModel::fetchMore(const QModelIndex &parent){
         DirectoryListing::Directory::Iter it;
         QModelIndex i = createIndexForItem(item);
 
+        item->dir->load();
         for (const auto &dir : item->dir->directories) //loading child directories
             fetchBranch(i, dir);
 
@@ -555,6 +557,9 @@ FileBrowserItem *FileBrowserModel::createRootForPath(const QString &path, FileBr
 
         bool found = false;
 
+        if (root->dir)
+            root->dir->load();
+
         if (root->dir && !root->dir->directories.empty() && !root->childCount()) //Load child items
             fetchMore(createIndexForItem(root));
 
@@ -61,9 +61,9 @@ void FileHasher::slotStart(){
 
     pushButton_RUN->setEnabled(false);
     HashManager  *HM = HashManager::getInstance();
-    const TTHValue *tth= HM->getFileTTHif(_tq(file));
-    if (tth) {
-        lineEdit_HASH->setText(_q(tth->toBase32()));
+    TTHValue tth;
+    if (HM->getFileTTHif(_tq(file), tth)) {
+        lineEdit_HASH->setText(_q(tth.toBase32()));
         pushButton_RUN->setEnabled(true);
     } else {
         if (hasher){
@@ -781,9 +781,9 @@ void HubFrame::LinkParser::parseForMagnetAlias(QString &output){
         if (!rx.cap(2).isEmpty())
             name = rx.cap(2);
 
-        const TTHValue *tth = HashManager::getInstance()->getFileTTHif(_tq(fi.absoluteFilePath()));
-        if (tth) {
-            QString urlStr = WulforUtil::getInstance()->makeMagnet(name, fi.size(), _q(tth->toBase32()));
+        TTHValue tth;
+        if (HashManager::getInstance()->getFileTTHif(_tq(fi.absoluteFilePath()), tth)) {
+            QString urlStr = WulforUtil::getInstance()->makeMagnet(name, fi.size(), _q(tth.toBase32()));
             output.replace(pos, rx.cap(1).length(), urlStr);
         } else {
             output.replace(pos, rx.cap(1).length(), tr("not shared"));
@@ -442,7 +442,7 @@ QMenu  *ShareBrowser::getMenu(){
 
 void ShareBrowser::buildList(){
     try {
-        listing.loadFile(file.toStdString());
+        listing.loadFile(file.toStdString(), true);
         listing.getRoot()->setName(nick.toStdString());
         ADLSearchManager::getInstance()->matchListing(listing);
     }
@@ -573,6 +573,8 @@ void ShareBrowser::changeRoot(dcpp::DirectoryListing::Directory *root){
 
     current_size = 0;
 
+    root->load();
+
     for (const auto &dir : root->directories){
         FileBrowserItem *child;
         quint64 size = 0;
@@ -133,6 +133,7 @@ void ShareBrowserSearch::findMatches(FileBrowserItem *item){
             }
             findMatches(i);
             if (type_search == 0 || type_search == 2) {
+                i->dir->load();
                 DirectoryListing::File::List *files = &i->dir->files;
                 DirectoryListing::File::Iter it_file;
 
@@ -355,10 +355,10 @@ QString TransferView::getTTHFromItem(const TransferViewItem *item){
     if (item->download)
         tth_str = item->tth;
     else {
-        const TTHValue *tth = dcpp::HashManager::getInstance()->getFileTTHif(_tq(item->target));
+        TTHValue tth;
 
-        if (tth)
-            tth_str = _q(tth->toBase32());
+        if (dcpp::HashManager::getInstance()->getFileTTHif(_tq(item->target), tth))
+            tth_str = _q(tth.toBase32());
     }
 
     return tth_str;
@@ -520,10 +520,10 @@ void TransferView::slotContextMenu(const QPoint &){
 
                 if (tth_str.isEmpty()) {
                     QString str = QDir::toNativeSeparators(fi.canonicalFilePath() ); // try to follow symlinks
-                    const TTHValue *tth = HashManager::getInstance()->getFileTTHif(str.toStdString());
+                    TTHValue tth;
 
-                    if (tth)
-                        tth_str = _q(tth->toBase32());
+                    if (HashManager::getInstance()->getFileTTHif(str.toStdString(), tth))
+                        tth_str = _q(tth.toBase32());
                 }
 
                 if (!tth_str.isEmpty())